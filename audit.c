@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <openssl/sha.h>
+#include "entry.h"
+#include "format.h"
+#include "state.h"
+#include "db.h"
+#include "pool.h"
+#include "wordlist.h"
+#include "strength.h"
+#include "hashfile.h"
+#include "audit.h"
+#include "utils.h"
+
+/* Entry being audited. Password is wiped as soon as
+ * it has been scored.
+ */
+typedef struct _audit_entry
+{
+    char *id;
+    char *title;
+    char *user;
+    char *url;
+    char *password;
+    Strength_t strength;
+
+} Audit_entry_t;
+
+typedef struct _audit_batch
+{
+    Dictionary_t *dict;
+    Audit_entry_t entries[AUDIT_BATCH_SIZE];
+    int count;
+
+} Audit_batch_t;
+
+/* Batches are submitted to the pool while rows are still
+ * being read from the database.
+ */
+typedef struct _strength_audit
+{
+    Pool_t *pool;
+    Dictionary_t dict;
+    Audit_batch_t **batches;
+    int batch_count;
+    int batch_alloc;
+
+} Strength_audit_t;
+
+static char *copy_value(const char *value)
+{
+    return strdup(value ? value : "");
+}
+
+static void wipe_string(char *str)
+{
+    if(str)
+    {
+        memset(str, 0, strlen(str));
+        free(str);
+    }
+}
+
+/* Runs in a worker thread */
+static void score_batch(void *data)
+{
+    Audit_batch_t *batch = data;
+
+    for(int i = 0; i < batch->count; i++)
+    {
+        Audit_entry_t *entry = &batch->entries[i];
+
+        strength_estimate(batch->dict, entry->password, &entry->strength);
+        wipe_string(entry->password);
+        entry->password = NULL;
+    }
+}
+
+static void collect_entry(void *data, const char **values)
+{
+    Strength_audit_t *audit = data;
+    Audit_batch_t *batch = NULL;
+
+    if(audit->batch_count > 0)
+        batch = audit->batches[audit->batch_count - 1];
+
+    //Full batch is scored while more rows are read
+    if(!batch || batch->count == AUDIT_BATCH_SIZE)
+    {
+        if(batch)
+            pool_submit(audit->pool, score_batch, batch);
+
+        if(audit->batch_count == audit->batch_alloc)
+        {
+            audit->batch_alloc = audit->batch_alloc ? audit->batch_alloc * 2 : 16;
+            audit->batches = trealloc(audit->batches,
+                                      audit->batch_alloc * sizeof(Audit_batch_t *));
+        }
+
+        batch = tmalloc(sizeof(Audit_batch_t));
+        batch->dict = &audit->dict;
+        batch->count = 0;
+        audit->batches[audit->batch_count++] = batch;
+    }
+
+    Audit_entry_t *entry = &batch->entries[batch->count++];
+
+    entry->id = copy_value(values[FIELD_ID]);
+    entry->title = copy_value(values[FIELD_TITLE]);
+    entry->user = copy_value(values[FIELD_USER]);
+    entry->url = copy_value(values[FIELD_URL]);
+    entry->password = copy_value(values[FIELD_PASSWORD]);
+}
+
+/* Weakest first, ties by id */
+static int compare_strength(const void *a, const void *b)
+{
+    const Audit_entry_t *ea = *(const Audit_entry_t **)a;
+    const Audit_entry_t *eb = *(const Audit_entry_t **)b;
+
+    if(ea->strength.guesses_log10 != eb->strength.guesses_log10)
+        return ea->strength.guesses_log10 < eb->strength.guesses_log10 ? -1 : 1;
+
+    return atoi(ea->id) - atoi(eb->id);
+}
+
+/* Scores password of every entry on all processors and writes
+ * the entries weakest first, paged by limit and offset of options.
+ * Passwords themselves are never written.
+ */
+bool audit_strength(State_t *state, Formatter_t *formatter,
+                    List_options_t *options)
+{
+    Strength_audit_t audit;
+    Audit_entry_t **sorted;
+    const char *values[FIELD_COUNT] = { NULL };
+    char score[8];
+    char guesses[16];
+    char patterns[64];
+    int count = 0;
+    int row = 0;
+    bool ok;
+
+    memset(&audit, 0, sizeof(audit));
+
+    if(!dictionary_open(&audit.dict))
+        return false;
+
+    audit.pool = pool_new(pool_default_size());
+
+    ok = db_each_entry(state, collect_entry, &audit);
+
+    if(audit.batch_count > 0)
+        pool_submit(audit.pool, score_batch, audit.batches[audit.batch_count - 1]);
+
+    pool_wait(audit.pool);
+    pool_free(audit.pool);
+
+    for(int i = 0; i < audit.batch_count; i++)
+        count += audit.batches[i]->count;
+
+    sorted = tmalloc((count + 1) * sizeof(Audit_entry_t *));
+    count = 0;
+
+    for(int i = 0; i < audit.batch_count; i++)
+    {
+        for(int j = 0; j < audit.batches[i]->count; j++)
+            sorted[count++] = &audit.batches[i]->entries[j];
+    }
+
+    qsort(sorted, count, sizeof(Audit_entry_t *), compare_strength);
+
+    if(ok)
+    {
+        formatter_begin(formatter);
+
+        for(int i = options->offset; i < count; i++)
+        {
+            Audit_entry_t *entry = sorted[i];
+
+            if(options->limit >= 0 && row == options->limit)
+                break;
+
+            snprintf(score, sizeof(score), "%d", entry->strength.score);
+            snprintf(guesses, sizeof(guesses), "%.1f", entry->strength.guesses_log10);
+            strength_pattern_names(entry->strength.patterns, patterns,
+                                   sizeof(patterns));
+
+            values[FIELD_ID] = entry->id;
+            values[FIELD_TITLE] = entry->title;
+            values[FIELD_USER] = entry->user;
+            values[FIELD_URL] = entry->url;
+            values[FIELD_SCORE] = score;
+            values[FIELD_GUESSES] = guesses;
+            values[FIELD_PATTERN] = patterns;
+
+            formatter_row(formatter, values);
+            row++;
+        }
+
+        if(!formatter_end(formatter))
+        {
+            fprintf(stderr, "Error writing output.\n");
+            ok = false;
+        }
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        free(sorted[i]->id);
+        free(sorted[i]->title);
+        free(sorted[i]->user);
+        free(sorted[i]->url);
+    }
+
+    for(int i = 0; i < audit.batch_count; i++)
+        free(audit.batches[i]);
+
+    free(audit.batches);
+    free(sorted);
+    dictionary_close(&audit.dict);
+
+    return ok;
+}
+
+/* Entry whose password is in use by another entry too */
+typedef struct _reuse_entry
+{
+    char *id;
+    char *title;
+    char *user;
+    char *url;
+    /* Next entry with the same password, -1 ends the list */
+    int next;
+
+} Reuse_entry_t;
+
+/* Slot of the hash table, one for each distinct password */
+typedef struct _reuse_slot
+{
+    unsigned char hash[AUDIT_HASH_SIZE];
+    bool used;
+    int first;
+    int last;
+    int count;
+
+} Reuse_slot_t;
+
+/* Passwords are never stored, only their HMAC under a key which
+ * is random for each run, so the table is worthless once the key
+ * is gone.
+ */
+typedef struct _reuse_audit
+{
+    unsigned char key[AUDIT_HASH_SIZE];
+    Reuse_slot_t *slots;
+    size_t slot_count;
+    size_t used;
+    Reuse_entry_t *entries;
+    int entry_count;
+    int entry_alloc;
+    bool ok;
+
+} Reuse_audit_t;
+
+/* Returns the slot of hash, or the empty slot where it belongs.
+ * Hashes are uniformly random so their first bytes are used as
+ * the index as is.
+ */
+static Reuse_slot_t *find_slot(Reuse_slot_t *slots, size_t slot_count,
+                               const unsigned char *hash)
+{
+    uint64_t index;
+
+    memcpy(&index, hash, sizeof(index));
+    index &= slot_count - 1;
+
+    while(slots[index].used && memcmp(slots[index].hash, hash, AUDIT_HASH_SIZE) != 0)
+        index = (index + 1) & (slot_count - 1);
+
+    return &slots[index];
+}
+
+/* Doubles the table, keeping it at most half full */
+static void grow_slots(Reuse_audit_t *audit)
+{
+    size_t slot_count = audit->slot_count ? audit->slot_count * 2 : 1024;
+    Reuse_slot_t *slots = tmalloc(slot_count * sizeof(Reuse_slot_t));
+
+    memset(slots, 0, slot_count * sizeof(Reuse_slot_t));
+
+    for(size_t i = 0; i < audit->slot_count; i++)
+    {
+        if(audit->slots[i].used)
+            *find_slot(slots, slot_count, audit->slots[i].hash) = audit->slots[i];
+    }
+
+    if(audit->slots)
+    {
+        OPENSSL_cleanse(audit->slots, audit->slot_count * sizeof(Reuse_slot_t));
+        free(audit->slots);
+    }
+
+    audit->slots = slots;
+    audit->slot_count = slot_count;
+}
+
+static void hash_entry(void *data, const char **values)
+{
+    Reuse_audit_t *audit = data;
+    const char *password = values[FIELD_PASSWORD];
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_len = 0;
+    Reuse_slot_t *slot;
+    Reuse_entry_t *entry;
+
+    //Entries without a password share nothing
+    if(!password || *password == '\0')
+        return;
+
+    if(!HMAC(EVP_sha256(), audit->key, AUDIT_HASH_SIZE,
+             (const unsigned char *)password, strlen(password), hash, &hash_len))
+    {
+        audit->ok = false;
+        return;
+    }
+
+    if((audit->used + 1) * 2 > audit->slot_count)
+        grow_slots(audit);
+
+    if(audit->entry_count == audit->entry_alloc)
+    {
+        audit->entry_alloc = audit->entry_alloc ? audit->entry_alloc * 2 : 1024;
+        audit->entries = trealloc(audit->entries,
+                                  audit->entry_alloc * sizeof(Reuse_entry_t));
+    }
+
+    entry = &audit->entries[audit->entry_count];
+    entry->id = copy_value(values[FIELD_ID]);
+    entry->title = copy_value(values[FIELD_TITLE]);
+    entry->user = copy_value(values[FIELD_USER]);
+    entry->url = copy_value(values[FIELD_URL]);
+    entry->next = -1;
+
+    slot = find_slot(audit->slots, audit->slot_count, hash);
+
+    if(!slot->used)
+    {
+        memcpy(slot->hash, hash, AUDIT_HASH_SIZE);
+        slot->used = true;
+        slot->first = audit->entry_count;
+        slot->count = 0;
+        audit->used++;
+    }
+    else
+    {
+        audit->entries[slot->last].next = audit->entry_count;
+    }
+
+    slot->last = audit->entry_count;
+    slot->count++;
+    audit->entry_count++;
+
+    OPENSSL_cleanse(hash, sizeof(hash));
+}
+
+/* Largest groups first, ties by the first entry */
+static int compare_groups(const void *a, const void *b)
+{
+    const Reuse_slot_t *sa = *(const Reuse_slot_t **)a;
+    const Reuse_slot_t *sb = *(const Reuse_slot_t **)b;
+
+    if(sa->count != sb->count)
+        return sb->count - sa->count;
+
+    return sa->first - sb->first;
+}
+
+/* Finds entries sharing a password in a single pass over the
+ * database and writes them grouped, largest groups first. Limit
+ * and offset of options page the groups. Passwords themselves
+ * are never written.
+ */
+bool audit_reuse(State_t *state, Formatter_t *formatter,
+                 List_options_t *options)
+{
+    Reuse_audit_t audit;
+    Reuse_slot_t **groups;
+    const char *values[FIELD_COUNT] = { NULL };
+    char group_str[16];
+    int group_count = 0;
+    int row = 0;
+    bool ok;
+
+    memset(&audit, 0, sizeof(audit));
+    audit.ok = true;
+
+    if(RAND_bytes(audit.key, AUDIT_HASH_SIZE) != 1)
+    {
+        fprintf(stderr, "Unable to generate random data.\n");
+        return false;
+    }
+
+    grow_slots(&audit);
+
+    ok = db_each_entry(state, hash_entry, &audit) && audit.ok;
+
+    OPENSSL_cleanse(audit.key, AUDIT_HASH_SIZE);
+
+    groups = tmalloc((audit.used + 1) * sizeof(Reuse_slot_t *));
+
+    for(size_t i = 0; i < audit.slot_count; i++)
+    {
+        if(audit.slots[i].used && audit.slots[i].count > 1)
+            groups[group_count++] = &audit.slots[i];
+    }
+
+    qsort(groups, group_count, sizeof(Reuse_slot_t *), compare_groups);
+
+    if(ok)
+    {
+        formatter_begin(formatter);
+
+        for(int i = options->offset; i < group_count; i++)
+        {
+            if(options->limit >= 0 && row == options->limit)
+                break;
+
+            snprintf(group_str, sizeof(group_str), "%d", row + 1 + options->offset);
+
+            for(int e = groups[i]->first; e != -1; e = audit.entries[e].next)
+            {
+                values[FIELD_GROUP] = group_str;
+                values[FIELD_ID] = audit.entries[e].id;
+                values[FIELD_TITLE] = audit.entries[e].title;
+                values[FIELD_USER] = audit.entries[e].user;
+                values[FIELD_URL] = audit.entries[e].url;
+
+                formatter_row(formatter, values);
+            }
+
+            row++;
+        }
+
+        if(!formatter_end(formatter))
+        {
+            fprintf(stderr, "Error writing output.\n");
+            ok = false;
+        }
+    }
+
+    for(int i = 0; i < audit.entry_count; i++)
+    {
+        free(audit.entries[i].id);
+        free(audit.entries[i].title);
+        free(audit.entries[i].user);
+        free(audit.entries[i].url);
+    }
+
+    OPENSSL_cleanse(audit.slots, audit.slot_count * sizeof(Reuse_slot_t));
+    free(audit.slots);
+    free(audit.entries);
+    free(groups);
+
+    return ok;
+}
+
+typedef struct _breach_audit
+{
+    Hashfile_t file;
+    Formatter_t *formatter;
+    List_options_t *options;
+    /* Breached entries found so far */
+    int found;
+
+} Breach_audit_t;
+
+/* Checks one entry and writes it right away if its password is
+ * in the hash file, so no entries are collected in memory.
+ */
+static void check_entry(void *data, const char **values)
+{
+    Breach_audit_t *audit = data;
+    const char *password = values[FIELD_PASSWORD];
+    const char *row[FIELD_COUNT];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    char hash[HASHFILE_HASH_CHARS + 1];
+    char breaches[24];
+    long long count;
+
+    if(!password || *password == '\0')
+        return;
+
+    SHA1((const unsigned char *)password, strlen(password), digest);
+
+    for(int i = 0; i < SHA_DIGEST_LENGTH; i++)
+        sprintf(hash + i * 2, "%02X", digest[i]);
+
+    count = hashfile_lookup(&audit->file, hash);
+
+    OPENSSL_cleanse(digest, sizeof(digest));
+    OPENSSL_cleanse(hash, sizeof(hash));
+
+    if(count == 0)
+        return;
+
+    audit->found++;
+
+    if(audit->found <= audit->options->offset)
+        return;
+
+    if(audit->options->limit >= 0 &&
+       audit->found > audit->options->offset + audit->options->limit)
+        return;
+
+    snprintf(breaches, sizeof(breaches), "%lld", count);
+
+    memcpy(row, values, sizeof(row));
+    row[FIELD_PASSWORD] = NULL;
+    row[FIELD_BREACHES] = breaches;
+
+    formatter_row(audit->formatter, row);
+}
+
+/* Looks up SHA-1 of every password from the hash file at path and
+ * writes the entries found there in id order. Everything is done
+ * offline, the hash file is mapped and searched through its prefix
+ * index. Passwords themselves are never written.
+ */
+bool audit_breached(State_t *state, Formatter_t *formatter,
+                    List_options_t *options, const char *path)
+{
+    Breach_audit_t audit;
+    bool ok;
+
+    memset(&audit, 0, sizeof(audit));
+    audit.formatter = formatter;
+    audit.options = options;
+
+    if(!hashfile_open(&audit.file, path))
+        return false;
+
+    formatter_begin(formatter);
+
+    ok = db_each_entry(state, check_entry, &audit);
+
+    if(!formatter_end(formatter))
+    {
+        fprintf(stderr, "Error writing output.\n");
+        ok = false;
+    }
+
+    hashfile_close(&audit.file);
+
+    return ok;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __AUDIT_H
+#define __AUDIT_H
+
+/* Entries are scored in batches of this many on the worker pool */
+#define AUDIT_BATCH_SIZE (1024)
+
+/* Size of the keyed password hashes used to find reused passwords */
+#define AUDIT_HASH_SIZE (32)
+
+bool audit_strength(State_t *state, Formatter_t *formatter,
+                    List_options_t *options);
+bool audit_reuse(State_t *state, Formatter_t *formatter,
+                 List_options_t *options);
+bool audit_breached(State_t *state, Formatter_t *formatter,
+                    List_options_t *options, const char *path);
+
+#endif
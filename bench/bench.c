@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "entry.h"
+#include "format.h"
+#include "state.h"
+#include "db.h"
+#include "crypto.h"
+#include "lock.h"
+#include "utils.h"
+#include "libtitan.h"
+#include "libtitan_state.h"
+#include "vaultgen.h"
+
+/* Times the same libtitan, db.c and crypto.c calls the titan commands
+ * make on generated vaults of several sizes. Every command is run the given
+ * number of times and reported as one JSON object per line, so
+ * results of two builds can be compared to find regressions.
+ */
+
+#define BENCH_PASSPHRASE "benchmark passphrase"
+#define BENCH_SIZES "1000,10000,100000"
+#define BENCH_ITERATIONS (5)
+
+typedef struct _timing
+{
+    int iterations;
+    double total;
+    double min;
+    double max;
+
+} Timing_t;
+
+static double now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void timing_init(Timing_t *timing)
+{
+    timing->iterations = 0;
+    timing->total = 0;
+    timing->min = 0;
+    timing->max = 0;
+}
+
+static void timing_add(Timing_t *timing, double start)
+{
+    double elapsed = now_ms() - start;
+
+    if(timing->iterations == 0 || elapsed < timing->min)
+        timing->min = elapsed;
+
+    if(elapsed > timing->max)
+        timing->max = elapsed;
+
+    timing->total += elapsed;
+    timing->iterations++;
+}
+
+static void report(const char *command, int entries, Timing_t *timing, bool ok)
+{
+    printf("{\"command\":\"%s\",\"entries\":%d,\"iterations\":%d,"
+           "\"total_ms\":%.3f,\"mean_ms\":%.3f,\"min_ms\":%.3f,"
+           "\"max_ms\":%.3f,\"ok\":%s}\n", command, entries,
+           timing->iterations, timing->total,
+           timing->iterations ? timing->total / timing->iterations : 0,
+           timing->min, timing->max, ok ? "true" : "false");
+    fflush(stdout);
+}
+
+/* Each titan command runs in a new process, which checks the
+ * integrity of the database again.
+ */
+static void new_command(State_t *state)
+{
+    state->db_checked = false;
+}
+
+/* Same as adding or editing with titan, id zero adds entry */
+static bool put_entry(State_t *state, int id, Entry_t *entry)
+{
+    Titan_entry_t put = { 0 };
+    Titan_t *titan = titan_open_state(state);
+    bool ok;
+
+    put.id = id;
+    put.title = entry->title;
+    put.user = entry->user;
+    put.url = entry->url;
+    put.password = entry->password;
+    put.notes = entry->notes;
+
+    ok = titan && titan_put(titan, &put) != -1;
+    titan_close(titan);
+
+    return ok;
+}
+
+static bool write_entry(void *data, const Titan_entry_t *entry)
+{
+    const char *values[FIELD_COUNT] = { NULL };
+    char id_str[16];
+
+    snprintf(id_str, sizeof(id_str), "%d", entry->id);
+
+    values[FIELD_ID] = id_str;
+    values[FIELD_TITLE] = entry->title;
+    values[FIELD_USER] = entry->user;
+    values[FIELD_URL] = entry->url;
+    values[FIELD_PASSWORD] = entry->password;
+    values[FIELD_NOTES] = entry->notes;
+    values[FIELD_MODIFIED] = entry->modified;
+
+    formatter_row((Formatter_t *)data, values);
+
+    return true;
+}
+
+/* Same as listing or finding with titan, search NULL lists all */
+static bool write_entries(State_t *state, const char *search,
+                          Formatter_t *formatter)
+{
+    Titan_options_t options = { TITAN_SORT_ID, false, -1, 0, NULL };
+    Titan_t *titan = titan_open_state(state);
+    bool ok;
+
+    if(!titan)
+        return false;
+
+    formatter_begin(formatter);
+
+    if(search)
+        ok = titan_find(titan, search, &options, write_entry, formatter);
+    else
+        ok = titan_iterate(titan, &options, write_entry, formatter);
+
+    ok = formatter_end(formatter) && ok;
+    titan_close(titan);
+
+    return ok;
+}
+
+static bool bench_size(const char *dir, int entries, int iterations,
+                       int field_length)
+{
+    char path[4096];
+    char init_path[4096];
+    unsigned int seed = entries;
+    Timing_t timing;
+    State_t state;
+    Formatter_t formatter;
+    Fields_t fields;
+    FILE *devnull;
+    double start;
+    bool ok;
+
+    snprintf(path, sizeof(path), "%s/titan-bench-%d.db", dir, entries);
+    snprintf(init_path, sizeof(init_path), "%s/titan-bench-init.db", dir);
+
+    unlink(path);
+    unlink(init_path);
+
+    devnull = fopen("/dev/null", "w");
+
+    if(!devnull)
+    {
+        fprintf(stderr, "Cannot open /dev/null.\n");
+        return false;
+    }
+
+    fields_parse(NULL, &fields);
+
+    //init
+    timing_init(&timing);
+    ok = true;
+
+    for(int i = 0; i < iterations && ok; i++)
+    {
+        start = now_ms();
+        ok = db_init_new(init_path);
+        timing_add(&timing, start);
+        unlink(init_path);
+    }
+
+    report("init", 0, &timing, ok);
+
+    //Vault to run the commands against
+    timing_init(&timing);
+    start = now_ms();
+    ok = vaultgen_create(path, entries, field_length, seed);
+    timing_add(&timing, start);
+    report("generate", entries, &timing, ok);
+
+    if(!ok)
+    {
+        fclose(devnull);
+        return false;
+    }
+
+    state_init(&state);
+    state.db_path = strdup(path);
+    state.db_active = true;
+
+    //add
+    timing_init(&timing);
+
+    for(int i = 0; i < iterations && ok; i++)
+    {
+        Entry_t *entry = vaultgen_entry(&seed, field_length);
+
+        new_command(&state);
+        start = now_ms();
+
+        ok = put_entry(&state, 0, entry);
+        timing_add(&timing, start);
+        entry_free(entry);
+    }
+
+    report("add", entries, &timing, ok);
+
+    //edit
+    timing_init(&timing);
+
+    for(int i = 0; i < iterations && ok; i++)
+    {
+        Entry_t *entry = vaultgen_entry(&seed, field_length);
+        int id = entries > 0 ? 1 + rand_r(&seed) % entries : 1;
+
+        new_command(&state);
+        start = now_ms();
+
+        ok = put_entry(&state, id, entry);
+        timing_add(&timing, start);
+        entry_free(entry);
+    }
+
+    report("edit", entries, &timing, ok);
+
+    //list-all
+    timing_init(&timing);
+
+    for(int i = 0; i < iterations && ok; i++)
+    {
+        new_command(&state);
+        start = now_ms();
+        formatter_init(&formatter, devnull, TITAN_FORMAT_TEXT, &fields, true);
+
+        ok = write_entries(&state, NULL, &formatter);
+        timing_add(&timing, start);
+    }
+
+    report("list-all", entries, &timing, ok);
+
+    //find
+    timing_init(&timing);
+
+    for(int i = 0; i < iterations && ok; i++)
+    {
+        char search[4];
+
+        for(int j = 0; j < 3; j++)
+            search[j] = 'a' + rand_r(&seed) % 26;
+
+        search[3] = '\0';
+
+        new_command(&state);
+        start = now_ms();
+        formatter_init(&formatter, devnull, TITAN_FORMAT_TEXT, &fields, true);
+
+        ok = write_entries(&state, search, &formatter);
+        timing_add(&timing, start);
+    }
+
+    report("find", entries, &timing, ok);
+
+    //list-by-id
+    timing_init(&timing);
+
+    for(int i = 0; i < iterations && ok; i++)
+    {
+        int id = entries > 0 ? 1 + rand_r(&seed) % entries : 1;
+
+        new_command(&state);
+        start = now_ms();
+
+        Titan_t *titan = titan_open_state(&state);
+        Titan_entry_t *entry = titan ? titan_get(titan, id) : NULL;
+
+        ok = entry != NULL;
+        titan_close(titan);
+        timing_add(&timing, start);
+        titan_entry_free(entry);
+    }
+
+    report("list-by-id", entries, &timing, ok);
+
+    //encrypt and decrypt take turns on the same file
+    Timing_t decrypt_timing;
+
+    timing_init(&timing);
+    timing_init(&decrypt_timing);
+
+    for(int i = 0; i < iterations && ok; i++)
+    {
+        start = now_ms();
+
+        int lock = lock_database(path, TITAN_LOCK_EXCLUSIVE, TITAN_LOCK_TIMEOUT);
+
+        ok = lock != -1 && db_checkpoint(path) &&
+             encrypt_file(BENCH_PASSPHRASE, path);
+        unlock_database(lock);
+        timing_add(&timing, start);
+
+        if(!ok)
+            break;
+
+        start = now_ms();
+        lock = lock_database(path, TITAN_LOCK_EXCLUSIVE, TITAN_LOCK_TIMEOUT);
+        ok = lock != -1 && decrypt_file(BENCH_PASSPHRASE, path);
+        unlock_database(lock);
+        timing_add(&decrypt_timing, start);
+    }
+
+    report("encrypt", entries, &timing, ok);
+    report("decrypt", entries, &decrypt_timing, ok);
+
+    state_free(&state);
+    fclose(devnull);
+
+    unlink(path);
+
+    char lock_path[4096 + 8];
+
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    unlink(lock_path);
+
+    return ok;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: bench [-s sizes] [-i iterations] [-l field_length] "
+            "[-d directory]\n"
+            "Sizes is a comma separated list of vault sizes, default %s\n",
+            BENCH_SIZES);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *sizes = BENCH_SIZES;
+    const char *dir = getenv("TMPDIR");
+    int iterations = BENCH_ITERATIONS;
+    int field_length = VAULTGEN_FIELD_LENGTH;
+    bool ok = true;
+    int c;
+
+    if(!dir)
+        dir = "/tmp";
+
+    while((c = getopt(argc, argv, "s:i:l:d:")) != -1)
+    {
+        switch(c)
+        {
+        case 's':
+            sizes = optarg;
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 'l':
+            field_length = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if(iterations < 1 || field_length < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    while(*sizes != '\0' && ok)
+    {
+        char *end;
+        long entries = strtol(sizes, &end, 10);
+
+        if(end == sizes || entries < 0)
+        {
+            usage();
+            return 1;
+        }
+
+        ok = bench_size(dir, (int)entries, iterations, field_length);
+        sizes = *end == ',' ? end + 1 : end;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "entry.h"
+#include "vaultgen.h"
+
+static void usage()
+{
+    fprintf(stderr, "Usage: genvault [-n entries] [-l field_length] "
+            "[-s seed] <path>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int entries = 1000;
+    int field_length = VAULTGEN_FIELD_LENGTH;
+    unsigned int seed = 1;
+    int c;
+
+    while((c = getopt(argc, argv, "n:l:s:")) != -1)
+    {
+        switch(c)
+        {
+        case 'n':
+            entries = atoi(optarg);
+            break;
+        case 'l':
+            field_length = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if(optind != argc - 1 || entries < 0 || field_length < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    return vaultgen_create(argv[optind], entries, field_length, seed) ? 0 : 1;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "entry.h"
+#include "utils.h"
+#include "libtitan.h"
+#include "vaultgen.h"
+
+/* Damages the journal of a generated vault the ways a crash or an
+ * attacker would and checks that the vault either opens with every
+ * entry or is refused. Run by make check.
+ */
+
+#define CHECK_PASSPHRASE "check passphrase"
+#define CHECK_NEW_PASSPHRASE "new check passphrase"
+#define CHECK_ENTRIES (100)
+/* Records appended to the journal before it is damaged */
+#define CHECK_RECORDS (3)
+
+typedef struct _vault_files
+{
+    char path[4096];
+    char journal_path[4096 + 16];
+    char pending_path[4096 + 16];
+    char saved_path[4096 + 16];
+
+} Vault_files_t;
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+
+    if(!ok)
+        failures++;
+}
+
+static long file_size(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static bool copy_file(const char *from, const char *to)
+{
+    char buf[4096];
+    size_t len;
+    bool ok = true;
+    FILE *in = fopen(from, "rb");
+    FILE *out = in ? fopen(to, "wb") : NULL;
+
+    if(!out)
+    {
+        if(in)
+            fclose(in);
+
+        return false;
+    }
+
+    while((len = fread(buf, 1, sizeof(buf), in)) > 0 && ok)
+        ok = fwrite(buf, 1, len, out) == len;
+
+    fclose(in);
+
+    return fclose(out) == 0 && ok;
+}
+
+static bool count_entry(void *data, const Titan_entry_t *entry)
+{
+    (void)entry;
+    (*(int *)data)++;
+
+    return true;
+}
+
+/* Number of entries after unlocking the vault, -1 if it is refused.
+ * Vault is locked again with passphrase.
+ */
+static int unlocked_entries(const char *path, const char *passphrase)
+{
+    Titan_t *titan = titan_open(path, 0);
+    int count = -1;
+
+    if(titan && titan_unlock(titan, passphrase))
+    {
+        count = 0;
+
+        if(!titan_iterate(titan, NULL, count_entry, &count) ||
+           !titan_lock(titan, passphrase))
+            count = -1;
+    }
+
+    titan_close(titan);
+
+    return count;
+}
+
+/* Unlocks the vault, adds an entry and locks it again */
+static bool add_entry(const char *path, const char *passphrase)
+{
+    Titan_entry_t entry = { 0 };
+    Titan_t *titan = titan_open(path, 0);
+    bool ok;
+
+    entry.title = "check";
+    entry.password = "secret";
+
+    ok = titan && titan_unlock(titan, passphrase) &&
+         titan_put(titan, &entry) > 0 && titan_lock(titan, passphrase);
+    titan_close(titan);
+
+    return ok;
+}
+
+/* Puts the saved journal back and truncates it to len */
+static bool restore_journal(Vault_files_t *vault, long len)
+{
+    return copy_file(vault->saved_path, vault->journal_path) &&
+           truncate(vault->journal_path, len) == 0;
+}
+
+static void check_torn_tail(Vault_files_t *vault, long *sizes, int entries)
+{
+    long newest = sizes[CHECK_RECORDS - 1];
+    long full = sizes[CHECK_RECORDS];
+
+    copy_file(vault->journal_path, vault->saved_path);
+
+    restore_journal(vault, newest);
+    check(unlocked_entries(vault->path, CHECK_PASSPHRASE) == -1,
+          "journal without its newest record is refused");
+
+    restore_journal(vault, sizes[0]);
+    check(unlocked_entries(vault->path, CHECK_PASSPHRASE) == -1,
+          "journal without any of its records is refused");
+
+    restore_journal(vault, newest + (full - newest) / 2);
+    check(unlocked_entries(vault->path, CHECK_PASSPHRASE) == -1,
+          "journal with its newest record cut short is refused");
+
+    restore_journal(vault, full);
+    check(unlocked_entries(vault->path, CHECK_PASSPHRASE) == entries,
+          "whole journal opens after being refused");
+}
+
+/* Crash after a record is written but before the header counts it
+ * leaves the vault decrypted with the record beyond the header.
+ */
+static void check_uncounted_record(Vault_files_t *vault, long *sizes,
+                                   int entries)
+{
+    Titan_t *titan = titan_open(vault->path, 0);
+    bool ok = titan && titan_unlock(titan, CHECK_PASSPHRASE);
+    long newest = sizes[CHECK_RECORDS - 1];
+    char frame[4096];
+    FILE *fp;
+    size_t len = 0;
+
+    fp = fopen(vault->journal_path, "rb");
+
+    if(fp && fseek(fp, newest, SEEK_SET) == 0)
+        len = fread(frame, 1, sizeof(frame), fp);
+
+    if(fp)
+        fclose(fp);
+
+    fp = fopen(vault->journal_path, "ab");
+    ok = ok && fp && len > 0 && fwrite(frame, 1, len, fp) == len;
+
+    if(fp)
+        fclose(fp);
+
+    ok = ok && titan_lock(titan, CHECK_PASSPHRASE);
+    titan_close(titan);
+
+    check(ok && unlocked_entries(vault->path, CHECK_PASSPHRASE) == entries,
+          "record beyond the header is dropped when the vault is locked");
+}
+
+/* Crash after the new snapshot is in place but before its journal
+ * is renamed leaves the old journal next to the new snapshot.
+ */
+static void check_interrupted_compaction(Vault_files_t *vault, int entries)
+{
+    Titan_t *titan = titan_open(vault->path, 0);
+    bool ok;
+
+    copy_file(vault->journal_path, vault->saved_path);
+
+    //Changing the passphrase compacts the vault
+    ok = titan && titan_unlock(titan, CHECK_PASSPHRASE) &&
+         titan_lock(titan, CHECK_NEW_PASSPHRASE);
+    titan_close(titan);
+
+    check(ok && unlocked_entries(vault->path, CHECK_NEW_PASSPHRASE) == entries,
+          "vault is compacted with a new passphrase");
+
+    check(rename(vault->journal_path, vault->pending_path) == 0 &&
+          copy_file(vault->saved_path, vault->journal_path),
+          "compaction is interrupted before the journal is renamed");
+
+    check(unlocked_entries(vault->path, CHECK_PASSPHRASE) == -1,
+          "old journal does not open the new snapshot");
+
+    check(unlocked_entries(vault->path, CHECK_NEW_PASSPHRASE) == entries &&
+          !file_exists(vault->pending_path),
+          "interrupted compaction is finished when the vault is decrypted");
+
+    check(add_entry(vault->path, CHECK_NEW_PASSPHRASE) &&
+          unlocked_entries(vault->path, CHECK_NEW_PASSPHRASE) == entries + 1,
+          "journal of the new snapshot takes records");
+}
+
+static void remove_vault(Vault_files_t *vault)
+{
+    const char *exts[] = { "", ".snapshot", ".journal", ".journal.new", ".lock",
+                           ".saved" };
+    char path[4096 + 16];
+
+    for(size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s%s", vault->path, exts[i]);
+        unlink(path);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = getenv("TMPDIR");
+    long sizes[CHECK_RECORDS + 1];
+    int entries = CHECK_ENTRIES;
+    Vault_files_t vault;
+    Titan_t *titan;
+    bool ok;
+
+    if(argc > 1)
+        dir = argv[1];
+    else if(!dir)
+        dir = "/tmp";
+
+    snprintf(vault.path, sizeof(vault.path), "%s/titan-check-%d.db", dir,
+             (int)getpid());
+    snprintf(vault.journal_path, sizeof(vault.journal_path), "%s.journal",
+             vault.path);
+    snprintf(vault.pending_path, sizeof(vault.pending_path), "%s.journal.new",
+             vault.path);
+    snprintf(vault.saved_path, sizeof(vault.saved_path), "%s.saved",
+             vault.path);
+
+    remove_vault(&vault);
+
+    //First lock writes the snapshot and an empty journal
+    titan = vaultgen_create(vault.path, entries, VAULTGEN_FIELD_LENGTH, 1) ?
+            titan_open(vault.path, 0) : NULL;
+    ok = titan && titan_lock(titan, CHECK_PASSPHRASE);
+    titan_close(titan);
+
+    sizes[0] = file_size(vault.journal_path);
+    check(ok && sizes[0] > 0, "vault is encrypted with an empty journal");
+
+    for(int i = 1; i <= CHECK_RECORDS && ok; i++)
+    {
+        ok = add_entry(vault.path, CHECK_PASSPHRASE);
+        entries++;
+        sizes[i] = file_size(vault.journal_path);
+        ok = ok && sizes[i] > sizes[i - 1];
+    }
+
+    check(ok, "entries added are appended to the journal");
+
+    if(ok)
+    {
+        check_torn_tail(&vault, sizes, entries);
+        check_uncounted_record(&vault, sizes, entries);
+        check_interrupted_compaction(&vault, entries);
+    }
+
+    remove_vault(&vault);
+
+    if(failures > 0)
+        printf("%d checks failed\n", failures);
+
+    return failures > 0 || !ok ? 1 : 0;
+}
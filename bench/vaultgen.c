@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "entry.h"
+#include "format.h"
+#include "state.h"
+#include "db.h"
+#include "utils.h"
+#include "vaultgen.h"
+
+/* Small deterministic generator so the same seed always
+ * produces the same vault.
+ */
+static unsigned int next_random(unsigned int *seed)
+{
+    unsigned int x = *seed ? *seed : 0x2545f491;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+
+    return x;
+}
+
+static char *random_string(unsigned int *seed, int length, const char *alphabet)
+{
+    size_t alphabet_len = strlen(alphabet);
+    char *str = tmalloc(length + 1);
+
+    for(int i = 0; i < length; i++)
+        str[i] = alphabet[next_random(seed) % alphabet_len];
+
+    str[length] = '\0';
+
+    return str;
+}
+
+/* Returns a random entry with fields of about field_length
+ * characters. Caller must free the entry.
+ */
+Entry_t *vaultgen_entry(unsigned int *seed, int field_length)
+{
+    static const char *letters = "abcdefghijklmnopqrstuvwxyz     ";
+    static const char *chars = "abcdefghijklmnopqrstuvwxyz"
+                               "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!#%()/=?";
+    char *title = random_string(seed, field_length, letters);
+    char *user = random_string(seed, field_length / 2 + 1, letters + 5);
+    char *host = random_string(seed, field_length, letters + 5);
+    char *password = random_string(seed, field_length, chars);
+    char *notes = random_string(seed, field_length * 4, letters);
+    char *url = tmalloc(strlen(host) + 16);
+    Entry_t *entry;
+
+    sprintf(url, "https://%s.com", host);
+
+    entry = entry_new(title, user, url, password, notes);
+
+    free(title);
+    free(user);
+    free(host);
+    free(password);
+    free(notes);
+    free(url);
+
+    return entry;
+}
+
+/* Creates a new vault at path with entries random entries added
+ * through the same db.c functions titan uses, VAULTGEN_BATCH
+ * entries per transaction.
+ */
+bool vaultgen_create(const char *path, int entries, int field_length,
+                     unsigned int seed)
+{
+    Entry_t *batch[VAULTGEN_BATCH];
+    State_t state;
+    bool ok = true;
+
+    if(file_exists(path))
+    {
+        fprintf(stderr, "%s already exists.\n", path);
+        return false;
+    }
+
+    if(!db_init_new(path))
+        return false;
+
+    state_init(&state);
+    state.db_path = strdup(path);
+    state.db_active = true;
+
+    for(int i = 0; i < entries && ok; i += VAULTGEN_BATCH)
+    {
+        int count = entries - i < VAULTGEN_BATCH ? entries - i : VAULTGEN_BATCH;
+
+        for(int j = 0; j < count; j++)
+            batch[j] = vaultgen_entry(&seed, field_length);
+
+        ok = db_insert_entries(&state, batch, count);
+
+        for(int j = 0; j < count; j++)
+            entry_free(batch[j]);
+    }
+
+    state_free(&state);
+
+    return ok;
+}
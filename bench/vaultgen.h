@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __VAULTGEN_H
+#define __VAULTGEN_H
+
+/* Length of generated fields unless given, notes are four times longer */
+#define VAULTGEN_FIELD_LENGTH (16)
+/* Entries added per transaction */
+#define VAULTGEN_BATCH (1000)
+
+Entry_t *vaultgen_entry(unsigned int *seed, int field_length);
+bool vaultgen_create(const char *path, int entries, int field_length,
+                     unsigned int seed);
+
+#endif
@@ -10,11 +10,23 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
-#include "cmd_ui.h"
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "entry.h"
+#include "format.h"
+#include "state.h"
 #include "db.h"
+#include "cmd_ui.h"
 #include "utils.h"
 #include "crypto.h"
+#include "lock.h"
+#include "search.h"
+#include "audit.h"
+#include "server.h"
+#include "journal.h"
+#include "merge.h"
+#include "libtitan.h"
+#include "libtitan_state.h"
 
 extern int fileno(FILE *stream);
 
@@ -75,33 +87,67 @@ static size_t my_getpass(char *prompt, char **lineptr, size_t *n, FILE *stream)
     return nread;
 }
 
-void init_database(const char *path, int force, int auto_encrypt)
+/* Locks the active database. Returns the lock descriptor or -1 if
+ * the lock could not be taken in time, or if another process
+ * encrypted the database while we were waiting for the lock.
+ */
+static int lock_active_database(State_t *state, int mode)
 {
-    if(!has_active_database() || force == 1)
+    int fd;
+
+    fd = lock_database(state->db_path, mode, state->lock_timeout);
+
+    if(fd == -1)
+        return -1;
+
+    if(!file_exists(state->db_path) || is_file_encrypted(state->db_path))
     {
+        fprintf(stderr, "Database was encrypted by another process.\n");
+        unlock_database(fd);
+        state->db_active = false;
+
+        return -1;
+    }
+
+    return fd;
+}
+
+void init_database(State_t *state, const char *path)
+{
+    if(!state->db_active || state->force == 1)
+    {
+        int lock = lock_database(path, TITAN_LOCK_EXCLUSIVE, state->lock_timeout);
+
+        if(lock == -1)
+            return;
+
         //If forced, delete any existing file
-        if(force == 1)
+        if(state->force == 1)
         {
             if(file_exists(path))
                 unlink(path);
         }
             
         if(db_init_new(path))
-            write_active_database_path(path);
+            state_set_active_database(state, path);
+
+        unlock_database(lock);
     }
     else
     {
-        fprintf(stderr, "Existing database is already active. "
-                "Encrypt it before creating a new one.\n");
+        fprintf(stderr, "Existing database is already active in vault %s. "
+                "Encrypt it before creating a new one or use --vault.\n",
+                state->vault_name);
     }
 }
 
-void decrypt_database(const char *path)
+void decrypt_database(State_t *state, const char *path)
 {
-    if(has_active_database())
+    if(state->db_active)
     {
-        fprintf(stderr, "Existing database is already active. "
-                "Encrypt it before decrypting another one.\n");
+        fprintf(stderr, "Existing database is already active in vault %s. "
+                "Encrypt it before decrypting another one or use --vault.\n",
+                state->vault_name);
                 
         return;
     }
@@ -111,69 +157,63 @@ void decrypt_database(const char *path)
     char *ptr = pass;
     
     my_getpass("Password: ", &ptr, &pwdlen, stdin);
+
+    int lock = lock_database(path, TITAN_LOCK_EXCLUSIVE, state->lock_timeout);
+
+    if(lock == -1)
+        return;
     
-    if(!decrypt_file(pass, path))
+    if(!journal_unlock(pass, path, state->lock_timeout, NULL))
     {
         fprintf(stderr, "Failed to decrypt %s.\n", path);
+        unlock_database(lock);
         return;
     }
     
-    write_active_database_path(path);
+    state_set_active_database(state, path);
+    unlock_database(lock);
 }
 
-void encrypt_database()
+bool encrypt_database(State_t *state)
 {
-    if(!has_active_database())
+    if(!state->db_active)
     {
         fprintf(stderr, "No decrypted database found.\n");
-        return;
+        return false;
     }
     
     size_t pwdlen = 1024;
     char pass[pwdlen];
     char *ptr = pass;
-    char *path = NULL;
-    char *lockfile_path = NULL;
-    
-    path = read_active_database_path();
-    
-    if(!path)
-    {
-        fprintf(stderr, "Unable to read activate database path.\n");
-        return;
-    }
     
     my_getpass("Password: ", &ptr, &pwdlen, stdin);
     
     //TODO: ask the pass twice to make sure user typed it correctly
-    
-    if(!encrypt_file(pass, path))
-    {
-        fprintf(stderr, "Encryption of %s failed.\n", path);
-        free(path);
-        return;
-    }
-    
-    free(path);
-    
-    lockfile_path = get_lockfile_path();
-    
-    if(!lockfile_path)
+
+    int lock = lock_active_database(state, TITAN_LOCK_EXCLUSIVE);
+
+    if(lock == -1)
+        return false;
+
+    //Appends changes to the journal or writes a new snapshot
+    if(!journal_lock(pass, state->db_path, state->lock_timeout, NULL))
     {
-        fprintf(stderr, "Unable to retrieve the lock file path.\n");
-        return;
+        fprintf(stderr, "Encryption of %s failed.\n", state->db_path);
+        unlock_database(lock);
+        return false;
     }
     
-    //Finally delete the file that holds the activate database path.
-    //This way we allow Titan to create a new database or open another one.
-    unlink(lockfile_path);
-    free(lockfile_path);
+    //Finally forget the active database path.
+    state_clear_active_database(state);
+    unlock_database(lock);
+
+    return true;
 }
 
 /* Interactively adds a new entry to the database */
-bool add_new_entry(int auto_encrypt)
+bool add_new_entry(State_t *state)
 {
-    if(!has_active_database())
+    if(!state->db_active)
     {
         fprintf(stderr, "No decrypted database found.\n");
         return false;
@@ -186,6 +226,9 @@ bool add_new_entry(int auto_encrypt)
     size_t pwdlen = 1024;
     char pass[pwdlen];
     char *ptr = pass;
+    Titan_entry_t entry = { 0 };
+    Titan_t *titan;
+    int id = -1;
 
     fprintf(stdout, "Title: ");
     fgets(title, 1024, stdin);
@@ -203,40 +246,56 @@ bool add_new_entry(int auto_encrypt)
     strip_newline_str(url);
     strip_newline_str(notes);
 
-    Entry_t *entry = entry_new(title, user, url, pass,
-                               notes);
+    entry.title = title;
+    entry.user = user;
+    entry.url = url;
+    entry.password = pass;
+    entry.notes = notes;
+    entry.tags = state->tags;
 
-    if(!entry)
-        return false;
+    titan = titan_open_state(state);
+
+    if(titan)
+        id = titan_put(titan, &entry);
 
-    if(!db_insert_entry(entry))
+    titan_close(titan);
+
+    if(id == -1)
     {
         fprintf(stderr, "Failed to add a new entry.\n");
         return false;
     }
 
-    entry_free(entry);
-
     return true;
 }
 
-bool edit_entry(int id, int auto_encrypt)
+/* Current value of a field shown when editing, NULL if not set */
+static const char *current_value(const char *value)
 {
-    if(!has_active_database())
+    return value ? value : "";
+}
+
+bool edit_entry(State_t *state, int id)
+{
+    if(!state->db_active)
     {
         fprintf(stderr, "No decrypted database found.\n");
         return false;
     }
 
-    Entry_t *entry = db_get_entry_by_id(id);
+    Titan_t *titan = titan_open_state(state);
 
-    if(!entry)
+    if(!titan)
         return false;
 
-    if(entry->id == -1)
+    Titan_entry_t *entry = titan_get(titan, id);
+
+    //Don't keep the database open while waiting for user input
+    titan_close(titan);
+
+    if(!entry)
     {
         printf("Nothing found.\n");
-        free(entry);
         return false;
     }
 
@@ -247,21 +306,23 @@ bool edit_entry(int id, int auto_encrypt)
     size_t pwdlen = 1024;
     char pass[pwdlen];
     char *ptr = pass;
+    Titan_entry_t changed = *entry;
     bool update = false;
+    bool ok = true;
 
-    fprintf(stdout, "Current title %s\n", entry->title);
+    fprintf(stdout, "Current title %s\n", current_value(entry->title));
     fprintf(stdout, "New title: ");
     fgets(title, 1024, stdin);
-    fprintf(stdout, "Current username %s\n", entry->user);
+    fprintf(stdout, "Current username %s\n", current_value(entry->user));
     fprintf(stdout, "New username: ");
     fgets(user, 1024, stdin);
-    fprintf(stdout, "Current url %s\n", entry->url);
+    fprintf(stdout, "Current url %s\n", current_value(entry->url));
     fprintf(stdout, "New url: ");
     fgets(url, 1024, stdin);
-    fprintf(stdout, "Current notes %s\n", entry->notes);
+    fprintf(stdout, "Current notes %s\n", current_value(entry->notes));
     fprintf(stdout, "New note: ");
     fgets(notes, 1024, stdin);
-    fprintf(stdout, "Current password %s\n", entry->password);
+    fprintf(stdout, "Current password %s\n", current_value(entry->password));
     my_getpass("New password: ", &ptr, &pwdlen, stdin);
 
     strip_newline_str(title);
@@ -271,49 +332,68 @@ bool edit_entry(int id, int auto_encrypt)
 
     if(title[0] != '\0')
     {
-        entry->title = strdup(title);
+        changed.title = title;
         update = true;
     }
     if(user[0] != '\0')
     {
-        entry->user = strdup(user);
+        changed.user = user;
         update = true;
     }
     if(url[0] != '\0')
     {
-        entry->url = strdup(url);
+        changed.url = url;
         update = true;
     }
     if(notes[0] != '\0')
     {
-        entry->notes = strdup(notes);
+        changed.notes = notes;
         update = true;
     }
     if(pass[0] != '\0')
     {
-        entry->password = strdup(pass);
+        changed.password = pass;
+        update = true;
+    }
+    if(state->tags)
+    {
+        changed.tags = state->tags;
         update = true;
     }
 
     if(update)
-        db_update_entry(entry->id, entry);
+    {
+        titan = titan_open_state(state);
+        ok = titan && titan_put(titan, &changed) != -1;
+        titan_close(titan);
+    }
 
-    entry_free(entry);
+    titan_entry_free(entry);
 
-    return true;
+    return ok;
 }
 
-bool remove_entry(int id, int auto_encrypt)
+bool remove_entry(State_t *state, int id)
 {
-    if(!has_active_database())
+    if(!state->db_active)
     {
         fprintf(stderr, "No decrypted database found.\n");
         return false;
     }
 
     bool changes = false;
+    bool ok;
+    int lock;
+
+    lock = lock_active_database(state, TITAN_LOCK_EXCLUSIVE);
 
-    if(db_delete_entry(id, &changes))
+    if(lock == -1)
+        return false;
+
+    ok = db_delete_entry(state, id, &changes);
+    unlock_database(lock);
+
+    if(ok)
     {
         if(changes == true)
             fprintf(stdout, "Entry was deleted from the database.\n");
@@ -326,98 +406,615 @@ bool remove_entry(int id, int auto_encrypt)
     return false;
 }
 
-void list_by_id(int id, int show_password, int auto_encrypt)
+/* Initializes formatter writing to fp using the format and fields
+ * given on the command line. If no format was given default_format
+ * is used. Returns false if either of them is invalid.
+ */
+static bool setup_formatter(Formatter_t *formatter, FILE *fp, State_t *state,
+                            int default_format, bool mask_password)
+{
+    int format = default_format;
+    Fields_t fields;
+
+    if(state->format)
+    {
+        format = format_from_name(state->format);
+
+        if(format == -1)
+        {
+            fprintf(stderr, "Unknown format %s.\n", state->format);
+            return false;
+        }
+    }
+
+    if(!fields_parse(state->fields, &fields))
+        return false;
+
+    formatter_init(formatter, fp, format, &fields, !!mask_password);
+
+    return true;
+}
+
+/* Options of the command line for titan_find and titan_iterate */
+static void titan_options(State_t *state, Titan_options_t *options)
+{
+    List_options_t *list = &state->list_options;
+
+    options->sort = list->sort;
+    options->reverse = list->reverse;
+    options->limit = list->limit;
+    options->offset = list->offset;
+    options->with_tags = list->with_tags;
+}
+
+/* Writes entry using the formatter passed as data */
+static bool write_entry(void *data, const Titan_entry_t *entry)
+{
+    const char *values[FIELD_COUNT] = { NULL };
+    char id_str[16];
+
+    snprintf(id_str, sizeof(id_str), "%d", entry->id);
+
+    values[FIELD_ID] = id_str;
+    values[FIELD_TITLE] = entry->title;
+    values[FIELD_USER] = entry->user;
+    values[FIELD_URL] = entry->url;
+    values[FIELD_PASSWORD] = entry->password;
+    values[FIELD_NOTES] = entry->notes;
+    values[FIELD_MODIFIED] = entry->modified;
+
+    formatter_row((Formatter_t *)data, values);
+
+    return true;
+}
+
+/* Writes the entries found by titan_find, or every entry if search
+ * is NULL, to stdout in the requested format and order.
+ */
+static void write_entries(State_t *state, const char *search)
+{
+    Formatter_t formatter;
+    Titan_options_t options;
+    Titan_t *titan;
+
+    if(!state->db_active)
+    {
+        fprintf(stderr, "No decrypted database found.\n");
+        return;
+    }
+
+    if(!setup_formatter(&formatter, stdout, state, TITAN_FORMAT_TEXT,
+                        state->show_password != 1))
+        return;
+
+    titan = titan_open_state(state);
+
+    if(!titan)
+        return;
+
+    titan_options(state, &options);
+    formatter_begin(&formatter);
+
+    if(search)
+        titan_find(titan, search, &options, write_entry, &formatter);
+    else
+        titan_iterate(titan, &options, write_entry, &formatter);
+
+    if(!formatter_end(&formatter))
+        fprintf(stderr, "Error writing output.\n");
+
+    titan_close(titan);
+}
+
+void list_by_id(State_t *state, int id)
 {
-    if(!has_active_database())
+    Formatter_t formatter;
+    Titan_entry_t *entry;
+    Titan_t *titan;
+
+    if(!state->db_active)
     {
         fprintf(stderr, "No decrypted database found.\n");
         return;
     }
 
-    Entry_t *entry = db_get_entry_by_id(id);
+    if(!setup_formatter(&formatter, stdout, state, TITAN_FORMAT_TEXT,
+                        state->show_password != 1))
+        return;
 
-    if(!entry)
+    titan = titan_open_state(state);
+
+    if(!titan)
         return;
 
+    entry = titan_get(titan, id);
+    titan_close(titan);
 
-    if(entry->id == -1)
+    if(!entry)
     {
         printf("Nothing found with id %d.\n", id);
-        free(entry);
         return;
     }
 
-    fprintf(stdout, "=====================================================================\n");
-    fprintf(stdout, "Title: %s\n", entry->title);
-    fprintf(stdout, "User:  %s\n", entry->user);
-    fprintf(stdout, "Url:   %s\n", entry->url);
-    fprintf(stdout, "Notes: %s\n", entry->notes);
-    fprintf(stdout, "Modified: %s\n", entry->stamp);
+    formatter_begin(&formatter);
+    write_entry(&formatter, entry);
+    formatter_end(&formatter);
 
-    if(show_password == 1)
-        fprintf(stdout, "Password: %s\n", entry->password);
-    else
-        fprintf(stdout, "Password: **********\n");
+    titan_entry_free(entry);
+}
 
-    fprintf(stdout, "=====================================================================\n");
-    entry_free(entry);
+/* Loop through all entries in the database and write them
+ * to stdout in the requested format and order.
+ */
+void list_all(State_t *state)
+{
+    write_entries(state, NULL);
 }
 
-/* Loop through all entries in the database.
- * At the moment printing to stdout is handled by sqlite callback.
- * While it's ok for the command line, but if we ever need GUI
- * then this needs to be designed better using a linked list etc.
+/* Stores the file at path as an attachment of entry id, named by
+ * its base name. Attaching another file of the same name replaces it.
  */
-void list_all(int show_password, int auto_encrypt)
+void attach_file(State_t *state, int id, const char *path)
 {
-    if(!has_active_database())
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    struct stat st;
+    FILE *fp;
+    int lock;
+
+    if(!state->db_active)
     {
         fprintf(stderr, "No decrypted database found.\n");
         return;
     }
 
-    db_list_all(show_password);
+    fp = fopen(path, "r");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open %s for reading.\n", path);
+        return;
+    }
+
+    if(fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || *name == '\0')
+    {
+        fprintf(stderr, "%s is not a regular file.\n", path);
+        fclose(fp);
+        return;
+    }
+
+    lock = lock_active_database(state, TITAN_LOCK_EXCLUSIVE);
+
+    if(lock != -1 && db_attach(state, id, name, fp, st.st_size))
+        fprintf(stdout, "Attached %s to entry %d.\n", name, id);
+
+    unlock_database(lock);
+    fclose(fp);
 }
 
-/* Uses sqlite "like" query and prints results to stdout.
- * This is ok for the command line version of Titan. However
- * better design is needed _if_ GUI version will be developed.
+/* Writes attachment name of entry id to stdout, which must not be
+ * a terminal.
  */
-void find(const char *search, int show_password, int auto_encrypt)
+void extract_file(State_t *state, int id, const char *name)
 {
-    if(!has_active_database())
+    int lock;
+
+    if(!state->db_active)
     {
         fprintf(stderr, "No decrypted database found.\n");
         return;
     }
 
-    db_find(search, show_password);
+    if(isatty(STDOUT_FILENO))
+    {
+        fprintf(stderr, "Redirect the attachment into a file.\n");
+        return;
+    }
+
+    lock = lock_active_database(state, TITAN_LOCK_SHARED);
+
+    if(lock == -1)
+        return;
+
+    if(db_extract(state, id, name, stdout))
+        fflush(stdout);
+
+    unlock_database(lock);
 }
 
-void show_current_db_path()
+/* Prints entries changed or deleted since time, as JSON lines by
+ * default so a replication job can apply them by uuid.
+ */
+void changed_since(State_t *state, const char *time)
 {
-    char *path = NULL;
+    Formatter_t formatter;
+    long long since;
 
-    path = read_active_database_path();
+    if(!state->db_active)
+    {
+        fprintf(stderr, "No decrypted database found.\n");
+        return;
+    }
 
-    if(!path)
+    if(!parse_time(time, &since))
     {
+        fprintf(stderr, "Invalid time %s.\n", time);
+        return;
+    }
+
+    if(!setup_formatter(&formatter, stdout, state, TITAN_FORMAT_JSONL,
+                        state->show_password != 1))
+        return;
+
+    if(!state->fields)
+        fields_parse("change,id,uuid,title,user,url,password,notes,modified",
+                     &formatter.fields);
+
+    int lock = lock_active_database(state, TITAN_LOCK_SHARED);
+
+    if(lock == -1)
+        return;
+
+    db_changed_since(state, since, &formatter, &state->list_options);
+    unlock_database(lock);
+}
+
+/* Prints entries matching search to stdout in the requested
+ * format. Search is in the query language of query.c: words,
+ * field:text, field:pattern and field=text of title, user, url
+ * and notes, tag:name, modified comparisons and -term negations.
+ */
+void find(State_t *state, const char *search)
+{
+    write_entries(state, search);
+}
+
+void show_current_db_path(State_t *state)
+{
+    if(!state->db_path)
         fprintf(stderr, "No decrypted database exist.\n");
+    else
+        fprintf(stdout, "%s\n", state->db_path);
+}
+
+/* Writes a row found by find_all tagged with its vault */
+static void write_found_row(void *data, Search_job_t *job,
+                            const char **row)
+{
+    const char *values[FIELD_COUNT] = { NULL };
+
+    memcpy(values, row, ENTRY_FIELD_COUNT * sizeof(char *));
+    values[FIELD_VAULT] = job->label;
+
+    formatter_row((Formatter_t *)data, values);
+}
+
+/* Searches several vaults at once and writes the results tagged
+ * with the vault they were found in. Vaults are names of unlocked
+ * vaults or paths to database files. Encrypted files are decrypted
+ * in memory only, after asking their passwords up front. Without
+ * vaults every unlocked vault is searched.
+ */
+void find_all(State_t *state, const char *search, int count, char **vaults)
+{
+    Formatter_t formatter;
+    Search_job_t *jobs;
+    Fields_t *fields;
+
+    if(!setup_formatter(&formatter, stdout, state, TITAN_FORMAT_TEXT,
+                        state->show_password != 1))
+        return;
+
+    //Tag the results with their vault unless fields were given
+    fields = &formatter.fields;
+
+    if(!state->fields)
+    {
+        memmove(fields->index + 1, fields->index, fields->count * sizeof(int));
+        fields->index[0] = FIELD_VAULT;
+        fields->count++;
+    }
+
+    if(count == 0)
+        count = state->vault_count;
+
+    if(count == 0)
+    {
+        fprintf(stderr, "No vaults to search.\n");
+        return;
+    }
+
+    jobs = tmalloc(count * sizeof(Search_job_t));
+    memset(jobs, 0, count * sizeof(Search_job_t));
+
+    for(int i = 0; i < count; i++)
+    {
+        Search_job_t *job = &jobs[i];
+
+        job->search = search;
+        job->lock_timeout = state->lock_timeout;
+
+        if(!vaults)
+        {
+            job->label = state->vaults[i].name;
+            job->path = state->vaults[i].path;
+        }
+        else
+        {
+            job->label = vaults[i];
+            job->path = vaults[i];
+
+            for(int j = 0; j < state->vault_count; j++)
+            {
+                if(strcmp(state->vaults[j].name, vaults[i]) == 0)
+                    job->path = state->vaults[j].path;
+            }
+        }
+
+        if(!file_exists(job->path))
+        {
+            fprintf(stderr, "Vault %s not found.\n", job->label);
+            job->path = NULL;
+            continue;
+        }
+
+        if(is_file_encrypted(job->path))
+        {
+            size_t pwdlen = 1024;
+            char pass[pwdlen];
+            char *ptr = pass;
+            char *prompt = tmalloc(strlen(job->label) + 16);
+
+            sprintf(prompt, "Password for %s: ", job->label);
+            my_getpass(prompt, &ptr, &pwdlen, stdin);
+            free(prompt);
+
+            job->passphrase = strdup(pass);
+            memset(pass, 0, sizeof(pass));
+        }
+    }
+
+    search_vaults(jobs, count, &state->list_options);
+
+    formatter_begin(&formatter);
+    search_merge(jobs, count, &state->list_options, write_found_row,
+                 &formatter);
+    formatter_end(&formatter);
+
+    for(int i = 0; i < count; i++)
+        search_job_free(&jobs[i]);
+
+    free(jobs);
+}
+
+/* Audits passwords of the active database. Kind is strength,
+ * reuse or breached, which checks them against the hash file
+ * at path.
+ */
+void audit(State_t *state, const char *kind, const char *path)
+{
+    Formatter_t formatter;
+    const char *default_fields;
+    int lock;
+
+    if(strcmp(kind, "strength") == 0)
+        default_fields = "id,title,user,score,guesses_log10,pattern";
+    else if(strcmp(kind, "reuse") == 0)
+        default_fields = "group,id,title,user,url";
+    else if(strcmp(kind, "breached") == 0)
+        default_fields = "id,title,user,url,breaches";
+    else
+    {
+        fprintf(stderr, "Unknown audit %s.\n", kind);
+        return;
+    }
+
+    if(!state->db_active)
+    {
+        fprintf(stderr, "No decrypted database found.\n");
+        return;
+    }
+
+    if(!setup_formatter(&formatter, stdout, state, TITAN_FORMAT_TABLE, true))
+        return;
+
+    if(!state->fields)
+        fields_parse(default_fields, &formatter.fields);
+
+    lock = lock_active_database(state, TITAN_LOCK_SHARED);
+
+    if(lock == -1)
+        return;
+
+    if(strcmp(kind, "strength") == 0)
+        audit_strength(state, &formatter, &state->list_options);
+    else if(strcmp(kind, "reuse") == 0)
+        audit_reuse(state, &formatter, &state->list_options);
+    else
+        audit_breached(state, &formatter, &state->list_options, path);
+
+    unlock_database(lock);
+}
+
+/* Serves find, get and list requests for the active database
+ * on a Unix socket until interrupted.
+ */
+void serve(State_t *state, const char *socket_path)
+{
+    Fields_t fields;
+
+    if(!state->db_active)
+    {
+        fprintf(stderr, "No decrypted database found.\n");
+        return;
     }
+
+    if(!fields_parse(state->fields, &fields))
+        return;
+
+    server_run(state, socket_path, &fields, state->show_password != 1);
+}
+
+/* Opens a decrypted vault other than the active one for merge,
+ * holding a shared lock on it.
+ */
+static struct sqlite3 *open_merge_vault(State_t *state, const char *path,
+                                        int *lock)
+{
+    struct sqlite3 *db = NULL;
+
+    if(!file_exists(path))
+    {
+        fprintf(stderr, "File %s does not exist.\n", path);
+        return NULL;
+    }
+
+    *lock = lock_database(path, TITAN_LOCK_SHARED, state->lock_timeout);
+
+    if(*lock == -1)
+        return NULL;
+
+    if(is_file_encrypted(path))
+        fprintf(stderr, "Database %s is encrypted, decrypt it first.\n", path);
     else
+        db = db_open(path, state->lock_timeout);
+
+    if(!db)
+    {
+        unlock_database(*lock);
+        *lock = -1;
+    }
+
+    return db;
+}
+
+/* Merges another copy of the active database into it. Base is the
+ * common ancestor of both copies or NULL if not known.
+ */
+void merge(State_t *state, const char *other, const char *base)
+{
+    Merge_result_t result;
+    struct sqlite3 *local_db = NULL;
+    struct sqlite3 *other_db = NULL;
+    struct sqlite3 *base_db = NULL;
+    int other_lock = -1;
+    int base_lock = -1;
+    int lock;
+    bool ok;
+
+    if(!state->db_active)
+    {
+        fprintf(stderr, "No decrypted database found.\n");
+        return;
+    }
+
+    lock = lock_active_database(state, TITAN_LOCK_EXCLUSIVE);
+
+    if(lock == -1)
+        return;
+
+    ok = (local_db = db_open(state->db_path, state->lock_timeout)) != NULL &&
+         (other_db = open_merge_vault(state, other, &other_lock)) != NULL &&
+         (!base || (base_db = open_merge_vault(state, base, &base_lock)) != NULL) &&
+         merge_vaults(local_db, other_db, base_db, &result);
+
+    if(ok)
     {
-        fprintf(stdout, "%s\n", path);
-        free(path);
+        fprintf(stdout, "Merged %s: %d added, %d updated, %d deleted, "
+                "%d conflicts.\n", other, result.added, result.updated,
+                result.deleted, result.conflicts);
     }
+
+    db_close(base_db);
+    db_close(other_db);
+    db_close(local_db);
+    unlock_database(base_lock);
+    unlock_database(other_lock);
+    unlock_database(lock);
 }
 
-void set_use_db(const char *path)
+/* Lists all unlocked vaults and their database paths */
+void list_vaults(State_t *state)
 {
-    if(has_active_database())
+    for(int i = 0; i < state->vault_count; i++)
+        fprintf(stdout, "%s\t%s\n", state->vaults[i].name, state->vaults[i].path);
+}
+
+void set_use_db(State_t *state, const char *path)
+{
+    if(state->db_active)
     {
         fprintf(stderr, "Current database is decrypted, encrypt it first.\n");
         return;
     }
 
-    write_active_database_path(path);
+    state_set_active_database(state, path);
+}
+
+/* Exports the active database into path, "-" means stdout.
+ * The export contains plain text passwords unless they are left
+ * out with fields, so the file is created readable only by the owner.
+ * Returns false if the export failed.
+ */
+bool export_database(State_t *state, const char *path)
+{
+    Formatter_t formatter;
+    FILE *out = NULL;
+    bool ok = false;
+    int fd;
+    int lock;
+
+    if(!state->db_active)
+    {
+        fprintf(stderr, "No decrypted database found.\n");
+        return false;
+    }
+
+    if(strcmp(path, "-") == 0)
+    {
+        if(!setup_formatter(&formatter, stdout, state, TITAN_FORMAT_JSONL, false))
+            return false;
+
+        lock = lock_active_database(state, TITAN_LOCK_SHARED);
+
+        ok = lock != -1 && db_list_all(state, &formatter, &state->list_options);
+
+        if(!ok)
+            fprintf(stderr, "Export failed.\n");
+
+        unlock_database(lock);
+
+        return ok;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if(fd == -1 || (out = fdopen(fd, "w")) == NULL)
+    {
+        fprintf(stderr, "Unable to open %s for writing.\n", path);
+
+        if(fd != -1)
+            close(fd);
+
+        return false;
+    }
+
+    if(setup_formatter(&formatter, out, state, TITAN_FORMAT_JSONL, false))
+    {
+        lock = lock_active_database(state, TITAN_LOCK_SHARED);
+
+        ok = lock != -1 && db_list_all(state, &formatter, &state->list_options);
+
+        if(!ok)
+            fprintf(stderr, "Export to %s failed.\n", path);
+
+        unlock_database(lock);
+    }
+
+    if(fclose(out) != 0 && ok)
+    {
+        fprintf(stderr, "Export to %s failed.\n", path);
+        ok = false;
+    }
+
+    return ok;
 }
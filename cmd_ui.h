@@ -5,17 +5,26 @@
 #ifndef __CMD_UI_H
 #define __CMD_UI_H
 
-void init_database(const char *path, int force, int auto_encrypt);
-bool add_new_entry(int auto_encrypt);
-bool edit_entry(int id, int auto_encrypt);
-bool remove_entry(int id, int auto_encrypt);
-void list_by_id(int id, int show_password, int auto_encrypt);
-void list_all(int show_password, int auto_encrypt);
-void find(const char *search, int show_password, int auto_encrypt);
-void show_current_db_path();
-void set_use_db(const char *path);
+void init_database(State_t *state, const char *path);
+bool add_new_entry(State_t *state);
+bool edit_entry(State_t *state, int id);
+bool remove_entry(State_t *state, int id);
+void list_by_id(State_t *state, int id);
+void list_all(State_t *state);
+void find(State_t *state, const char *search);
+void changed_since(State_t *state, const char *time);
+void attach_file(State_t *state, int id, const char *path);
+void extract_file(State_t *state, int id, const char *name);
+void find_all(State_t *state, const char *search, int count, char **vaults);
+void show_current_db_path(State_t *state);
+void set_use_db(State_t *state, const char *path);
+void list_vaults(State_t *state);
+void audit(State_t *state, const char *kind, const char *path);
+void serve(State_t *state, const char *socket_path);
+void merge(State_t *state, const char *other, const char *base);
 
-void decrypt_database(const char *path);
-void encrypt_database();
+void decrypt_database(State_t *state, const char *path);
+bool encrypt_database(State_t *state);
+bool export_database(State_t *state, const char *path);
 
 #endif
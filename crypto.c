@@ -12,6 +12,7 @@
 #include <openssl/hmac.h>
 #include "crypto.h"
 #include "utils.h"
+#include "stats.h"
 
 //Our magic number that's written into the
 //encrypted file. Used to determine if the file
@@ -69,10 +70,14 @@ static Key_t generate_key(const char *passphrase, char *old_salt,
         return key;
     }
 
+    double start = stats_start();
+
     success = PKCS5_PBKDF2_HMAC(passphrase, strlen(passphrase), (unsigned char*)salt,
                                 SALT_SIZE, iterations, EVP_sha256(),
                                 KEY_SIZE, (unsigned char*)resultbytes);
 
+    stats_stop(STATS_KDF, start);
+
     if(success == 0)
     {
         free(salt);
@@ -115,6 +120,7 @@ static bool encrypt_decrypt(unsigned char *data_in, int data_in_len,
     int output_len = 0;
     int output_len_final = 0;
     int cipher_block_size;
+    double start = stats_start();
 
     ctx = EVP_CIPHER_CTX_new();
 
@@ -143,7 +149,8 @@ static bool encrypt_decrypt(unsigned char *data_in, int data_in_len,
         return false;
     }
 
-    fwrite(out_buffer, sizeof(unsigned char), output_len + output_len_final, out);
+    stats_stop(STATS_CIPHER, start);
+    stats_fwrite(out_buffer, sizeof(unsigned char), output_len + output_len_final, out);
 
     free(out_buffer);
 
@@ -156,8 +163,13 @@ static unsigned char *hmac_data(const void *key, int key_len,
                                unsigned char *data, int data_len,
                                unsigned char *result, int *res_len)
 {
-    return HMAC(EVP_sha512(), key, key_len, data, data_len, result,
-                (unsigned int *)res_len);
+    double start = stats_start();
+    unsigned char *hmac = HMAC(EVP_sha512(), key, key_len, data, data_len,
+                               result, (unsigned int *)res_len);
+
+    stats_stop(STATS_CIPHER, start);
+
+    return hmac;
 }
 
 //Calculates hmac from the content of fp and writes the hash
@@ -175,14 +187,14 @@ static bool calculate_and_write_hmac(FILE *fp, const void *key)
     fseek(fp, 0, SEEK_SET);
 
     cipher_buffer = tmalloc(cipherlen * sizeof(char));
-    fread(cipher_buffer, sizeof(char), cipherlen, fp);
+    stats_fread(cipher_buffer, sizeof(char), cipherlen, fp);
 
     hmac_sha512 = tmalloc(HMAC_SHA512_SIZE);
 
     hmac_data(key, KEY_SIZE, (unsigned char *)cipher_buffer,cipherlen,
               (unsigned char *)hmac_sha512, &len);
 
-    fwrite(hmac_sha512, 1, HMAC_SHA512_SIZE, fp);
+    stats_fwrite(hmac_sha512, 1, HMAC_SHA512_SIZE, fp);
 
     free(cipher_buffer);
     free(hmac_sha512);
@@ -214,7 +226,7 @@ static bool read_and_verify_hmac(const char *path, char *hmac, const void *key)
     buffer = tmalloc(offset * sizeof(char));
 
     //read whole file until hmac
-    fread(buffer, sizeof(char), offset, fp);
+    stats_fread(buffer, sizeof(char), offset, fp);
 
     hmac_data(key, KEY_SIZE, (unsigned char*)buffer, offset,
              (unsigned char*)new_hmac, &result);
@@ -252,7 +264,7 @@ bool is_file_encrypted(const char *path)
     fseek(fp, len - offset, SEEK_CUR);
 
     //Read our magic header
-    fread((void*)&data, sizeof(MAGIC_HEADER), 1, fp);
+    stats_fread((void*)&data, sizeof(MAGIC_HEADER), 1, fp);
     fclose(fp);
 
     if(data != MAGIC_HEADER)
@@ -307,7 +319,7 @@ bool encrypt_file(const char *passphrase, const char *path)
 
     plain_data = tmalloc(plain_len * sizeof(char));
 
-    fread(plain_data, sizeof(char), plain_len, plain);
+    stats_fread(plain_data, sizeof(char), plain_len, plain);
     fclose(plain);
 
     output_filename = get_output_filename(path, ".titan");
@@ -337,9 +349,9 @@ bool encrypt_file(const char *passphrase, const char *path)
                     TITAN_MODE_ENCRYPT);
 
     //write iv etc. into the end of the file
-    fwrite((void*)&MAGIC_HEADER, sizeof(MAGIC_HEADER), 1, cipher_fp);
-    fwrite(iv, 1, IV_SIZE, cipher_fp);
-    fwrite(key.salt, 1, SALT_SIZE, cipher_fp);
+    stats_fwrite((void*)&MAGIC_HEADER, sizeof(MAGIC_HEADER), 1, cipher_fp);
+    stats_fwrite(iv, 1, IV_SIZE, cipher_fp);
+    stats_fwrite(key.salt, 1, SALT_SIZE, cipher_fp);
 
     //Close the file pointer, to sync the data, before reading it again
     //for the hmac calculation
@@ -372,14 +384,15 @@ bool encrypt_file(const char *passphrase, const char *path)
     return true;
 }
 
-bool decrypt_file(const char *passphrase, const char *path)
+//Verifies and decrypts the file at path and writes the plain
+//data into out. Caller must close out.
+static bool decrypt_to_stream(const char *passphrase, const char *path,
+                              FILE *out)
 {
     bool ok;
     char *iv = NULL;
     char *salt = NULL;
-    FILE *plain = NULL;
     FILE *cipher = NULL;
-    char *output_filename = NULL;
     char *cipher_data = NULL;
     char *hmac;
 
@@ -414,9 +427,10 @@ bool decrypt_file(const char *passphrase, const char *path)
     //Skip the magic header
     fseek(cipher, sizeof(int), SEEK_CUR);
     //iv, salt
-    fread(iv, IV_SIZE, 1, cipher);
-    fread(salt, SALT_SIZE, 1, cipher);
-    fread(hmac, HMAC_SHA512_SIZE, 1, cipher);
+    stats_fread(iv, IV_SIZE, 1, cipher);
+    stats_fread(salt, SALT_SIZE, 1, cipher);
+    stats_fread(hmac, HMAC_SHA512_SIZE, 1, cipher);
+    fclose(cipher);
 
     Key_t key = generate_key(passphrase, salt, &ok);
 
@@ -429,8 +443,6 @@ bool decrypt_file(const char *passphrase, const char *path)
         return false;
     }
 
-    fclose(cipher);
-
     if(!read_and_verify_hmac(path, hmac, key.data))
     {
         fprintf(stderr, "Invalid password or tampered data. Aborted.\n");
@@ -445,19 +457,31 @@ bool decrypt_file(const char *passphrase, const char *path)
     cipher_data = tmalloc(offset * sizeof(char));
 
     //read all data, skip header, salt, iv
-    fread(cipher_data, sizeof(char), offset, cipher);
+    stats_fread(cipher_data, sizeof(char), offset, cipher);
     fclose(cipher);
 
+    ok = encrypt_decrypt((unsigned char*)cipher_data, offset, out,
+                         (unsigned char *)key.data, (unsigned char *)iv,
+                         TITAN_MODE_DECRYPT);
+
+    free(iv);
+    free(salt);
+    free(cipher_data);
+    free(hmac);
+
+    return ok;
+}
+
+bool decrypt_file(const char *passphrase, const char *path)
+{
+    FILE *plain = NULL;
+    char *output_filename = NULL;
+
     output_filename = get_output_filename(path, ".plain");
 
     if(!output_filename)
     {
         fprintf(stderr, "Unable to create output filename.\n");
-        free(iv);
-        free(salt);
-        free(cipher_data);
-        free(hmac);
-
         return false;
     }
 
@@ -466,18 +490,21 @@ bool decrypt_file(const char *passphrase, const char *path)
     if(!plain)
     {
         fprintf(stderr, "Unable to open %s for writing.\n", output_filename);
-        free(iv);
-        free(salt);
         free(output_filename);
-        free(cipher_data);
-        free(hmac);
 
         return false;
     }
 
-    encrypt_decrypt((unsigned char*)cipher_data, offset, plain,
-                    (unsigned char *)key.data, (unsigned char *)iv,
-                    TITAN_MODE_DECRYPT);
+    if(!decrypt_to_stream(passphrase, path, plain))
+    {
+        fclose(plain);
+        remove(output_filename);
+        free(output_filename);
+
+        return false;
+    }
+
+    fclose(plain);
 
     //Finally remove the cipher file
     if(remove(path) != 0)
@@ -489,11 +516,271 @@ bool decrypt_file(const char *passphrase, const char *path)
     rename(output_filename, path);
     free(output_filename);
 
+    return true;
+}
+
+//Decrypts the file at path into memory without writing the
+//plain data to disk. Caller must free *data.
+bool decrypt_to_memory(const char *passphrase, const char *path,
+                       char **data, size_t *len)
+{
+    FILE *out = NULL;
+
+    *data = NULL;
+    *len = 0;
+
+    out = open_memstream(data, len);
+
+    if(!out)
+    {
+        fprintf(stderr, "Unable to allocate memory for %s.\n", path);
+        return false;
+    }
+
+    if(!decrypt_to_stream(passphrase, path, out))
+    {
+        fclose(out);
+        free(*data);
+        *data = NULL;
+        *len = 0;
+
+        return false;
+    }
+
+    fclose(out);
+
+    return true;
+}
+
+/* Derives key from passphrase and salt, or a new random salt if salt
+ * is NULL. Key can be used for any number of encrypt_with_key calls.
+ */
+bool derive_key(const char *passphrase, const char *salt, Key_t *key)
+{
+    bool ok;
+
+    *key = generate_key(passphrase, (char *)salt, &ok);
+
+    if(!ok)
+        fprintf(stderr, "Key derivation failed.\n");
+
+    return ok;
+}
+
+/* Calculates hmac of len bytes of data with key */
+void key_hmac(const Key_t *key, const char *data, size_t len, char *hmac)
+{
+    int hmac_len = 0;
+
+    hmac_data(key->data, KEY_SIZE, (unsigned char *)data, len,
+              (unsigned char *)hmac, &hmac_len);
+}
+
+/* Encrypts len bytes of data into memory with key, laid out the same
+ * way as an encrypted file. Caller must free *out.
+ */
+bool encrypt_with_key(const Key_t *key, const char *data, size_t len,
+                      char **out, size_t *out_len)
+{
+    bool ok;
+    char *iv = NULL;
+    FILE *fp = NULL;
+
+    *out = NULL;
+    *out_len = 0;
+
+    iv = generate_random_data(IV_SIZE);
+
+    if(!iv)
+    {
+        fprintf(stderr, "Initialization vector generation failed.\n");
+        return false;
+    }
+
+    fp = open_memstream(out, out_len);
+
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to allocate memory.\n");
+        free(iv);
+        return false;
+    }
+
+    ok = encrypt_decrypt((unsigned char *)data, len, fp,
+                         (unsigned char *)key->data, (unsigned char *)iv,
+                         TITAN_MODE_ENCRYPT);
+
+    fwrite((void*)&MAGIC_HEADER, sizeof(MAGIC_HEADER), 1, fp);
+    fwrite(iv, 1, IV_SIZE, fp);
+    fwrite(key->salt, 1, SALT_SIZE, fp);
+    fclose(fp);
     free(iv);
-    free(salt);
-    fclose(plain);
-    free(cipher_data);
-    free(hmac);
+
+    //Room for the hmac of everything before it
+    char *buffer = ok ? realloc(*out, *out_len + HMAC_SHA512_SIZE) : NULL;
+
+    if(!buffer)
+    {
+        free(*out);
+        *out = NULL;
+        *out_len = 0;
+
+        return false;
+    }
+
+    key_hmac(key, buffer, *out_len, buffer + *out_len);
+
+    *out = buffer;
+    *out_len += HMAC_SHA512_SIZE;
 
     return true;
 }
+
+/* Encrypts len bytes of data into memory, laid out the same way as
+ * an encrypted file. Caller must free *out.
+ */
+bool encrypt_to_memory(const char *passphrase, const char *data, size_t len,
+                       char **out, size_t *out_len)
+{
+    Key_t key;
+
+    *out = NULL;
+    *out_len = 0;
+
+    return derive_key(passphrase, NULL, &key) &&
+           encrypt_with_key(&key, data, len, out, out_len);
+}
+
+/* Returns the salt of data laid out like an encrypted file, NULL if
+ * data is not.
+ */
+static const char *memory_salt(const char *data, size_t len)
+{
+    size_t trailer = sizeof(int) + IV_SIZE + SALT_SIZE + HMAC_SHA512_SIZE;
+    int magic;
+
+    if(len < trailer)
+        return NULL;
+
+    memcpy(&magic, data + len - trailer, sizeof(int));
+
+    if(magic != MAGIC_HEADER)
+        return NULL;
+
+    return data + len - SALT_SIZE - HMAC_SHA512_SIZE;
+}
+
+/* Decrypts data written by encrypt_with_key with the same key. Caller
+ * must free *out. Returns false if data was encrypted with another
+ * key or has been tampered.
+ */
+bool decrypt_with_key(const Key_t *key, const char *data, size_t len,
+                      char **out, size_t *out_len)
+{
+    bool ok;
+    char hmac[HMAC_SHA512_SIZE];
+    const char *salt = memory_salt(data, len);
+    FILE *fp = NULL;
+
+    *out = NULL;
+    *out_len = 0;
+
+    if(!salt || CRYPTO_memcmp(salt, key->salt, SALT_SIZE) != 0)
+        return false;
+
+    size_t offset = len - sizeof(int) - IV_SIZE - SALT_SIZE - HMAC_SHA512_SIZE;
+    const char *iv = data + offset + sizeof(int);
+
+    key_hmac(key, data, len - HMAC_SHA512_SIZE, hmac);
+
+    if(CRYPTO_memcmp(hmac, data + len - HMAC_SHA512_SIZE, HMAC_SHA512_SIZE) != 0)
+        return false;
+
+    fp = open_memstream(out, out_len);
+
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to allocate memory.\n");
+        return false;
+    }
+
+    ok = encrypt_decrypt((unsigned char *)data, offset, fp,
+                         (unsigned char *)key->data, (unsigned char *)iv,
+                         TITAN_MODE_DECRYPT);
+    fclose(fp);
+
+    if(!ok)
+    {
+        free(*out);
+        *out = NULL;
+        *out_len = 0;
+    }
+
+    return ok;
+}
+
+/* Decrypts data written by encrypt_to_memory. Caller must free *out.
+ * Returns false if passphrase is wrong or data has been tampered.
+ */
+bool decrypt_from_memory(const char *passphrase, const char *data, size_t len,
+                         char **out, size_t *out_len)
+{
+    const char *salt = memory_salt(data, len);
+    Key_t key;
+
+    *out = NULL;
+    *out_len = 0;
+
+    return salt && derive_key(passphrase, salt, &key) &&
+           decrypt_with_key(&key, data, len, out, out_len);
+}
+
+/* Reads the hmac stored at the end of an encrypted file, which
+ * identifies its content.
+ */
+bool read_file_hmac(const char *path, char *hmac)
+{
+    FILE *fp = fopen(path, "r");
+    bool ok;
+
+    if(!fp)
+        return false;
+
+    ok = fseek(fp, -HMAC_SHA512_SIZE, SEEK_END) == 0 &&
+         stats_fread(hmac, HMAC_SHA512_SIZE, 1, fp) == 1;
+
+    fclose(fp);
+
+    return ok;
+}
+
+/* Returns true if passphrase decrypts the encrypted file at path */
+bool verify_file(const char *passphrase, const char *path)
+{
+    bool ok;
+    char salt[SALT_SIZE];
+    char hmac[HMAC_SHA512_SIZE];
+    FILE *fp = NULL;
+
+    if(!is_file_encrypted(path))
+        return false;
+
+    fp = fopen(path, "r");
+
+    if(!fp)
+        return false;
+
+    //Salt and hmac are the last fields of the file
+    ok = fseek(fp, -(SALT_SIZE + HMAC_SHA512_SIZE), SEEK_END) == 0 &&
+         stats_fread(salt, SALT_SIZE, 1, fp) == 1 &&
+         stats_fread(hmac, HMAC_SHA512_SIZE, 1, fp) == 1;
+
+    fclose(fp);
+
+    if(!ok)
+        return false;
+
+    Key_t key = generate_key(passphrase, salt, &ok);
+
+    return ok && read_and_verify_hmac(path, hmac, key.data);
+}
@@ -22,6 +22,20 @@ typedef struct Key
 
 bool encrypt_file(const char *passphrase, const char *path);
 bool decrypt_file(const char *passphrase, const char *path);
+bool decrypt_to_memory(const char *passphrase, const char *path,
+                       char **data, size_t *len);
+bool encrypt_to_memory(const char *passphrase, const char *data, size_t len,
+                       char **out, size_t *out_len);
+bool decrypt_from_memory(const char *passphrase, const char *data, size_t len,
+                         char **out, size_t *out_len);
+bool derive_key(const char *passphrase, const char *salt, Key_t *key);
+void key_hmac(const Key_t *key, const char *data, size_t len, char *hmac);
+bool encrypt_with_key(const Key_t *key, const char *data, size_t len,
+                      char **out, size_t *out_len);
+bool decrypt_with_key(const Key_t *key, const char *data, size_t len,
+                      char **out, size_t *out_len);
+bool read_file_hmac(const char *path, char *hmac);
+bool verify_file(const char *passphrase, const char *path);
 bool is_file_encrypted(const char *path);
 
 #endif
@@ -8,454 +8,1607 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <sqlite3.h>
+#include <openssl/crypto.h>
 #include "entry.h"
+#include "format.h"
+#include "state.h"
 #include "db.h"
 #include "utils.h"
+#include "stats.h"
+#include "query.h"
 
 /* sqlite callbacks */
 static int cb_check_integrity(void *notused, int argc, char **argv, char **column_name);
-static int cb_get_by_id(void *entry, int argc, char **argv, char **column_name);
-static int cb_list_all(void *show_password, int argc, char **argv, char **column_name);
-static int cb_find(void *show_password, int argc, char **argv, char **column_name);
+
+/* Closes db and counts the pages it had to read from disk */
+void db_close(sqlite3 *db)
+{
+    int current = 0;
+    int highwater = 0;
+
+    if(db && stats_enabled() &&
+       sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &current,
+                         &highwater, 0) == SQLITE_OK)
+        stats_add(STATS_PAGES_READ, current);
+
+    sqlite3_close(db);
+}
+
+/* Statements of a connection can run interleaved, each is
+ * reported with its own counters.
+ */
+#define PROFILE_SLOTS (8)
+
+/* Rows returned by statements being profiled, kept by State_t so
+ * no counters are shared between connections of different callers.
+ */
+typedef struct _profile
+{
+    sqlite3_stmt *stmts[PROFILE_SLOTS];
+    long rows[PROFILE_SLOTS];
+    /* Monotonic time the statement started running */
+    struct timespec started[PROFILE_SLOTS];
+
+} Profile_t;
+
+/* Returns the slot of stmt, taking a free one for a statement not
+ * seen yet, or -1 if every slot is taken.
+ */
+static int profile_slot(Profile_t *profile, sqlite3_stmt *stmt)
+{
+    int slot = -1;
+
+    for(int i = 0; i < PROFILE_SLOTS; i++)
+    {
+        if(profile->stmts[i] == stmt)
+            return i;
+
+        if(slot == -1 && !profile->stmts[i])
+            slot = i;
+    }
+
+    if(slot != -1)
+    {
+        profile->stmts[slot] = stmt;
+        profile->rows[slot] = 0;
+        clock_gettime(CLOCK_MONOTONIC, &profile->started[slot]);
+    }
+
+    return slot;
+}
+
+/* Writes sql to stderr with string literals replaced by ?, so
+ * passwords in update statements are not shown.
+ */
+static void db_print_sql(const char *sql)
+{
+    bool literal = false;
+
+    for(const char *p = sql; *p != '\0'; p++)
+    {
+        if(*p == '\'')
+        {
+            //Quotes inside a literal are doubled
+            if(literal && p[1] == '\'')
+            {
+                p++;
+                continue;
+            }
+
+            literal = !literal;
+
+            if(literal)
+                fputc('?', stderr);
+        }
+        else if(!literal)
+        {
+            fputc(*p == '\n' ? ' ' : *p, stderr);
+        }
+    }
+
+    fputc('\n', stderr);
+}
+
+/* Trace callback of --profile-sql. Reports every finished statement
+ * with its counters, which are reset so a statement run several
+ * times is reported once per run. Time is measured here from the
+ * first step to the end of the run, the time sqlite passes in x
+ * has only millisecond resolution on most systems.
+ */
+static int db_profile(unsigned type, void *data, void *p, void *x)
+{
+    Profile_t *profile = data;
+    sqlite3_stmt *stmt = p;
+    int slot = profile_slot(profile, stmt);
+    struct timespec now;
+    double elapsed_ms;
+    long rows;
+
+    if(type == SQLITE_TRACE_STMT)
+        return 0;
+
+    if(type == SQLITE_TRACE_ROW)
+    {
+        if(slot != -1)
+            profile->rows[slot]++;
+
+        return 0;
+    }
+
+    if(slot == -1)
+    {
+        rows = 0;
+        elapsed_ms = *(sqlite3_int64 *)x / 1000000.0;
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        rows = profile->rows[slot];
+        elapsed_ms = (now.tv_sec - profile->started[slot].tv_sec) * 1000.0 +
+                     (now.tv_nsec - profile->started[slot].tv_nsec) / 1000000.0;
+        profile->stmts[slot] = NULL;
+    }
+
+    //Plans shown by --explain
+    if(sqlite3_stmt_isexplain(stmt))
+        return 0;
+
+    fprintf(stderr, "sql: %.3f ms, %ld rows, %d steps, %d fullscan, "
+            "%d sort, %d autoindex: ", elapsed_ms, rows,
+            sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1),
+            sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1),
+            sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1),
+            sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1));
+    db_print_sql(sqlite3_sql(stmt));
+
+    return 0;
+}
+
+/* Writes EXPLAIN QUERY PLAN of query to stderr as a tree. Parameters
+ * of compiled, if not NULL, are bound first. sqlite plans LIKE with a
+ * bound pattern again once it knows the value, so the plan is the one
+ * the query runs with.
+ */
+void db_explain(sqlite3 *db, const char *query, Query_t *compiled)
+{
+    sqlite3_stmt *stmt;
+    int ids[64];
+    int depths[64];
+    int count = 0;
+    char *sql = sqlite3_mprintf("explain query plan %s", query);
+
+    if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_free(sql);
+        return;
+    }
+
+    if(compiled)
+        query_bind(compiled, stmt);
+
+    fprintf(stderr, "plan: ");
+    db_print_sql(query);
+
+    while(sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int id = sqlite3_column_int(stmt, 0);
+        int parent = sqlite3_column_int(stmt, 1);
+        int depth = 0;
+
+        for(int i = 0; i < count; i++)
+        {
+            if(ids[i] == parent)
+                depth = depths[i] + 1;
+        }
+
+        if(count < 64)
+        {
+            ids[count] = id;
+            depths[count] = depth;
+            count++;
+        }
+
+        fprintf(stderr, "%*s`--%s\n", depth * 3, "",
+                (const char *)sqlite3_column_text(stmt, 3));
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+}
+
+/* Prepares sql, showing its query plan first if --explain is given */
+static int db_prepare(State_t *state, sqlite3 *db, const char *sql,
+                      sqlite3_stmt **stmt)
+{
+    if(state->explain)
+        db_explain(db, sql, NULL);
+
+    return sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
+}
+
+/* sqlite3_step timed as query */
+int db_step(sqlite3_stmt *stmt)
+{
+    double start = stats_start();
+    int rc = sqlite3_step(stmt);
+
+    stats_stop(STATS_QUERY, start);
+
+    return rc;
+}
+
+/* sqlite3_exec timed as query */
+static int db_exec(sqlite3 *db, const char *sql,
+                   int (*callback)(void*, int, char**, char**),
+                   void *data, char **err)
+{
+    double start = stats_start();
+    int rc = sqlite3_exec(db, sql, callback, data, err);
+
+    stats_stop(STATS_QUERY, start);
+
+    return rc;
+}
 
 /*Run integrity check for the database to detect
  *malformed and corrupted databases. Returns true
  *if everything is ok, false if something is wrong.
  */
 static bool
-db_check_integrity(const char *path)
+db_check_integrity(sqlite3 *db)
 {
-    sqlite3 *db;
     char *err = NULL;
     int retval;
     char *sql;
+    double start = stats_start();
 
-    retval = sqlite3_open(path, &db);
+    sql = "pragma integrity_check;";
 
-    if(retval)
+    retval = sqlite3_exec(db, sql, cb_check_integrity, 0, &err);
+    stats_stop(STATS_INTEGRITY, start);
+
+    if(retval != SQLITE_OK)
     {
-        fprintf(stderr, "Can't initialize: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "SQL error: %s\n", err);
+        sqlite3_free(err);
         return false;
     }
 
-    sql = "pragma integrity_check;";
+    return true;
+}
+
+/* Schema migrations in the order they are applied. The database
+ * user_version tells how many of them have already been applied.
+ * Never change or reorder existing migrations, only append new ones.
+ */
+static const char *migrations[] =
+{
+    /* 1: Indexes used by sorted listings. Title and url are sorted
+     * case insensitively so the indexes use the same collation.
+     * Databases created before versioning may already have these.
+     */
+    "create index if not exists entries_title "
+    "on entries(title collate nocase);"
+    "create index if not exists entries_url "
+    "on entries(url collate nocase);"
+    "create index if not exists entries_timestamp "
+    "on entries(timestamp);",
+
+    /* 2: Modification time as integer epoch. Text timestamp is
+     * kept up to date for older versions of Titan.
+     */
+    "alter table entries add column modified integer;"
+    "update entries set modified=strftime('%s', timestamp, 'utc');"
+    "create index entries_modified on entries(modified);"
+    "drop index if exists entries_timestamp;",
+
+    /* 3: Ids of entries changed since the vault was decrypted. They
+     * are appended to the journal when the vault is encrypted again.
+     * Only updates of the journaled columns are changes, uuid is added
+     * by the next migration and hash updates of --merge are not.
+     */
+    "create table changes(id integer primary key);"
+    "create trigger changes_insert after insert on entries begin "
+    "insert or ignore into changes values(new.id); end;"
+    "create trigger changes_update after update of title,user,url,password,"
+    "notes,timestamp,modified,uuid on entries begin "
+    "insert or ignore into changes values(old.id);"
+    "insert or ignore into changes values(new.id); end;"
+    "create trigger changes_delete after delete on entries begin "
+    "insert or ignore into changes values(old.id); end;",
+
+    /* 4: Stable ids and content hashes used by --merge. Every entry
+     * gets a random uuid, ids of copies which diverged before the
+     * upgrade may belong to unrelated entries. Copies to be merged
+     * must therefore come from one upgraded vault. Hashes of changed
+     * entries and the merkle buckets holding them are cleared and
+     * computed again by the next merge.
+     */
+    "alter table entries add column uuid text;"
+    "alter table entries add column hash blob;"
+    "update entries set uuid=lower(hex(randomblob(16)));"
+    "create unique index entries_uuid on entries(uuid);"
+    "create index entries_stale on entries(id) where hash is null;"
+    "create table merkle(bucket text primary key, hash blob);"
+    "create trigger entries_new_uuid after insert on entries "
+    "when new.uuid is null begin "
+    "update entries set uuid=lower(hex(randomblob(16))) where id=new.id; end;"
+    "create trigger merkle_insert after insert on entries begin "
+    "delete from merkle where bucket in (substr(new.uuid,1,1),"
+    "substr(new.uuid,1,2),substr(new.uuid,1,3)); end;"
+    "create trigger merkle_update after update of title,user,url,password,"
+    "notes,uuid on entries begin "
+    "update entries set hash=null where id=new.id;"
+    "delete from merkle where bucket in (substr(old.uuid,1,1),"
+    "substr(old.uuid,1,2),substr(old.uuid,1,3),substr(new.uuid,1,1),"
+    "substr(new.uuid,1,2),substr(new.uuid,1,3)); end;"
+    "create trigger merkle_delete after delete on entries begin "
+    "delete from merkle where bucket in (substr(old.uuid,1,1),"
+    "substr(old.uuid,1,2),substr(old.uuid,1,3)); end;",
+
+    /* 5: Tombstones of deleted entries for --changed-since. Entry
+     * added back by a merge is no longer deleted.
+     */
+    "create table tombstones(uuid text primary key, id integer,"
+    "deleted integer);"
+    "create index tombstones_deleted on tombstones(deleted);"
+    "create index tombstones_id on tombstones(id);"
+    "create trigger tombstones_delete after delete on entries begin "
+    "insert or replace into tombstones values(old.uuid,old.id,"
+    "strftime('%s','now')); end;"
+    "create trigger tombstones_insert after insert on entries begin "
+    "delete from tombstones where uuid=new.uuid; end;",
+
+    /* 6: Files attached to entries, streamed in and out with
+     * sqlite3_blob. Attachments are not journaled, the vault is
+     * rewritten when they have changed.
+     */
+    "create table attachments(id integer primary key,"
+    "entry integer not null, name text not null, size integer not null,"
+    "data blob, unique(entry,name));"
+    "create table attachment_changes(id integer primary key);"
+    "create trigger attachments_insert after insert on attachments begin "
+    "insert or ignore into attachment_changes values(new.id); end;"
+    "create trigger attachments_update after update on attachments begin "
+    "insert or ignore into attachment_changes values(new.id); end;"
+    "create trigger attachments_delete after delete on attachments begin "
+    "insert or ignore into attachment_changes values(old.id); end;"
+    "create trigger entries_attachments after delete on entries begin "
+    "delete from attachments where entry=old.id; end;",
+
+    /* 7: Tags of entries. Primary key of entry_tags is ordered by
+     * tag so entries having a tag are a range of it. Tag changes are
+     * changes of the entry for the journal, and tags are part of the
+     * content hash used by --merge. Tag changes clear the hash of the
+     * entry and its merkle buckets like changes of the other values,
+     * hashes computed without tags are cleared. Time of the entry is
+     * updated for sorting, searches and --changed-since.
+     */
+    "create table tags(id integer primary key,"
+    "name text not null unique collate nocase);"
+    "create table entry_tags(tag integer not null, entry integer not null,"
+    "primary key(tag,entry)) without rowid;"
+    "create index entry_tags_entry on entry_tags(entry);"
+    "create trigger entry_tags_insert after insert on entry_tags begin "
+    "insert or ignore into changes values(new.entry);"
+    "update entries set hash=null,timestamp=datetime('now','localtime'),"
+    "modified=strftime('%s','now') where id=new.entry;"
+    "delete from merkle where bucket in (select substr(uuid,1,1) from "
+    "entries where id=new.entry union all select substr(uuid,1,2) from "
+    "entries where id=new.entry union all select substr(uuid,1,3) from "
+    "entries where id=new.entry); end;"
+    "create trigger entry_tags_delete after delete on entry_tags begin "
+    "insert or ignore into changes values(old.entry);"
+    "update entries set hash=null,timestamp=datetime('now','localtime'),"
+    "modified=strftime('%s','now') where id=old.entry;"
+    "delete from merkle where bucket in (select substr(uuid,1,1) from "
+    "entries where id=old.entry union all select substr(uuid,1,2) from "
+    "entries where id=old.entry union all select substr(uuid,1,3) from "
+    "entries where id=old.entry); end;"
+    "create trigger entries_tags after delete on entries begin "
+    "delete from entry_tags where entry=old.id; end;"
+    "update entries set hash=null;"
+    "delete from merkle;",
+
+    /* 8: Id of the journal an encrypted snapshot is followed by, so
+     * a missing or stale journal is noticed. See journal.c.
+     */
+    "create table journal(id text);",
+};
+
+#define MIGRATION_COUNT ((int)(sizeof(migrations) / sizeof(migrations[0])))
+
+/* Returns the schema version stored in the database
+ * header or -1 on failure.
+ */
+static int db_schema_version(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int version = -1;
+
+    if(sqlite3_prepare_v2(db, "pragma user_version;", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+
+    if(sqlite3_step(stmt) == SQLITE_ROW)
+        version = sqlite3_column_int(stmt, 0);
+
+    sqlite3_finalize(stmt);
+
+    return version;
+}
+
+/* Applies all pending migrations in a single transaction. Either
+ * every migration is applied and user_version updated, or
+ * the database is left untouched.
+ */
+bool db_migrate(sqlite3 *db)
+{
+    char *err = NULL;
+    char *query;
+    int version;
+
+    version = db_schema_version(db);
+
+    if(version == MIGRATION_COUNT)
+        return true;
+
+    if(sqlite3_exec(db, "begin immediate;", NULL, 0, &err) != SQLITE_OK)
+    {
+        fprintf(stderr, "Schema migration failed: %s\n", err);
+        sqlite3_free(err);
+
+        return false;
+    }
+
+    //Read again, another process may have migrated in the meanwhile
+    version = db_schema_version(db);
+
+    if(version < 0 || version > MIGRATION_COUNT)
+    {
+        fprintf(stderr, "Unsupported database version %d. "
+                "Database was created with a newer Titan.\n", version);
+        sqlite3_exec(db, "rollback;", NULL, 0, NULL);
+
+        return false;
+    }
+
+    for(; version < MIGRATION_COUNT; version++)
+    {
+        if(sqlite3_exec(db, migrations[version], NULL, 0, &err) != SQLITE_OK)
+        {
+            fprintf(stderr, "Schema migration %d failed: %s\n", version + 1, err);
+            sqlite3_free(err);
+            sqlite3_exec(db, "rollback;", NULL, 0, NULL);
+
+            return false;
+        }
+    }
+
+    query = sqlite3_mprintf("pragma user_version=%d;commit;", MIGRATION_COUNT);
+
+    if(sqlite3_exec(db, query, NULL, 0, &err) != SQLITE_OK)
+    {
+        fprintf(stderr, "Schema migration failed: %s\n", err);
+        sqlite3_free(err);
+        sqlite3_free(query);
+        sqlite3_exec(db, "rollback;", NULL, 0, NULL);
+
+        return false;
+    }
+
+    sqlite3_free(query);
+
+    return true;
+}
+
+/* Opens database at path, checking its integrity first if check
+ * is true. Schema is migrated if needed. Statements are reported
+ * on stderr, counted in profile, if profile is not NULL. Returns
+ * NULL on failure, otherwise caller must close the returned handle.
+ */
+static sqlite3 *db_connect(const char *path, int lock_timeout, bool check,
+                           Profile_t *profile)
+{
+    sqlite3 *db;
+    double start = stats_start();
+
+    int rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to open database: %s\n", sqlite3_errmsg(db));
+        db_close(db);
+
+        return NULL;
+    }
+
+    /* Readers don't block behind a writer in WAL mode. Mode is
+     * stored in the database so this is a no-op after first time.
+     */
+    sqlite3_busy_timeout(db, lock_timeout);
+    sqlite3_exec(db, "pragma journal_mode=wal;", NULL, 0, NULL);
+
+    if(profile)
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE |
+                         SQLITE_TRACE_ROW,
+                         db_profile, profile);
+
+    stats_stop(STATS_DB_OPEN, start);
+
+    if(check && !db_check_integrity(db))
+    {
+        fprintf(stderr, "Corrupted database. Abort.\n");
+        db_close(db);
+
+        return NULL;
+    }
+
+    start = stats_start();
+
+    if(!db_migrate(db))
+    {
+        db_close(db);
+        return NULL;
+    }
+
+    stats_stop(STATS_DB_OPEN, start);
+
+    return db;
+}
+
+/* Opens the active database of state. Integrity is checked
+ * only on the first open during the run.
+ */
+sqlite3 *db_open_active(State_t *state)
+{
+    sqlite3 *db;
+
+    if(!state->db_path)
+    {
+        fprintf(stderr, "Error getting database path\n");
+        return NULL;
+    }
+
+    if(state->profile_sql && !state->profile)
+    {
+        state->profile = tmalloc(sizeof(Profile_t));
+        memset(state->profile, 0, sizeof(Profile_t));
+    }
+
+    db = db_connect(state->db_path, state->lock_timeout, !state->db_checked,
+                    state->profile);
+
+    if(db)
+        state->db_checked = true;
+
+    return db;
+}
+
+/* Opens a connection to the database at path for callers keeping it
+ * open over several operations, such as libtitan. Integrity is
+ * checked every time. Returns NULL on failure, otherwise the handle
+ * must be closed with db_close.
+ */
+sqlite3 *db_open(const char *path, int lock_timeout)
+{
+    return db_connect(path, lock_timeout, true, NULL);
+}
+
+bool db_init_new(const char *path)
+{
+    sqlite3 *db;
+    char *err = NULL;
+
+    int rc = sqlite3_open(path, &db);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to initialize database: %s\n", sqlite3_errmsg(db));
+        db_close(db);
+
+        return false;
+    }
+
+    char *query = "create table entries"
+        "(id integer primary key, title text, user text, url text,"
+        "password text, notes text,"
+        "timestamp date default (datetime('now','localtime')));";
+
+    rc = sqlite3_exec(db, query, 0, 0, &err);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", err);
+        sqlite3_free(err);
+        db_close(db);
+
+        return false;
+    }
+
+    if(!db_migrate(db))
+    {
+        db_close(db);
+        return false;
+    }
+
+    db_close(db);
+
+    return true;
+}
+
+/* Merges the write-ahead log into the database file and switches
+ * back to rollback journal, so that the whole database is in a
+ * single file before encryption. Caller must hold an exclusive lock.
+ */
+bool db_checkpoint(const char *path)
+{
+    sqlite3 *db;
+    char *err = NULL;
+
+    int rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to open database: %s\n", sqlite3_errmsg(db));
+        db_close(db);
+
+        return false;
+    }
+
+    rc = sqlite3_exec(db, "pragma journal_mode=delete;", NULL, 0, &err);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", err);
+        sqlite3_free(err);
+        db_close(db);
+
+        return false;
+    }
+
+    db_close(db);
+
+    return true;
+}
+
+/* Inserts count entries in a single transaction, either all
+ * of them are added or none.
+ */
+bool db_insert_entries(State_t *state, Entry_t **entries, int count)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int rc;
+
+    db = db_open_active(state);
+
+    if(!db)
+        return false;
+
+    rc = db_exec(db, "begin;", NULL, NULL, NULL);
+
+    if(rc == SQLITE_OK)
+        rc = db_prepare(state, db, "insert into entries(title,user,url,password,"
+                        "notes,modified) values(?,?,?,?,?,"
+                        "strftime('%s','now'));", &stmt);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        db_close(db);
+
+        return false;
+    }
+
+    for(int i = 0; i < count && rc == SQLITE_OK; i++)
+    {
+        sqlite3_bind_text(stmt, 1, entries[i]->title, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, entries[i]->user, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, entries[i]->url, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 4, entries[i]->password, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 5, entries[i]->notes, -1, SQLITE_STATIC);
+
+        if(db_step(stmt) != SQLITE_DONE)
+            rc = SQLITE_ERROR;
+        else
+            sqlite3_reset(stmt);
+
+        if(rc == SQLITE_OK && entries[i]->tags &&
+           !db_set_tags(db, sqlite3_last_insert_rowid(db), entries[i]->tags))
+            rc = SQLITE_ERROR;
+    }
+
+    if(rc == SQLITE_OK)
+        rc = db_exec(db, "commit;", NULL, NULL, NULL);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        sqlite3_exec(db, "rollback;", NULL, NULL, NULL);
+        db_close(db);
+
+        return false;
+    }
+
+    sqlite3_finalize(stmt);
+    db_close(db);
+
+    return true;
+}
+
+/* Returns true on success, false on failure.
+ * Parameter changes is set to true if entry with given
+ * id was found and deleted.
+ */
+bool db_delete_entry(State_t *state, int id, bool *changes)
+{
+    sqlite3 *db;
+    int rc;
+    char *query;
+    char *err = NULL;
+    int count;
+
+    db = db_open_active(state);
+
+    if(!db)
+        return false;
+
+    query = sqlite3_mprintf("delete from entries where id=%d;", id);
+
+    if(state->explain)
+        db_explain(db, query, NULL);
+
+    rc = db_exec(db, query, NULL, 0, &err);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", err);
+        sqlite3_free(err);
+        sqlite3_free(query);
+        db_close(db);
+
+        return false;
+    }
+
+    count = sqlite3_changes(db);
+
+    if(count > 0)
+        *changes = true;
+
+    sqlite3_free(query);
+    db_close(db);
+
+    return true;
+}
+
+/* Steps through stmt and writes every row using formatter.
+ * Statement must select the columns in FIELD_* order. Rows are
+ * never collected in memory so this works for any database size.
+ */
+static bool write_rows(sqlite3 *db, sqlite3_stmt *stmt, Formatter_t *formatter)
+{
+    const char *values[FIELD_COUNT] = { NULL };
+    bool ok = true;
+    int rc;
+
+    formatter_begin(formatter);
+
+    while((rc = db_step(stmt)) == SQLITE_ROW)
+    {
+        for(int i = 0; i < ENTRY_FIELD_COUNT; i++)
+            values[i] = (const char *)sqlite3_column_text(stmt, i);
+
+        formatter_row(formatter, values);
+    }
+
+    if(rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        ok = false;
+    }
+
+    if(!formatter_end(formatter))
+    {
+        fprintf(stderr, "Error writing output.\n");
+        ok = false;
+    }
+
+    return ok;
+}
+
+/* Returns SORT_* matching name or -1 if entries
+ * cannot be sorted by it.
+ */
+int db_sort_from_name(const char *name)
+{
+    if(strcmp(name, "id") == 0)
+        return SORT_ID;
+    if(strcmp(name, "title") == 0)
+        return SORT_TITLE;
+    if(strcmp(name, "url") == 0)
+        return SORT_URL;
+    if(strcmp(name, "modified") == 0)
+        return SORT_MODIFIED;
+
+    return -1;
+}
+
+/* Copies the next tag of the comma separated list *tags without
+ * surrounding spaces and moves *tags past it. Returns NULL at the
+ * end of the list, otherwise caller must free the return value.
+ */
+static char *next_tag(const char **tags)
+{
+    while(**tags != '\0')
+    {
+        const char *start = *tags;
+        size_t len = strcspn(start, ",");
+
+        *tags += len;
+
+        if(**tags == ',')
+            (*tags)++;
+
+        while(len > 0 && isspace((unsigned char)*start))
+        {
+            start++;
+            len--;
+        }
+
+        while(len > 0 && isspace((unsigned char)start[len - 1]))
+            len--;
+
+        if(len > 0)
+            return strndup(start, len);
+    }
+
+    return NULL;
+}
+
+/* Replaces the tags of entry id with the comma separated list
+ * tags. Tags no longer used by any entry are removed.
+ */
+bool db_set_tags(sqlite3 *db, int id, const char *tags)
+{
+    sqlite3_stmt *clear = NULL;
+    sqlite3_stmt *add_tag = NULL;
+    sqlite3_stmt *tag_entry = NULL;
+    char *name;
+    bool ok;
+
+    ok = sqlite3_exec(db, "savepoint tags;", NULL, NULL, NULL) == SQLITE_OK &&
+         sqlite3_prepare_v2(db, "delete from entry_tags where entry=?;", -1,
+                            &clear, NULL) == SQLITE_OK &&
+         sqlite3_prepare_v2(db, "insert or ignore into tags(name) values(?);",
+                            -1, &add_tag, NULL) == SQLITE_OK &&
+         sqlite3_prepare_v2(db, "insert or ignore into entry_tags(tag,entry) "
+                            "select id,?2 from tags where name=?1;", -1,
+                            &tag_entry, NULL) == SQLITE_OK;
+
+    if(ok)
+    {
+        sqlite3_bind_int(clear, 1, id);
+        ok = db_step(clear) == SQLITE_DONE;
+    }
+
+    while(ok && (name = next_tag(&tags)) != NULL)
+    {
+        sqlite3_bind_text(add_tag, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(tag_entry, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_int(tag_entry, 2, id);
+
+        ok = db_step(add_tag) == SQLITE_DONE && db_step(tag_entry) == SQLITE_DONE;
+
+        sqlite3_reset(add_tag);
+        sqlite3_reset(tag_entry);
+        free(name);
+    }
+
+    ok = ok && sqlite3_exec(db, "delete from tags where not exists"
+                            "(select 1 from entry_tags where tag=tags.id);",
+                            NULL, NULL, NULL) == SQLITE_OK;
+
+    if(!ok)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "rollback to tags;", NULL, NULL, NULL);
+    }
+
+    sqlite3_exec(db, "release tags;", NULL, NULL, NULL);
+
+    sqlite3_finalize(clear);
+    sqlite3_finalize(add_tag);
+    sqlite3_finalize(tag_entry);
+
+    return ok;
+}
+
+/* Appends a condition matching entries having every tag of the comma
+ * separated list tags to query. Entries of each tag are a range of
+ * the entry_tags primary key and the ranges are intersected, so no
+ * entry without the tags is read.
+ */
+static char *append_tag_filter(char *query, const char *tags)
+{
+    char *name;
+    char *next;
+    int count = 0;
+
+    while((name = next_tag(&tags)) != NULL)
+    {
+        next = sqlite3_mprintf("%s%s select entry from entry_tags where "
+                               "tag=(select id from tags where name='%q')",
+                               query, count == 0 ? "id in (" : " intersect",
+                               name);
+        sqlite3_free(query);
+        free(name);
+
+        query = next;
+        count++;
+    }
+
+    //Only separators, nothing to filter
+    next = sqlite3_mprintf("%s%s", query, count > 0 ? ")" : "1");
+    sqlite3_free(query);
+
+    return next;
+}
+
+/* Appends tag filter, ordering and paging from options to the query.
+ * Has_where tells if the query already has a where clause. Every
+ * sort key has a matching index and id is used as a tie breaker,
+ * so sqlite can walk the index and stop after limit rows.
+ * Caller must free the return value with sqlite3_free.
+ */
+char *db_build_list_query(const char *query, bool has_where,
+                          List_options_t *options)
+{
+    static const char *order_by[] =
+    {
+        "id",
+        "title collate nocase",
+        "url collate nocase",
+        "modified"
+    };
+
+    const char *direction = options->reverse ? " desc" : "";
+    char *filtered = sqlite3_mprintf("%s", query);
+
+    if(options->with_tags)
+    {
+        char *next = sqlite3_mprintf("%s %s ", filtered,
+                                     has_where ? "and" : "where");
+
+        sqlite3_free(filtered);
+        filtered = append_tag_filter(next, options->with_tags);
+    }
+
+    //Ids are unique, sorting by id needs no tie breaker
+    const char *tie = options->sort != SORT_ID ? ", id" : "";
+    char *built = sqlite3_mprintf("%s order by %s%s%s%s limit %d offset %d;",
+                                  filtered, order_by[options->sort], direction,
+                                  tie, *tie ? direction : "", options->limit,
+                                  options->offset);
+
+    sqlite3_free(filtered);
+
+    return built;
+}
+
+/* Compiles search and builds the query of its matches, ordered and
+ * paged as specified by options. Returns NULL if search is invalid,
+ * otherwise the caller must free the return value with sqlite3_free
+ * and bind query before stepping the statement.
+ */
+char *db_build_find_query(const char *search, Query_t *query,
+                          List_options_t *options)
+{
+    if(!query_compile(search, query))
+    {
+        query_free(query);
+        return NULL;
+    }
+
+    char *select = sqlite3_mprintf("select id,title,user,url,password,notes,"
+                                   "datetime(modified,'unixepoch','localtime') "
+                                   "from entries where %s", query->where);
+    char *built = db_build_list_query(select, true, options);
+
+    sqlite3_free(select);
+
+    return built;
+}
+
+/* Writes all entries using formatter, ordered
+ * and paged as specified by options.
+ */
+bool db_list_all(State_t *state, Formatter_t *formatter, List_options_t *options)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    bool ok;
+    int rc;
+
+    db = db_open_active(state);
+
+    if(!db)
+        return false;
+
+    char *query = db_build_list_query("select id,title,user,url,password,notes,"
+                                   "datetime(modified,'unixepoch','localtime') "
+                                   "from entries", false, options);
+
+    rc = db_prepare(state, db, query, &stmt);
+    sqlite3_free(query);
+
+    if(rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        db_close(db);
+
+        return false;
+    }
+
+    ok = write_rows(db, stmt, formatter);
+
+    sqlite3_finalize(stmt);
+    db_close(db);
+
+    return ok;
+}
+
+/* Attachments are copied between files and blobs in chunks of this
+ * size, so no attachment is ever held in memory as a whole.
+ */
+#define ATTACHMENT_CHUNK_SIZE (64 * 1024)
+
+/* Fills the zeroed blob of attachment rowid with size bytes of fp */
+static bool write_blob(sqlite3 *db, sqlite3_int64 rowid, FILE *fp,
+                       sqlite3_int64 size)
+{
+    sqlite3_blob *blob;
+    sqlite3_int64 offset = 0;
+    char *chunk;
+    bool ok = true;
+
+    if(sqlite3_blob_open(db, "main", "attachments", "data", rowid, 1,
+                         &blob) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+
+    chunk = tmalloc(ATTACHMENT_CHUNK_SIZE);
+
+    while(ok && offset < size)
+    {
+        size_t len = stats_fread(chunk, 1, ATTACHMENT_CHUNK_SIZE, fp);
+
+        //File changed while it was read
+        if(len == 0 || offset + (sqlite3_int64)len > size)
+        {
+            fprintf(stderr, "Attached file changed while reading it.\n");
+            ok = false;
+            break;
+        }
+
+        ok = sqlite3_blob_write(blob, chunk, len, offset) == SQLITE_OK;
 
-    retval = sqlite3_exec(db, sql, cb_check_integrity, 0, &err);
+        if(!ok)
+            fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
 
-    if(retval != SQLITE_OK)
-    {
-        fprintf(stderr, "SQL error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_close(db);
-        return false;
+        offset += len;
     }
 
-    sqlite3_close(db);
+    OPENSSL_cleanse(chunk, ATTACHMENT_CHUNK_SIZE);
+    free(chunk);
+    sqlite3_blob_close(blob);
 
-    return true;
+    return ok;
 }
 
-bool db_init_new(const char *path)
+/* Writes the blob of attachment rowid into fp */
+static bool read_blob(sqlite3 *db, sqlite3_int64 rowid, FILE *fp)
 {
-    sqlite3 *db;
-    char *err = NULL;
-
-    int rc = sqlite3_open(path, &db);
-
-    if(rc != SQLITE_OK)
+    sqlite3_blob *blob;
+    char *chunk;
+    int offset = 0;
+    int size;
+    bool ok = true;
+
+    if(sqlite3_blob_open(db, "main", "attachments", "data", rowid, 0,
+                         &blob) != SQLITE_OK)
     {
-        fprintf(stderr, "Failed to initialize database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
         return false;
     }
 
-    char *query = "create table entries"
-        "(id integer primary key, title text, user text, url text,"
-        "password text, notes text,"
-        "timestamp date default (datetime('now','localtime')));";
-
-    rc = sqlite3_exec(db, query, 0, 0, &err);
+    chunk = tmalloc(ATTACHMENT_CHUNK_SIZE);
+    size = sqlite3_blob_bytes(blob);
 
-    if(rc != SQLITE_OK)
+    while(ok && offset < size)
     {
-        fprintf(stderr, "Error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_close(db);
+        int len = size - offset;
 
-        return false;
+        if(len > ATTACHMENT_CHUNK_SIZE)
+            len = ATTACHMENT_CHUNK_SIZE;
+
+        ok = sqlite3_blob_read(blob, chunk, len, offset) == SQLITE_OK &&
+             stats_fwrite(chunk, 1, len, fp) == (size_t)len;
+
+        offset += len;
     }
 
-    sqlite3_close(db);
+    if(!ok)
+        fprintf(stderr, "Error writing attachment.\n");
 
-    return true;
+    OPENSSL_cleanse(chunk, ATTACHMENT_CHUNK_SIZE);
+    free(chunk);
+    sqlite3_blob_close(blob);
+
+    return ok;
 }
 
-bool db_insert_entry(Entry_t *entry)
+/* Stores size bytes of fp as attachment name of entry id, replacing
+ * an attachment of the same name. Space for the content is reserved
+ * first and then written in chunks, all in one transaction.
+ */
+bool db_attach(State_t *state, int id, const char *name, FILE *fp,
+               long long size)
 {
     sqlite3 *db;
-    char *err = NULL;
-    char *path = NULL;
+    sqlite3_stmt *stmt;
+    bool exists = false;
+    bool ok;
 
-    path = read_active_database_path();
+    db = db_open_active(state);
 
-    if(!path)
-    {
-        fprintf(stderr, "Error getting database path\n");
+    if(!db)
         return false;
-    }
 
-    if(!db_check_integrity(path))
+    ok = db_exec(db, "begin immediate;", NULL, NULL, NULL) == SQLITE_OK &&
+         db_prepare(state, db, "select exists(select 1 from entries "
+                    "where id=?);", &stmt) == SQLITE_OK;
+
+    if(ok)
     {
-        fprintf(stderr, "Corrupted database. Abort.\n");
-        free(path);
-        return 0;
+        sqlite3_bind_int(stmt, 1, id);
+        exists = db_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
     }
 
-    int rc = sqlite3_open(path, &db);
+    //Zeroblob is only left unallocated when inserted from values
+    if(exists)
+        ok = db_prepare(state, db, "insert or replace into attachments"
+                        "(entry,name,size,data) values(?,?,?,zeroblob(?));",
+                        &stmt) == SQLITE_OK;
 
-    if(rc != SQLITE_OK)
+    if(ok && exists)
     {
-        fprintf(stderr, "Failed to initialize database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        free(path);
+        sqlite3_bind_int(stmt, 1, id);
+        sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, size);
+        sqlite3_bind_int64(stmt, 4, size);
 
-        return false;
+        ok = db_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    }
+
+    if(!ok)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+    else if(!exists)
+    {
+        fprintf(stderr, "No entry with id %d was found.\n", id);
+        ok = false;
     }
 
-    char *query = sqlite3_mprintf("insert into entries(title, user, url, password, notes)"
-                                  "values('%q','%q','%q','%q','%q')",
-                                  entry->title, entry->user, entry->url, entry->password,
-                                  entry->notes);
+    if(ok)
+        ok = write_blob(db, sqlite3_last_insert_rowid(db), fp, size) &&
+             db_exec(db, "commit;", NULL, NULL, NULL) == SQLITE_OK;
 
-    rc = sqlite3_exec(db, query, NULL, 0, &err);
+    if(!ok)
+        db_exec(db, "rollback;", NULL, NULL, NULL);
 
-    if(rc != SQLITE_OK)
-    {
-        fprintf(stderr, "Error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_free(query);
-        sqlite3_close(db);
-        free(path);
+    db_close(db);
 
-        return false;
-    }
+    return ok;
+}
 
-    sqlite3_free(query);
-    sqlite3_close(db);
-    free(path);
+/* Lists names of the attachments of entry id to stderr */
+static void print_attachment_names(sqlite3 *db, int id)
+{
+    sqlite3_stmt *stmt;
 
-    return true;
+    if(sqlite3_prepare_v2(db, "select name,size from attachments "
+                          "where entry=? order by name;", -1, &stmt,
+                          NULL) != SQLITE_OK)
+        return;
+
+    sqlite3_bind_int(stmt, 1, id);
+
+    while(db_step(stmt) == SQLITE_ROW)
+        fprintf(stderr, "    %s (%lld bytes)\n", sqlite3_column_text(stmt, 0),
+                sqlite3_column_int64(stmt, 1));
+
+    sqlite3_finalize(stmt);
 }
 
-bool db_update_entry(int id, Entry_t *new_entry)
+/* Writes attachment name of entry id into fp */
+bool db_extract(State_t *state, int id, const char *name, FILE *fp)
 {
     sqlite3 *db;
-    char *err = NULL;
-    char *path = NULL;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 rowid = 0;
+    bool ok;
+    int rc;
 
-    path = read_active_database_path();
+    db = db_open_active(state);
 
-    if(!path)
-    {
-        fprintf(stderr, "Error getting database path\n");
+    if(!db)
         return false;
-    }
 
-    if(!db_check_integrity(path))
+    if(db_prepare(state, db, "select id from attachments "
+                  "where entry=? and name=?;", &stmt) != SQLITE_OK)
     {
-        fprintf(stderr, "Corrupted database. Abort.\n");
-        free(path);
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        db_close(db);
 
-        return 0;
+        return false;
     }
 
-    int rc = sqlite3_open(path, &db);
-
-    if(rc != SQLITE_OK)
-    {
-        fprintf(stderr, "Failed to initialize database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        free(path);
+    sqlite3_bind_int(stmt, 1, id);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
 
-        return false;
-    }
+    rc = db_step(stmt);
 
-    char *query = sqlite3_mprintf("update entries set title='%q',"
-                                  "user='%q',"
-                                  "url='%q',"
-                                  "password='%q',"
-                                  "notes='%q',timestamp=datetime('now','localtime') where id=%d;",
-                                  new_entry->title,
-                                  new_entry->user,
-                                  new_entry->url,
-                                  new_entry->password,
-                                  new_entry->notes,id);
+    if(rc == SQLITE_ROW)
+        rowid = sqlite3_column_int64(stmt, 0);
 
-    rc = sqlite3_exec(db, query, NULL, 0, &err);
+    sqlite3_finalize(stmt);
 
-    if(rc != SQLITE_OK)
+    if(rc == SQLITE_ROW)
+        ok = read_blob(db, rowid, fp);
+    else
     {
-        fprintf(stderr, "Error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_free(query);
-        sqlite3_close(db);
-        free(path);
-
-        return false;
+        fprintf(stderr, "No attachment %s in entry %d. Attachments:\n", name, id);
+        print_attachment_names(db, id);
+        ok = false;
     }
 
-    sqlite3_free(query);
-    sqlite3_close(db);
-    free(path);
+    db_close(db);
 
-    return true;
+    return ok;
 }
 
-/*Get entry which has the wanted id.
- * Caller must free the return value.
+/* Writes entries changed or deleted at or after since, in seconds
+ * since the epoch, oldest change first and paged as specified by
+ * options. Deleted entries only have id, uuid and the time of
+ * deletion as modified. Both parts are read through their time
+ * indexes.
  */
-Entry_t *
-db_get_entry_by_id(int id)
+bool db_changed_since(State_t *state, long long since, Formatter_t *formatter,
+                      List_options_t *options)
 {
-    char *path = NULL;
+    const char *values[FIELD_COUNT] = { NULL };
     sqlite3 *db;
+    sqlite3_stmt *stmt;
+    bool ok = true;
     int rc;
-    char *query;
-    char *err = NULL;
-    Entry_t *entry = NULL;
 
-    path = read_active_database_path();
+    db = db_open_active(state);
 
-    if(!path)
-    {
-        fprintf(stderr, "Error getting database path\n");
-        return NULL;
-    }
+    if(!db)
+        return false;
+
+    char *query = sqlite3_mprintf("select id,title,user,url,password,notes,"
+                                  "datetime(modified,'unixepoch','localtime'),"
+                                  "uuid,'changed',modified "
+                                  "from entries where modified>=?1 "
+                                  "union all "
+                                  "select id,null,null,null,null,null,"
+                                  "datetime(deleted,'unixepoch','localtime'),"
+                                  "uuid,'deleted',deleted "
+                                  "from tombstones where deleted>=?1 "
+                                  "order by 10,1 limit %d offset %d;",
+                                  options->limit, options->offset);
+
+    rc = db_prepare(state, db, query, &stmt);
+    sqlite3_free(query);
 
-    if(!db_check_integrity(path))
+    if(rc != SQLITE_OK)
     {
-        fprintf(stderr, "Corrupted database. Abort.\n");
-        free(path);
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        db_close(db);
 
-        return NULL;
+        return false;
     }
 
-    rc = sqlite3_open(path, &db);
+    sqlite3_bind_int64(stmt, 1, since);
+    formatter_begin(formatter);
 
-    if(rc != SQLITE_OK)
+    while((rc = db_step(stmt)) == SQLITE_ROW)
     {
-        fprintf(stderr, "Error %s\n", sqlite3_errmsg(db));
-        free(path);
+        for(int i = 0; i < ENTRY_FIELD_COUNT; i++)
+            values[i] = (const char *)sqlite3_column_text(stmt, i);
 
-        return NULL;
+        values[FIELD_UUID] = (const char *)sqlite3_column_text(stmt, 7);
+        values[FIELD_CHANGE] = (const char *)sqlite3_column_text(stmt, 8);
+
+        formatter_row(formatter, values);
+    }
+
+    if(rc != SQLITE_DONE)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        ok = false;
     }
 
-    entry = tmalloc(sizeof(struct _entry));
+    if(!formatter_end(formatter))
+    {
+        fprintf(stderr, "Error writing output.\n");
+        ok = false;
+    }
 
-    query = sqlite3_mprintf("select id,title,user,url,password,notes,"
-                            "timestamp from entries where id=%d;", id);
+    sqlite3_finalize(stmt);
+    db_close(db);
 
-    /* Set id to minus one by default. If query finds data
-     * we set the id back to the original one in the callback.
-     * We can uses this to easily check if we have valid data in the structure.
-     */
-    entry->id = -1;
+    return ok;
+}
 
-    rc = sqlite3_exec(db, query, cb_get_by_id, entry, &err);
+/* Opens a read only connection to a database already checked and
+ * migrated by db_open, for callers such as the query server that
+ * keep it open. Returns NULL on failure, otherwise the handle must
+ * be closed with db_close.
+ */
+sqlite3 *db_open_readonly(const char *path, int lock_timeout)
+{
+    sqlite3 *db;
+    int rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL);
 
     if(rc != SQLITE_OK)
     {
-        fprintf(stderr, "Error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_free(query);
-        free(path);
+        fprintf(stderr, "Failed to open database: %s\n", sqlite3_errmsg(db));
+        db_close(db);
 
         return NULL;
     }
 
-    sqlite3_free(query);
-    sqlite3_close(db);
-    free(path);
+    sqlite3_busy_timeout(db, lock_timeout);
+
+    //Reads come straight from the mapped file instead of copied pages
+    sqlite3_exec(db, "pragma mmap_size=268435456;", NULL, 0, NULL);
 
-    return entry;
+    return db;
 }
 
-/* Returns true on success, false on failure.
- * Parameter changes is set to true if entry with given
- * id was found and deleted.
+/* Runs query on db binding the parameters of compiled, if not
+ * NULL, and writes the rows using formatter.
  */
-bool db_delete_entry(int id, bool *changes)
+static bool write_query(sqlite3 *db, const char *query, Query_t *compiled,
+                        Formatter_t *formatter)
 {
-    char *path = NULL;
-    sqlite3 *db;
-    int rc;
-    char *query;
-    char *err = NULL;
-    int count;
+    sqlite3_stmt *stmt;
+    bool ok;
 
-    path = read_active_database_path();
-
-    if(!path)
+    if(sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK)
     {
-        fprintf(stderr, "Error getting database path\n");
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
         return false;
     }
 
-    if(!db_check_integrity(path))
-    {
-        fprintf(stderr, "Corrupted database. Abort.\n");
-        free(path);
+    if(compiled)
+        query_bind(compiled, stmt);
 
-        return false;
-    }
+    ok = write_rows(db, stmt, formatter);
+    sqlite3_finalize(stmt);
 
-    rc = sqlite3_open(path, &db);
+    return ok;
+}
 
-    if(rc != SQLITE_OK)
-    {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        free(path);
-        return false;
-    }
+/* Same as db_list_all on an open connection */
+bool db_write_all(sqlite3 *db, Formatter_t *formatter, List_options_t *options)
+{
+    char *query = db_build_list_query("select id,title,user,url,password,notes,"
+                                   "datetime(modified,'unixepoch','localtime') "
+                                   "from entries", false, options);
+    bool ok = write_query(db, query, NULL, formatter);
 
-    query = sqlite3_mprintf("delete from entries where id=%d;", id);
-    rc = sqlite3_exec(db, query, NULL, 0, &err);
+    sqlite3_free(query);
 
-    if(rc != SQLITE_OK)
-    {
-        fprintf(stderr, "Error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_free(query);
-        sqlite3_close(db);
-        free(path);
+    return ok;
+}
 
-        return false;
-    }
+/* Same as titan --find on an open connection */
+bool db_write_found(sqlite3 *db, const char *search, Formatter_t *formatter,
+                    List_options_t *options)
+{
+    Query_t compiled;
+    char *query = db_build_find_query(search, &compiled, options);
 
-    count = sqlite3_changes(db);
+    if(!query)
+        return false;
 
-    if(count > 0)
-        *changes = true;
+    bool ok = write_query(db, query, &compiled, formatter);
 
     sqlite3_free(query);
-    sqlite3_close(db);
-
-    free(path);
+    query_free(&compiled);
 
-    return true;
+    return ok;
 }
 
-bool db_list_all(int show_password)
+/* Writes the entry with id, if any, on an open connection */
+bool db_write_by_id(sqlite3 *db, int id, Formatter_t *formatter)
 {
-    char *path = NULL;
-    char *err = NULL;
-    sqlite3 *db;
+    char *query = sqlite3_mprintf("select id,title,user,url,password,notes,"
+                                  "datetime(modified,'unixepoch','localtime') "
+                                  "from entries where id=%d;", id);
+    bool ok = write_query(db, query, NULL, formatter);
 
-    path = read_active_database_path();
+    sqlite3_free(query);
 
-    if(!path)
-    {
-        fprintf(stderr, "Error getting database path\n");
-        return false;
-    }
+    return ok;
+}
 
-    if(!db_check_integrity(path))
-    {
-        fprintf(stderr, "Corrupted database. Abort.\n");
-        free(path);
+/* Passes every entry to fn in id order, values are indexed by
+ * FIELD_*. Rows are not collected so memory use does not depend
+ * on the size of the database.
+ */
+bool db_each_entry(State_t *state, Row_fn_t fn, void *data)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    const char *values[FIELD_COUNT] = { NULL };
+    int rc;
+
+    db = db_open_active(state);
 
+    if(!db)
         return false;
-    }
 
-    int rc = sqlite3_open(path, &db);
+    rc = db_prepare(state, db, "select id,title,user,url,password,notes,"
+                    "datetime(modified,'unixepoch','localtime') "
+                    "from entries order by id;", &stmt);
 
     if(rc != SQLITE_OK)
     {
         fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        free(path);
+        db_close(db);
 
         return false;
     }
 
-    char *query = "select * from entries;";
-    rc = sqlite3_exec(db, query, cb_list_all, &show_password, &err);
-
-    if(rc != SQLITE_OK)
+    while((rc = db_step(stmt)) == SQLITE_ROW)
     {
-        fprintf(stderr, "Error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_close(db);
-        free(path);
+        for(int i = 0; i < ENTRY_FIELD_COUNT; i++)
+            values[i] = (const char *)sqlite3_column_text(stmt, i);
 
-        return false;
+        fn(data, values);
     }
 
-    sqlite3_close(db);
-    free(path);
+    if(rc != SQLITE_DONE)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
 
-    return true;
+    sqlite3_finalize(stmt);
+    db_close(db);
+
+    return rc == SQLITE_DONE;
 }
 
-bool db_find(const char *search, int show_password)
+/* Runs the same search as titan --find against the database at path or,
+ * if image is not NULL, against a decrypted database image of
+ * image_len bytes held in memory. Every matching row is passed to fn.
+ * Each call uses its own connection so searches may run in several
+ * threads at once. A database file is opened read-only, its schema
+ * has to be up to date. Caller is responsible for locking path.
+ */
+bool db_search(const char *path, const char *image, size_t image_len,
+               const char *search, List_options_t *options,
+               Row_fn_t fn, void *data)
 {
-    char *path = NULL;
-    char *err = NULL;
     sqlite3 *db;
+    sqlite3_stmt *stmt;
+    Query_t compiled;
+    const char *values[FIELD_COUNT] = { NULL };
+    int rc;
 
-    path = read_active_database_path();
+    if(image)
+    {
+        unsigned char *copy;
+
+        rc = sqlite3_open(":memory:", &db);
 
-    if(!path)
+        /* Deserialized database must be allocated by sqlite, it
+         * may grow while the schema is migrated.
+         */
+        copy = sqlite3_malloc64(image_len);
+
+        if(rc == SQLITE_OK && copy)
+        {
+            memcpy(copy, image, image_len);
+            rc = sqlite3_deserialize(db, "main", copy, image_len, image_len,
+                                     SQLITE_DESERIALIZE_FREEONCLOSE |
+                                     SQLITE_DESERIALIZE_RESIZEABLE);
+        }
+        else
+        {
+            sqlite3_free(copy);
+            rc = SQLITE_NOMEM;
+        }
+    }
+    else
     {
-        fprintf(stderr, "Error getting database path\n");
-        return false;
+        rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL);
     }
 
-    if(!db_check_integrity(path))
+    if(rc != SQLITE_OK)
     {
-        fprintf(stderr, "Corrupted database. Abort.\n");
-        free(path);
+        fprintf(stderr, "Failed to open %s: %s\n", path, sqlite3_errmsg(db));
+        db_close(db);
 
         return false;
     }
 
-    int rc = sqlite3_open(path, &db);
+    /* Only the private image may be migrated, the file at path is
+     * opened read-only under a shared lock.
+     */
+    if(image && !db_migrate(db))
+    {
+        db_close(db);
+        return false;
+    }
 
-    if(rc != SQLITE_OK)
+    if(!image && db_schema_version(db) != MIGRATION_COUNT)
     {
-        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        free(path);
+        fprintf(stderr, "Database %s has to be upgraded first, open it with "
+                "titan.\n", path);
+        db_close(db);
 
         return false;
     }
 
-    /* Search the same search term from each column we're might be interested in. */
-    char *query = sqlite3_mprintf("select * from entries where title like '%%%q%%' "
-                                  "or user like '%%%q%%' "
-                                  "or url like '%%%q%%' "
-                                  "or notes like '%%%q%%';", search, search, search, search);
+    char *query = db_build_find_query(search, &compiled, options);
+
+    if(!query)
+    {
+        db_close(db);
+        return false;
+    }
 
-    rc = sqlite3_exec(db, query, cb_find, &show_password, &err);
+    rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+    sqlite3_free(query);
 
     if(rc != SQLITE_OK)
     {
-        fprintf(stderr, "Error: %s\n", err);
-        sqlite3_free(err);
-        sqlite3_free(query);
-        sqlite3_close(db);
-        free(path);
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        query_free(&compiled);
+        db_close(db);
 
         return false;
     }
 
-    sqlite3_free(query);
-    sqlite3_close(db);
-    free(path);
+    query_bind(&compiled, stmt);
 
-    return true;
+    while((rc = db_step(stmt)) == SQLITE_ROW)
+    {
+        for(int i = 0; i < ENTRY_FIELD_COUNT; i++)
+            values[i] = (const char *)sqlite3_column_text(stmt, i);
+
+        fn(data, values);
+    }
+
+    if(rc != SQLITE_DONE)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+
+    sqlite3_finalize(stmt);
+    query_free(&compiled);
+    db_close(db);
+
+    return rc == SQLITE_DONE;
 }
 
 static int cb_check_integrity(void *notused, int argc, char **argv, char **column_name)
@@ -473,80 +1626,3 @@ static int cb_check_integrity(void *notused, int argc, char **argv, char **colum
 
     return 0;
 }
-
-static int cb_list_all(void *show_password, int argc, char **argv, char **column_name)
-{
-    fprintf(stdout, "=====================================================================\n");
-    fprintf(stdout, "ID: %s\n",        argv[0]);
-    fprintf(stdout, "Title: %s\n",     argv[1]);
-    fprintf(stdout, "User: %s\n",      argv[2]);
-    fprintf(stdout, "Url: %s\n",       argv[3]);
-
-    int defer = *(int *)show_password;
-
-    if(defer == 1)
-        fprintf(stdout, "Password: %s\n", argv[4]);
-    else
-        fprintf(stdout, "Password: **********\n");
-
-    fprintf(stdout, "Notes: %s\n",     argv[5]);
-    fprintf(stdout, "Modified: %s\n",  argv[6]);
-
-    fprintf(stdout, "=====================================================================\n");
-
-    return 0;
-}
-
-static int cb_find(void *show_password, int argc, char **argv, char **column_name)
-{
-
-    fprintf(stdout, "=====================================================================\n");
-    fprintf(stdout, "ID: %s\n",        argv[0]);
-    fprintf(stdout, "Title: %s\n",     argv[1]);
-    fprintf(stdout, "User: %s\n",      argv[2]);
-    fprintf(stdout, "Url: %s\n",       argv[3]);
-
-    int defer = *(int *)show_password;
-
-    if(defer == 1)
-        fprintf(stdout, "Password: %s\n", argv[4]);
-    else
-        fprintf(stdout, "Password: **********\n");
-
-    fprintf(stdout, "Notes: %s\n",     argv[5]);
-    fprintf(stdout, "Modified: %s\n",  argv[6]);
-
-    fprintf(stdout, "=====================================================================\n");
-
-    return 0;
-}
-
-static int
-cb_get_by_id(void *entry, int argc, char **argv, char **column_name)
-{
-    /*Let's not allow NULLs*/
-    if(argv[0] == NULL)
-        return 1;
-    if(argv[1] == NULL)
-        return 1;
-    if(argv[2] == NULL)
-        return 1;
-    if(argv[3] == NULL)
-        return 1;
-    if(argv[4] == NULL)
-        return 1;
-    if(argv[5] == NULL)
-        return 1;
-    if(argv[6] == NULL)
-        return 1;
-
-    ((Entry_t *)entry)->id = atoi(argv[0]);
-    ((Entry_t *)entry)->title = strdup(argv[1]);
-    ((Entry_t *)entry)->user = strdup(argv[2]);
-    ((Entry_t *)entry)->url = strdup(argv[3]);
-    ((Entry_t *)entry)->password = strdup(argv[4]);
-    ((Entry_t *)entry)->notes = strdup(argv[5]);
-    ((Entry_t *)entry)->stamp = strdup(argv[6]);
-
-    return 0;
-}
@@ -5,12 +5,45 @@
 #ifndef __DB_H
 #define __DB_H
 
+struct sqlite3_stmt;
+struct _query;
+
+/* Called for each row found by db_search and db_each_entry,
+ * values are indexed by FIELD_*
+ */
+typedef void (*Row_fn_t)(void *data, const char **values);
+
+struct sqlite3 *db_open(const char *path, int lock_timeout);
+struct sqlite3 *db_open_active(State_t *state);
+struct sqlite3 *db_open_readonly(const char *path, int lock_timeout);
+void db_close(struct sqlite3 *db);
+bool db_migrate(struct sqlite3 *db);
+bool db_set_tags(struct sqlite3 *db, int id, const char *tags);
 bool db_init_new(const char *path);
-bool db_insert_entry(Entry_t *entry);
-bool db_update_entry(int id, Entry_t *new_entry);
-bool db_delete_entry(int id, bool *changes);
-Entry_t *db_get_entry_by_id(int id);
-bool db_list_all(int show_password);
-bool db_find(const char *search, int show_password);
+bool db_checkpoint(const char *path);
+bool db_insert_entries(State_t *state, Entry_t **entries, int count);
+bool db_delete_entry(State_t *state, int id, bool *changes);
+bool db_list_all(State_t *state, Formatter_t *formatter, List_options_t *options);
+bool db_attach(State_t *state, int id, const char *name, FILE *fp,
+               long long size);
+bool db_extract(State_t *state, int id, const char *name, FILE *fp);
+bool db_changed_since(State_t *state, long long since, Formatter_t *formatter,
+                      List_options_t *options);
+bool db_write_all(struct sqlite3 *db, Formatter_t *formatter,
+                  List_options_t *options);
+bool db_write_found(struct sqlite3 *db, const char *search,
+                    Formatter_t *formatter, List_options_t *options);
+bool db_write_by_id(struct sqlite3 *db, int id, Formatter_t *formatter);
+bool db_each_entry(State_t *state, Row_fn_t fn, void *data);
+int db_sort_from_name(const char *name);
+int db_step(struct sqlite3_stmt *stmt);
+void db_explain(struct sqlite3 *db, const char *query, struct _query *compiled);
+char *db_build_list_query(const char *query, bool has_where,
+                          List_options_t *options);
+char *db_build_find_query(const char *search, struct _query *query,
+                          List_options_t *options);
+bool db_search(const char *path, const char *image, size_t image_len,
+               const char *search, List_options_t *options,
+               Row_fn_t fn, void *data);
 
 #endif
@@ -27,7 +27,7 @@ Entry_t *entry_new(const char *title, const char *user,
     new->url = strdup(url);
     new->password = strdup(password);
     new->notes = strdup(notes);
-    new->stamp = NULL;
+    new->tags = NULL;
 
     return new;
 }
@@ -43,8 +43,7 @@ void entry_free(Entry_t *entry)
     free(entry->password);
     free(entry->notes);
 
-    if(entry->stamp)
-        free(entry->stamp);
+    free(entry->tags);
 
     free(entry);
 }
@@ -13,8 +13,10 @@ typedef struct _entry
     char *url;
     char *password;
     char *notes;
-    /* Currently stamp is only used by db_get_entry_by_id */
-    char *stamp;
+    /* Comma separated tags to set when the entry is stored,
+     * NULL leaves tags as they are
+     */
+    char *tags;
 
 } Entry_t;
 
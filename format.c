@@ -0,0 +1,511 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "format.h"
+
+static const char *field_names[FIELD_COUNT] =
+{
+    "id", "title", "user", "url", "password", "notes", "modified", "vault",
+    "score", "guesses_log10", "pattern", "group", "breaches", "uuid", "change"
+};
+
+/* Labels used by the text format */
+static const char *field_labels[FIELD_COUNT] =
+{
+    "ID", "Title", "User", "Url", "Password", "Notes", "Modified", "Vault",
+    "Score", "Guesses (log10)", "Pattern", "Group", "Breaches", "UUID",
+    "Change"
+};
+
+/* Column widths used by the table format */
+static const int field_widths[FIELD_COUNT] =
+{
+    5, 20, 16, 28, 16, 24, 19, 12, 5, 13, 24, 5, 10, 32, 7
+};
+
+static const char *separator =
+    "=====================================================================\n";
+
+static const char *format_names[] =
+{
+    "text", "jsonl", "csv", "json", "tsv", "table", NULL
+};
+
+void writer_init(Writer_t *writer, FILE *fp)
+{
+    writer->fp = fp;
+    writer->len = 0;
+    writer->error = false;
+}
+
+/* Writes the buffered data to the underlying stream. Returns false
+ * if any write since writer_init has failed.
+ */
+bool writer_flush(Writer_t *writer)
+{
+    if(writer->len > 0 && !writer->error)
+    {
+        if(fwrite(writer->buffer, 1, writer->len, writer->fp) != writer->len)
+            writer->error = true;
+    }
+
+    //Buffer may contain passwords, don't leave them lying around
+    memset(writer->buffer, 0, writer->len);
+    writer->len = 0;
+
+    if(fflush(writer->fp) != 0)
+        writer->error = true;
+
+    return !writer->error;
+}
+
+void writer_write(Writer_t *writer, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        size_t room = WRITER_BUFFER_SIZE - writer->len;
+        size_t n = len < room ? len : room;
+
+        memcpy(writer->buffer + writer->len, data, n);
+        writer->len += n;
+        data += n;
+        len -= n;
+
+        if(writer->len == WRITER_BUFFER_SIZE)
+        {
+            if(fwrite(writer->buffer, 1, writer->len, writer->fp) != writer->len)
+                writer->error = true;
+
+            writer->len = 0;
+        }
+    }
+}
+
+void writer_putc(Writer_t *writer, char c)
+{
+    if(writer->len == WRITER_BUFFER_SIZE)
+    {
+        if(fwrite(writer->buffer, 1, writer->len, writer->fp) != writer->len)
+            writer->error = true;
+
+        writer->len = 0;
+    }
+
+    writer->buffer[writer->len++] = c;
+}
+
+static void writer_puts(Writer_t *writer, const char *str)
+{
+    writer_write(writer, str, strlen(str));
+}
+
+/* Writes str as a quoted JSON string. Control characters are
+ * escaped, everything else including UTF-8 is passed through as is.
+ */
+static void write_json_string(Writer_t *writer, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *start = str;
+
+    writer_putc(writer, '"');
+
+    for(; *str != '\0'; str++)
+    {
+        unsigned char c = (unsigned char)*str;
+
+        if(c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        //Copy the run of plain characters in one go
+        writer_write(writer, start, str - start);
+        start = str + 1;
+
+        switch(c)
+        {
+        case '"':
+            writer_puts(writer, "\\\"");
+            break;
+        case '\\':
+            writer_puts(writer, "\\\\");
+            break;
+        case '\n':
+            writer_puts(writer, "\\n");
+            break;
+        case '\r':
+            writer_puts(writer, "\\r");
+            break;
+        case '\t':
+            writer_puts(writer, "\\t");
+            break;
+        default:
+            writer_puts(writer, "\\u00");
+            writer_putc(writer, hex[c >> 4]);
+            writer_putc(writer, hex[c & 0x0f]);
+            break;
+        }
+    }
+
+    writer_write(writer, start, str - start);
+    writer_putc(writer, '"');
+}
+
+/* Writes str as a RFC 4180 CSV field. Field is quoted only when
+ * it contains a separator, quote or line break.
+ */
+static void write_csv_field(Writer_t *writer, const char *str)
+{
+    if(strpbrk(str, ",\"\r\n") == NULL)
+    {
+        writer_puts(writer, str);
+        return;
+    }
+
+    writer_putc(writer, '"');
+
+    for(; *str != '\0'; str++)
+    {
+        if(*str == '"')
+            writer_putc(writer, '"');
+
+        writer_putc(writer, *str);
+    }
+
+    writer_putc(writer, '"');
+}
+
+/* Writes str as a TSV field. Tabs, line breaks and backslashes
+ * are escaped so that each entry is always exactly one line.
+ */
+static void write_tsv_field(Writer_t *writer, const char *str)
+{
+    const char *start = str;
+
+    for(; *str != '\0'; str++)
+    {
+        const char *escape;
+
+        switch(*str)
+        {
+        case '\t':
+            escape = "\\t";
+            break;
+        case '\n':
+            escape = "\\n";
+            break;
+        case '\r':
+            escape = "\\r";
+            break;
+        case '\\':
+            escape = "\\\\";
+            break;
+        default:
+            continue;
+        }
+
+        writer_write(writer, start, str - start);
+        writer_puts(writer, escape);
+        start = str + 1;
+    }
+
+    writer_write(writer, start, str - start);
+}
+
+/* Writes str truncated to width characters, counted in UTF-8
+ * characters. Truncation is marked with '~' and control characters
+ * are written as spaces to keep one entry per line. If pad is true
+ * the cell is padded with spaces to exactly width characters.
+ */
+static void write_table_cell(Writer_t *writer, const char *str, int width,
+                             bool pad)
+{
+    int chars = 0;
+
+    while(*str != '\0')
+    {
+        const char *next = str + 1;
+
+        //Find the end of this character
+        while(((unsigned char)*next & 0xc0) == 0x80)
+            next++;
+
+        if(chars == width - 1 && *next != '\0')
+        {
+            writer_putc(writer, '~');
+            chars++;
+            break;
+        }
+
+        for(; str < next; str++)
+            writer_putc(writer, (unsigned char)*str < 0x20 ? ' ' : *str);
+
+        chars++;
+    }
+
+    for(; pad && chars < width; chars++)
+        writer_putc(writer, ' ');
+}
+
+/* Returns TITAN_FORMAT_* matching name or -1 if the
+ * format is not known.
+ */
+int format_from_name(const char *name)
+{
+    for(int i = 0; format_names[i] != NULL; i++)
+    {
+        if(strcmp(name, format_names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Parses comma separated list of field names into fields.
+ * NULL spec selects every field of an entry. Returns false if
+ * spec contains an unknown field name.
+ */
+bool fields_parse(const char *spec, Fields_t *fields)
+{
+    fields->count = 0;
+
+    if(spec == NULL)
+    {
+        for(int i = 0; i < ENTRY_FIELD_COUNT; i++)
+            fields->index[fields->count++] = i;
+
+        return true;
+    }
+
+    while(*spec != '\0')
+    {
+        size_t len = strcspn(spec, ",");
+        int found = -1;
+
+        for(int i = 0; i < FIELD_COUNT; i++)
+        {
+            if(strlen(field_names[i]) == len &&
+               strncmp(spec, field_names[i], len) == 0)
+            {
+                found = i;
+                break;
+            }
+        }
+
+        if(found == -1 || fields->count == FIELD_COUNT)
+        {
+            fprintf(stderr, "Unknown field '%.*s'.\n", (int)len, spec);
+            return false;
+        }
+
+        fields->index[fields->count++] = found;
+        spec += len;
+
+        if(*spec == ',')
+            spec++;
+    }
+
+    return fields->count > 0;
+}
+
+/* Passwords are replaced with asterisks if mask_password is true */
+void formatter_init(Formatter_t *formatter, FILE *fp, int format,
+                    Fields_t *fields, bool mask_password)
+{
+    writer_init(&formatter->writer, fp);
+    formatter->format = format;
+    formatter->fields = *fields;
+    formatter->mask_password = mask_password;
+    formatter->rows = 0;
+}
+
+/* Writes whatever the format needs before the first entry */
+void formatter_begin(Formatter_t *formatter)
+{
+    Writer_t *writer = &formatter->writer;
+    Fields_t *fields = &formatter->fields;
+
+    switch(formatter->format)
+    {
+    case TITAN_FORMAT_JSON:
+        writer_putc(writer, '[');
+        break;
+    case TITAN_FORMAT_CSV:
+    case TITAN_FORMAT_TSV:
+        for(int i = 0; i < fields->count; i++)
+        {
+            if(i > 0)
+                writer_putc(writer, formatter->format == TITAN_FORMAT_CSV ? ',' : '\t');
+
+            writer_puts(writer, field_names[fields->index[i]]);
+        }
+
+        writer_puts(writer, formatter->format == TITAN_FORMAT_CSV ? "\r\n" : "\n");
+        break;
+    case TITAN_FORMAT_TABLE:
+        for(int i = 0; i < fields->count; i++)
+        {
+            int field = fields->index[i];
+
+            if(i > 0)
+                writer_puts(writer, "  ");
+
+            write_table_cell(writer, field_names[field], field_widths[field],
+                             i < fields->count - 1);
+        }
+
+        writer_putc(writer, '\n');
+
+        for(int i = 0; i < fields->count; i++)
+        {
+            if(i > 0)
+                writer_puts(writer, "  ");
+
+            for(int j = 0; j < field_widths[fields->index[i]]; j++)
+                writer_putc(writer, '-');
+        }
+
+        writer_putc(writer, '\n');
+        break;
+    }
+}
+
+static void write_json_object(Writer_t *writer, Fields_t *fields,
+                              const char **values)
+{
+    writer_putc(writer, '{');
+
+    for(int i = 0; i < fields->count; i++)
+    {
+        int field = fields->index[i];
+        const char *value = values[field];
+
+        if(i > 0)
+            writer_putc(writer, ',');
+
+        writer_putc(writer, '"');
+        writer_puts(writer, field_names[field]);
+        writer_puts(writer, "\":");
+
+        if(value == NULL)
+            writer_puts(writer, "null");
+        else if(field == FIELD_ID || field == FIELD_SCORE ||
+                field == FIELD_GUESSES || field == FIELD_GROUP ||
+                field == FIELD_BREACHES)
+            writer_puts(writer, value);
+        else
+            write_json_string(writer, value);
+    }
+
+    writer_putc(writer, '}');
+}
+
+/* Writes one entry. Values are indexed by FIELD_* and
+ * may be NULL.
+ */
+void formatter_row(Formatter_t *formatter, const char **values)
+{
+    Writer_t *writer = &formatter->writer;
+    Fields_t *fields = &formatter->fields;
+    const char *masked[FIELD_COUNT];
+
+    if(formatter->mask_password && values[FIELD_PASSWORD] != NULL)
+    {
+        memcpy(masked, values, sizeof(masked));
+        masked[FIELD_PASSWORD] = "**********";
+        values = masked;
+    }
+
+    switch(formatter->format)
+    {
+    case TITAN_FORMAT_TEXT:
+        writer_puts(writer, separator);
+
+        for(int i = 0; i < fields->count; i++)
+        {
+            int field = fields->index[i];
+
+            writer_puts(writer, field_labels[field]);
+            writer_puts(writer, ": ");
+
+            if(values[field] != NULL)
+                writer_puts(writer, values[field]);
+
+            writer_putc(writer, '\n');
+        }
+
+        writer_puts(writer, separator);
+        break;
+    case TITAN_FORMAT_JSONL:
+        write_json_object(writer, fields, values);
+        writer_putc(writer, '\n');
+        break;
+    case TITAN_FORMAT_JSON:
+        if(formatter->rows > 0)
+            writer_putc(writer, ',');
+
+        writer_putc(writer, '\n');
+        write_json_object(writer, fields, values);
+        break;
+    case TITAN_FORMAT_CSV:
+        for(int i = 0; i < fields->count; i++)
+        {
+            const char *value = values[fields->index[i]];
+
+            if(i > 0)
+                writer_putc(writer, ',');
+
+            if(value != NULL)
+                write_csv_field(writer, value);
+        }
+
+        writer_puts(writer, "\r\n");
+        break;
+    case TITAN_FORMAT_TSV:
+        for(int i = 0; i < fields->count; i++)
+        {
+            const char *value = values[fields->index[i]];
+
+            if(i > 0)
+                writer_putc(writer, '\t');
+
+            if(value != NULL)
+                write_tsv_field(writer, value);
+        }
+
+        writer_putc(writer, '\n');
+        break;
+    case TITAN_FORMAT_TABLE:
+        for(int i = 0; i < fields->count; i++)
+        {
+            int field = fields->index[i];
+
+            if(i > 0)
+                writer_puts(writer, "  ");
+
+            write_table_cell(writer, values[field] ? values[field] : "",
+                             field_widths[field], i < fields->count - 1);
+        }
+
+        writer_putc(writer, '\n');
+        break;
+    }
+
+    formatter->rows++;
+}
+
+/* Finishes the output and flushes the writer. Returns false
+ * if writing failed at any point.
+ */
+bool formatter_end(Formatter_t *formatter)
+{
+    if(formatter->format == TITAN_FORMAT_JSON)
+        writer_puts(&formatter->writer, formatter->rows > 0 ? "\n]\n" : "]\n");
+
+    return writer_flush(&formatter->writer);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __FORMAT_H
+#define __FORMAT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#define TITAN_FORMAT_TEXT  (0)
+#define TITAN_FORMAT_JSONL (1)
+#define TITAN_FORMAT_CSV   (2)
+#define TITAN_FORMAT_JSON  (3)
+#define TITAN_FORMAT_TSV   (4)
+#define TITAN_FORMAT_TABLE (5)
+
+/* Columns of the entries table in the order they are selected */
+#define FIELD_ID       (0)
+#define FIELD_TITLE    (1)
+#define FIELD_USER     (2)
+#define FIELD_URL      (3)
+#define FIELD_PASSWORD (4)
+#define FIELD_NOTES    (5)
+#define FIELD_MODIFIED (6)
+/* Vault an entry was found in, only set by searches across vaults */
+#define FIELD_VAULT    (7)
+/* Password strength, only set by audits */
+#define FIELD_SCORE    (8)
+#define FIELD_GUESSES  (9)
+#define FIELD_PATTERN  (10)
+/* Group of entries sharing a password, only set by audits */
+#define FIELD_GROUP    (11)
+/* Times a password appears in a breach, only set by audits */
+#define FIELD_BREACHES (12)
+/* Only set by the change feed */
+#define FIELD_UUID     (13)
+#define FIELD_CHANGE   (14)
+#define FIELD_COUNT    (15)
+
+/* Fields stored in the entries table */
+#define ENTRY_FIELD_COUNT (7)
+
+#define SORT_ID       (0)
+#define SORT_TITLE    (1)
+#define SORT_URL      (2)
+#define SORT_MODIFIED (3)
+
+#define WRITER_BUFFER_SIZE (64 * 1024)
+
+typedef struct _writer
+{
+    FILE *fp;
+    size_t len;
+    bool error;
+    char buffer[WRITER_BUFFER_SIZE];
+
+} Writer_t;
+
+/* Selected output fields, indexes are FIELD_* values */
+typedef struct _fields
+{
+    int count;
+    int index[FIELD_COUNT];
+
+} Fields_t;
+
+/* Formats entries into a buffered writer. Shared by every
+ * command that outputs entries so all of them support the
+ * same formats and field selection.
+ */
+typedef struct _formatter
+{
+    Writer_t writer;
+    int format;
+    Fields_t fields;
+    bool mask_password;
+    long rows;
+
+} Formatter_t;
+
+/* Ordering, paging and filtering of listings. Negative
+ * limit means no limit.
+ */
+typedef struct _list_options
+{
+    int limit;
+    int offset;
+    int sort;
+    bool reverse;
+    /* Comma separated tags every listed entry must have, or NULL */
+    const char *with_tags;
+
+} List_options_t;
+
+void writer_init(Writer_t *writer, FILE *fp);
+void writer_write(Writer_t *writer, const char *data, size_t len);
+void writer_putc(Writer_t *writer, char c);
+bool writer_flush(Writer_t *writer);
+
+int format_from_name(const char *name);
+bool fields_parse(const char *spec, Fields_t *fields);
+
+void formatter_init(Formatter_t *formatter, FILE *fp, int format,
+                    Fields_t *fields, bool mask_password);
+void formatter_begin(Formatter_t *formatter);
+void formatter_row(Formatter_t *formatter, const char **values);
+bool formatter_end(Formatter_t *formatter);
+
+#endif
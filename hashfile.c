@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hashfile.h"
+#include "utils.h"
+
+/* Index is stored next to the hash file as <path>.idx so the hash
+ * file is only searched through once. It's rebuilt whenever the
+ * size or modification time of the hash file changes.
+ */
+static const char INDEX_MAGIC[8] = { 'T', 'I', 'T', 'A', 'N', 'H', 'I', 'X' };
+#define INDEX_VERSION (1)
+
+typedef struct _index_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t prefix_bits;
+    uint64_t file_size;
+    int64_t file_mtime;
+
+} Index_header_t;
+
+/* Probes start this far apart when building the index */
+#define GALLOP_STEP (4096)
+
+static uint64_t line_start(Hashfile_t *file, uint64_t pos)
+{
+    while(pos > 0 && file->data[pos - 1] != '\n')
+        pos--;
+
+    return pos;
+}
+
+static uint64_t next_line(Hashfile_t *file, uint64_t pos)
+{
+    const char *eol = memchr(file->data + pos, '\n', file->size - pos);
+
+    return eol ? (uint64_t)(eol - file->data) + 1 : file->size;
+}
+
+/* Compares first len characters of the line at pos to key, which
+ * must be upper case hex.
+ */
+static int compare_line(Hashfile_t *file, uint64_t pos, const char *key, int len)
+{
+    for(int i = 0; i < len; i++)
+    {
+        int c = pos + i < file->size ? toupper((unsigned char)file->data[pos + i]) : -1;
+
+        if(c != key[i])
+            return c < key[i] ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* Returns the first line between line starts lo and hi
+ * not sorting before key.
+ */
+static uint64_t lower_bound(Hashfile_t *file, uint64_t lo, uint64_t hi,
+                            const char *key, int len)
+{
+    while(lo < hi)
+    {
+        uint64_t start = line_start(file, lo + (hi - lo) / 2);
+
+        if(compare_line(file, start, key, len) < 0)
+            lo = next_line(file, start);
+        else
+            hi = start;
+    }
+
+    return lo;
+}
+
+/* Like lower_bound but searches forward from lo with growing steps,
+ * so consecutive keys only touch the part of the file between them.
+ */
+static uint64_t gallop(Hashfile_t *file, uint64_t lo, const char *key, int len)
+{
+    uint64_t step = GALLOP_STEP;
+    uint64_t hi = file->size;
+
+    while(lo + step < file->size)
+    {
+        uint64_t start = line_start(file, lo + step);
+
+        if(compare_line(file, start, key, len) >= 0)
+        {
+            hi = start;
+            break;
+        }
+
+        lo = next_line(file, start);
+        step *= 2;
+    }
+
+    return lower_bound(file, lo, hi, key, len);
+}
+
+static void build_index(Hashfile_t *file)
+{
+    char prefix[HASHFILE_PREFIX_CHARS + 1];
+    uint64_t pos = 0;
+
+    for(uint32_t i = 0; i < HASHFILE_BUCKETS; i++)
+    {
+        snprintf(prefix, sizeof(prefix), "%05X", i);
+        pos = gallop(file, pos, prefix, HASHFILE_PREFIX_CHARS);
+        file->index[i] = pos;
+    }
+
+    file->index[HASHFILE_BUCKETS] = file->size;
+}
+
+static bool load_index(Hashfile_t *file, const char *index_path, struct stat *st)
+{
+    Index_header_t header;
+    size_t len = (HASHFILE_BUCKETS + 1) * sizeof(uint64_t);
+    FILE *fp = fopen(index_path, "r");
+    bool ok;
+
+    if(!fp)
+        return false;
+
+    ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+         memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+         header.version == INDEX_VERSION &&
+         header.prefix_bits == HASHFILE_PREFIX_BITS &&
+         header.file_size == (uint64_t)st->st_size &&
+         header.file_mtime == (int64_t)st->st_mtime &&
+         fread(file->index, len, 1, fp) == 1;
+
+    fclose(fp);
+
+    return ok;
+}
+
+/* Index is only an optimization, failing to save it is not an error */
+static void save_index(Hashfile_t *file, const char *index_path, struct stat *st)
+{
+    Index_header_t header;
+    char *tmp_path = tmalloc(strlen(index_path) + 5);
+    FILE *fp;
+    bool ok;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.prefix_bits = HASHFILE_PREFIX_BITS;
+    header.file_size = st->st_size;
+    header.file_mtime = st->st_mtime;
+
+    sprintf(tmp_path, "%s.tmp", index_path);
+    fp = fopen(tmp_path, "w");
+
+    if(fp)
+    {
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(file->index, (HASHFILE_BUCKETS + 1) * sizeof(uint64_t), 1, fp) == 1;
+        ok = fclose(fp) == 0 && ok;
+
+        if(!ok || rename(tmp_path, index_path) != 0)
+            unlink(tmp_path);
+    }
+
+    free(tmp_path);
+}
+
+/* Maps the hash file at path and loads its index, building it
+ * if needed. The file is never read into memory as a whole.
+ */
+bool hashfile_open(Hashfile_t *file, const char *path)
+{
+    char *index_path;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+
+    if(fd == -1)
+    {
+        fprintf(stderr, "Cannot open hash file %s.\n", path);
+        return false;
+    }
+
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "Invalid hash file %s.\n", path);
+        close(fd);
+        return false;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(data == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map hash file %s.\n", path);
+        return false;
+    }
+
+    //Lookups jump around, read ahead would only waste memory
+    posix_madvise(data, st.st_size, POSIX_MADV_RANDOM);
+
+    file->data = data;
+    file->size = st.st_size;
+    file->index = tmalloc((HASHFILE_BUCKETS + 1) * sizeof(uint64_t));
+
+    index_path = tmalloc(strlen(path) + 5);
+    sprintf(index_path, "%s.idx", path);
+
+    if(!load_index(file, index_path, &st))
+    {
+        build_index(file);
+        save_index(file, index_path, &st);
+    }
+
+    free(index_path);
+
+    return true;
+}
+
+void hashfile_close(Hashfile_t *file)
+{
+    munmap((void *)file->data, file->size);
+    free(file->index);
+
+    file->data = NULL;
+    file->index = NULL;
+}
+
+/* Returns the count of hash, which must be HASHFILE_HASH_CHARS
+ * upper case hex characters, or 0 if it's not in the file.
+ */
+long long hashfile_lookup(Hashfile_t *file, const char *hash)
+{
+    uint32_t prefix = 0;
+    uint64_t pos;
+    uint64_t end;
+
+    for(int i = 0; i < HASHFILE_PREFIX_CHARS; i++)
+        prefix = prefix * 16 + (isdigit((unsigned char)hash[i]) ? hash[i] - '0' : hash[i] - 'A' + 10);
+
+    end = file->index[prefix + 1];
+    pos = lower_bound(file, file->index[prefix], end, hash, HASHFILE_HASH_CHARS);
+
+    if(pos >= end || compare_line(file, pos, hash, HASHFILE_HASH_CHARS) != 0)
+        return 0;
+
+    pos += HASHFILE_HASH_CHARS;
+
+    //Count is optional, a listed hash is breached at least once
+    if(pos < file->size && file->data[pos] == ':')
+    {
+        long long count = 0;
+
+        for(pos++; pos < file->size && isdigit((unsigned char)file->data[pos]); pos++)
+            count = count * 10 + file->data[pos] - '0';
+
+        return count > 0 ? count : 1;
+    }
+
+    return 1;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __HASHFILE_H
+#define __HASHFILE_H
+
+/* Hash files are sorted lines of upper case SHA-1 hashes followed by
+ * a colon and a count, as in the Have I Been Pwned password dump.
+ * Lines are indexed by the first HASHFILE_PREFIX_BITS bits of the
+ * hash, the same ranges the HIBP range API uses.
+ */
+#define HASHFILE_PREFIX_BITS  (20)
+#define HASHFILE_PREFIX_CHARS (5)
+#define HASHFILE_BUCKETS      (1 << HASHFILE_PREFIX_BITS)
+#define HASHFILE_HASH_CHARS   (40)
+
+typedef struct _hashfile
+{
+    const char *data;
+    uint64_t size;
+    /* Offset of the first line of each prefix, HASHFILE_BUCKETS + 1
+     * values so the last one is the end of the file.
+     */
+    uint64_t *index;
+
+} Hashfile_t;
+
+bool hashfile_open(Hashfile_t *file, const char *path);
+void hashfile_close(Hashfile_t *file);
+long long hashfile_lookup(Hashfile_t *file, const char *hash);
+
+#endif
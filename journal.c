@@ -0,0 +1,1326 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include <openssl/crypto.h>
+#include "entry.h"
+#include "format.h"
+#include "state.h"
+#include "db.h"
+#include "crypto.h"
+#include "utils.h"
+#include "stats.h"
+#include "journal.h"
+
+/* Encrypting a vault used to rewrite all of it. Now the encrypted
+ * snapshot is kept as <path>.snapshot while the vault is decrypted,
+ * and encrypting appends the entries changed during the session to
+ * <path>.journal as one encrypted and authenticated record. The
+ * snapshot itself is put back untouched. Records are replayed when
+ * the vault is decrypted.
+ *
+ * Journal starts with a header
+ *
+ *   "TJH3" | journal id | salt | number of records (u32) |
+ *   hmac of the last record | hmac of the header
+ *
+ * followed by frames:
+ *
+ *   "TJR2" | record length (u32) | record
+ *
+ * Records are encrypted with the key of the passphrase and the salt
+ * of the header, derived once per session rather than per record,
+ * and checked against the header instead of the whole snapshot.
+ *
+ * Each record is laid out like an encrypted file, ending in its
+ * hmac. Decrypted record starts with
+ *
+ *   snapshot hmac | sequence number (u32) | hmac of the previous record
+ *
+ * which chain the records to the snapshot they were written against
+ * and to each other, the first record being number 0 and following
+ * the snapshot. The header is followed by deletions and then updates:
+ *
+ *   'D' | id (u32) | uuid (length (u32) | text) | time of deletion (u32)
+ *   'U' | id (u32) | JOURNAL_COLUMNS x (length (u32) | text) |
+ *         tags (length (u32) | comma separated text)
+ *
+ * Entries are identified by uuid, the last of the columns. Ids may
+ * be reused after a deletion, an update keeps its id only if no
+ * other entry has it. Deletion leaves a tombstone with its original
+ * time.
+ *
+ * Snapshot stores the id of its journal in the journal table. A
+ * vault whose journal is missing or has another id was copied or
+ * restored without its journal and is not decrypted. Compaction
+ * writes the header of the new journal to <path>.journal.new before
+ * the snapshot and renames it in place after, an interrupted
+ * compaction is finished by the next decryption.
+ *
+ * The header is rewritten after each record is appended, so newest
+ * records dropped together are told apart from an older journal. A
+ * crash between the two leaves the vault decrypted, and the record
+ * beyond the header is replaced by the next append.
+ *
+ * A record of another snapshot, out of order or after a missing one,
+ * a record cut short, records missing at the end or beyond the
+ * header mean the journal was tampered with, and the vault is not
+ * decrypted either. Only a copy of both the snapshot and its journal
+ * taken earlier replays as an older vault. Integers are little
+ * endian.
+ */
+
+#define JOURNAL_HEADER_MAGIC "TJH3"
+/* Hex of 16 random bytes */
+#define JOURNAL_ID_SIZE (32)
+/* Offsets of the header fields */
+#define JOURNAL_SALT (4 + JOURNAL_ID_SIZE)
+#define JOURNAL_RECORDS (JOURNAL_SALT + SALT_SIZE)
+#define JOURNAL_HEAD (JOURNAL_RECORDS + 4)
+#define JOURNAL_HEADER_SIZE (JOURNAL_HEAD + HMAC_SHA512_SIZE * 2)
+#define JOURNAL_MAGIC "TJR2"
+#define JOURNAL_FRAME_HEADER (8)
+#define JOURNAL_COLUMNS (8)
+/* Snapshot hmac, sequence number and hmac of the previous record */
+#define JOURNAL_RECORD_HEADER (HMAC_SHA512_SIZE * 2 + 4)
+/* Length of a NULL column */
+#define JOURNAL_NULL (0xffffffff)
+
+struct _journal_key
+{
+    bool valid;
+    Key_t key;
+    /* Hmac of the passphrase with the key, checks it is unchanged */
+    char passphrase[HMAC_SHA512_SIZE];
+};
+
+/* Files of a vault and the key of its journal, if cached */
+typedef struct _journal_files
+{
+    const char *path;
+    char *snapshot_path;
+    char *journal_path;
+    /* Journal of an unfinished compaction */
+    char *pending_path;
+    int lock_timeout;
+    Journal_key_t *key;
+
+} Journal_files_t;
+
+static char *sidecar_path(const char *path, const char *ext)
+{
+    char *sidecar = tmalloc(strlen(path) + strlen(ext) + 1);
+
+    strcpy(sidecar, path);
+    strcat(sidecar, ext);
+
+    return sidecar;
+}
+
+static void vault_init(Journal_files_t *vault, const char *path, int lock_timeout,
+                       Journal_key_t *key)
+{
+    vault->path = path;
+    vault->snapshot_path = sidecar_path(path, ".snapshot");
+    vault->journal_path = sidecar_path(path, ".journal");
+    vault->pending_path = sidecar_path(path, ".journal.new");
+    vault->lock_timeout = lock_timeout;
+    vault->key = key;
+}
+
+static void vault_free(Journal_files_t *vault)
+{
+    free(vault->snapshot_path);
+    free(vault->journal_path);
+    free(vault->pending_path);
+}
+
+/* Returns a cache for the journal key, to be passed to journal_unlock
+ * and journal_lock of one vault. Free with journal_key_free.
+ */
+Journal_key_t *journal_key_new(void)
+{
+    return calloc(1, sizeof(Journal_key_t));
+}
+
+void journal_key_free(Journal_key_t *key)
+{
+    if(!key)
+        return;
+
+    OPENSSL_cleanse(key, sizeof(Journal_key_t));
+    free(key);
+}
+
+/* Derives key of passphrase and salt, or a new salt if salt is NULL.
+ * Cached key is used instead if its salt and passphrase are the same.
+ */
+static bool session_key(Journal_key_t *cache, const char *passphrase,
+                        const char *salt, Key_t *key)
+{
+    char check[HMAC_SHA512_SIZE];
+
+    if(cache && cache->valid && salt &&
+       CRYPTO_memcmp(cache->key.salt, salt, SALT_SIZE) == 0)
+    {
+        key_hmac(&cache->key, passphrase, strlen(passphrase), check);
+
+        if(CRYPTO_memcmp(check, cache->passphrase, HMAC_SHA512_SIZE) == 0)
+        {
+            *key = cache->key;
+            return true;
+        }
+    }
+
+    if(!derive_key(passphrase, salt, key))
+        return false;
+
+    if(cache)
+    {
+        cache->key = *key;
+        key_hmac(key, passphrase, strlen(passphrase), cache->passphrase);
+        cache->valid = true;
+    }
+
+    return true;
+}
+
+static void store_u32(char *data, uint32_t value)
+{
+    unsigned char *bytes = (unsigned char *)data;
+
+    bytes[0] = value & 0xff;
+    bytes[1] = (value >> 8) & 0xff;
+    bytes[2] = (value >> 16) & 0xff;
+    bytes[3] = value >> 24;
+}
+
+static void put_u32(FILE *fp, uint32_t value)
+{
+    char bytes[4];
+
+    store_u32(bytes, value);
+    fwrite(bytes, 1, sizeof(bytes), fp);
+}
+
+/* Reads u32 at *pos of data, returns false if data is too short */
+static bool get_u32(const char *data, size_t len, size_t *pos, uint32_t *value)
+{
+    const unsigned char *bytes = (const unsigned char *)data + *pos;
+
+    if(len < 4 || *pos > len - 4)
+        return false;
+
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+             ((uint32_t)bytes[3] << 24);
+    *pos += 4;
+
+    return true;
+}
+
+/* Reads the whole journal, it is kept small by compaction. Missing
+ * journal is read as empty. Caller must free *data.
+ */
+static bool read_journal(const char *path, char **data, size_t *len)
+{
+    FILE *fp;
+    long size;
+
+    *data = NULL;
+    *len = 0;
+
+    if(!file_exists(path))
+        return true;
+
+    fp = fopen(path, "r");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Unable to open %s for reading.\n", path);
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+
+    *data = tmalloc(size > 0 ? size : 1);
+    *len = stats_fread(*data, 1, size, fp);
+    fclose(fp);
+
+    return true;
+}
+
+/* Returns true if data starts with a header of the journal id */
+static bool is_journal_of(const char *data, size_t len, const char *id)
+{
+    return len >= JOURNAL_HEADER_SIZE &&
+           memcmp(data, JOURNAL_HEADER_MAGIC, 4) == 0 &&
+           memcmp(data + 4, id, JOURNAL_ID_SIZE) == 0;
+}
+
+/* Gets the key of the journal header in data and checks the header
+ * with it. Returns false if passphrase is not the one of the journal
+ * or the header has been tampered.
+ */
+static bool open_header(Journal_key_t *cache, const char *passphrase,
+                        const char *data, Key_t *key)
+{
+    char hmac[HMAC_SHA512_SIZE];
+    size_t len = JOURNAL_HEADER_SIZE - HMAC_SHA512_SIZE;
+
+    if(!session_key(cache, passphrase, data + JOURNAL_SALT, key))
+        return false;
+
+    key_hmac(key, data, len, hmac);
+
+    if(CRYPTO_memcmp(hmac, data + len, HMAC_SHA512_SIZE) == 0)
+        return true;
+
+    if(cache)
+        OPENSSL_cleanse(cache, sizeof(Journal_key_t));
+
+    return false;
+}
+
+/* Reads the id of the journal following the snapshot in db into id,
+ * which must have room for JOURNAL_ID_SIZE + 1. Id is empty if there
+ * is none.
+ */
+static bool read_journal_id(sqlite3 *db, char *id)
+{
+    sqlite3_stmt *stmt;
+    bool ok = false;
+
+    id[0] = '\0';
+
+    if(sqlite3_prepare_v2(db, "select id from journal where length(id)=?;",
+                          -1, &stmt, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+
+    sqlite3_bind_int(stmt, 1, JOURNAL_ID_SIZE);
+
+    switch(sqlite3_step(stmt))
+    {
+    case SQLITE_ROW:
+        memcpy(id, sqlite3_column_text(stmt, 0), JOURNAL_ID_SIZE);
+        id[JOURNAL_ID_SIZE] = '\0';
+        ok = true;
+        break;
+    case SQLITE_DONE:
+        ok = true;
+        break;
+    default:
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+    }
+
+    sqlite3_finalize(stmt);
+
+    return ok;
+}
+
+/* Reads the journal the snapshot with journal id is followed by.
+ * Finishes an interrupted compaction if finish is set, otherwise only
+ * reads its journal. Caller must free *data.
+ */
+static bool load_journal(Journal_files_t *vault, const char *id, bool finish,
+                         char **data, size_t *len)
+{
+    bool found;
+
+    if(id[0] == '\0')
+    {
+        *data = NULL;
+        *len = 0;
+
+        if(!file_exists(vault->journal_path))
+            return true;
+
+        fprintf(stderr, "Journal %s does not belong to %s. Aborted.\n",
+                vault->journal_path, vault->path);
+
+        return false;
+    }
+
+    if(!read_journal(vault->journal_path, data, len))
+        return false;
+
+    found = *len > 0;
+
+    if(is_journal_of(*data, *len, id))
+        return true;
+
+    free(*data);
+
+    if(!read_journal(vault->pending_path, data, len))
+        return false;
+
+    if(is_journal_of(*data, *len, id))
+    {
+        if(finish && rename(vault->pending_path, vault->journal_path) != 0)
+            fprintf(stderr, "WARNING: Unable to rename %s.\n",
+                    vault->pending_path);
+
+        return true;
+    }
+
+    free(*data);
+    *data = NULL;
+
+    if(found)
+        fprintf(stderr, "Journal %s belongs to another copy of %s. Aborted.\n",
+                vault->journal_path, vault->path);
+    else
+        fprintf(stderr, "Journal %s of %s is missing, it must be copied "
+                "along with the vault. Aborted.\n", vault->journal_path,
+                vault->path);
+
+    return false;
+}
+
+/* Finds the next complete frame at *pos. Returns false at the end
+ * of the journal or at a record cut short.
+ */
+static bool next_frame(const char *data, size_t len, size_t *pos,
+                       const char **record, uint32_t *record_len)
+{
+    size_t start = *pos;
+
+    if(len - start < JOURNAL_FRAME_HEADER ||
+       memcmp(data + start, JOURNAL_MAGIC, 4) != 0)
+        return false;
+
+    start += 4;
+
+    if(!get_u32(data, len, &start, record_len) || *record_len > len - start ||
+       *record_len < HMAC_SHA512_SIZE)
+        return false;
+
+    *record = data + start;
+    *pos = start + *record_len;
+
+    return true;
+}
+
+/* Statements replaying records */
+typedef struct _replay
+{
+    sqlite3_stmt *update;
+    sqlite3_stmt *insert;
+    sqlite3_stmt *get_id;
+    sqlite3_stmt *set_time;
+    sqlite3_stmt *delete;
+    sqlite3_stmt *tombstone;
+
+} Replay_t;
+
+/* Reads text of length (u32) | text at *pos, NULL text is read as
+ * NULL. Returns false if data is too short.
+ */
+static bool get_text(const char *data, size_t len, size_t *pos,
+                     const char **text, uint32_t *text_len)
+{
+    if(!get_u32(data, len, pos, text_len))
+        return false;
+
+    if(*text_len == JOURNAL_NULL)
+    {
+        *text = NULL;
+        return true;
+    }
+
+    if(*text_len > len - *pos)
+        return false;
+
+    *text = data + *pos;
+    *pos += *text_len;
+
+    return true;
+}
+
+static bool step_done(sqlite3 *db, sqlite3_stmt *stmt)
+{
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+
+    if(!ok)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    return ok;
+}
+
+static bool apply_delete(sqlite3 *db, Replay_t *replay, const char *body,
+                         size_t len, size_t *pos)
+{
+    const char *uuid;
+    uint32_t uuid_len;
+    uint32_t id;
+    uint32_t deleted;
+
+    if(!get_u32(body, len, pos, &id) ||
+       !get_text(body, len, pos, &uuid, &uuid_len) || !uuid ||
+       !get_u32(body, len, pos, &deleted))
+        return false;
+
+    sqlite3_bind_text(replay->delete, 1, uuid, uuid_len, SQLITE_STATIC);
+
+    if(!step_done(db, replay->delete))
+        return false;
+
+    sqlite3_bind_text(replay->tombstone, 1, uuid, uuid_len, SQLITE_STATIC);
+    sqlite3_bind_int64(replay->tombstone, 2, id);
+    sqlite3_bind_int64(replay->tombstone, 3, deleted);
+
+    return step_done(db, replay->tombstone);
+}
+
+static void bind_columns(sqlite3_stmt *stmt, int first, const char **values,
+                         const uint32_t *lengths)
+{
+    for(int i = 0; i < JOURNAL_COLUMNS; i++)
+    {
+        if(values[i])
+            sqlite3_bind_text(stmt, first + i, values[i], lengths[i],
+                              SQLITE_STATIC);
+    }
+}
+
+/* Updates the entry of the uuid or inserts it, then sets its tags.
+ * Setting tags touches the entry, so the recorded times are put back
+ * last.
+ */
+static bool apply_update(sqlite3 *db, Replay_t *replay, const char *body,
+                         size_t len, size_t *pos)
+{
+    const char *values[JOURNAL_COLUMNS];
+    uint32_t lengths[JOURNAL_COLUMNS];
+    const char *tags;
+    uint32_t tags_len;
+    uint32_t id;
+    char *tag_list;
+    int entry;
+    bool ok;
+
+    if(!get_u32(body, len, pos, &id))
+        return false;
+
+    for(int i = 0; i < JOURNAL_COLUMNS; i++)
+    {
+        if(!get_text(body, len, pos, &values[i], &lengths[i]))
+            return false;
+    }
+
+    if(!get_text(body, len, pos, &tags, &tags_len) ||
+       !values[JOURNAL_COLUMNS - 1])
+        return false;
+
+    bind_columns(replay->update, 1, values, lengths);
+
+    if(!step_done(db, replay->update))
+        return false;
+
+    if(sqlite3_changes(db) == 0)
+    {
+        sqlite3_bind_int64(replay->insert, 1, id);
+        bind_columns(replay->insert, 2, values, lengths);
+
+        if(!step_done(db, replay->insert))
+            return false;
+    }
+
+    sqlite3_bind_text(replay->get_id, 1, values[JOURNAL_COLUMNS - 1],
+                      lengths[JOURNAL_COLUMNS - 1], SQLITE_STATIC);
+    ok = sqlite3_step(replay->get_id) == SQLITE_ROW;
+    entry = sqlite3_column_int(replay->get_id, 0);
+    sqlite3_reset(replay->get_id);
+
+    if(!ok)
+        return false;
+
+    tag_list = tags ? strndup(tags, tags_len) : strdup("");
+    ok = db_set_tags(db, entry, tag_list);
+    free(tag_list);
+
+    if(!ok)
+        return false;
+
+    //Timestamp and modified are the columns before uuid
+    for(int i = 0; i < 2; i++)
+    {
+        if(values[i + 5])
+            sqlite3_bind_text(replay->set_time, i + 1, values[i + 5],
+                              lengths[i + 5], SQLITE_STATIC);
+    }
+
+    sqlite3_bind_int(replay->set_time, 3, entry);
+
+    return step_done(db, replay->set_time);
+}
+
+/* Applies operations of a decrypted record to db */
+static bool apply_record(sqlite3 *db, Replay_t *replay, const char *body,
+                         size_t len)
+{
+    size_t pos = JOURNAL_RECORD_HEADER;
+
+    while(pos < len)
+    {
+        char op = body[pos++];
+
+        if(op == 'D' && !apply_delete(db, replay, body, len, &pos))
+            return false;
+
+        if(op == 'U' && !apply_update(db, replay, body, len, &pos))
+            return false;
+
+        if(op != 'D' && op != 'U')
+            return false;
+    }
+
+    return true;
+}
+
+static bool prepare_replay(sqlite3 *db, Replay_t *replay)
+{
+    memset(replay, 0, sizeof(Replay_t));
+
+    return sqlite3_prepare_v2(db, "update entries set title=?1,user=?2,url=?3,"
+                              "password=?4,notes=?5,timestamp=?6,modified=?7 "
+                              "where uuid=?8;", -1, &replay->update,
+                              NULL) == SQLITE_OK &&
+           sqlite3_prepare_v2(db, "insert into entries(id,title,user,url,"
+                              "password,notes,timestamp,modified,uuid) "
+                              "values((select case when exists(select 1 from "
+                              "entries where id=?1) then null else ?1 end),"
+                              "?2,?3,?4,?5,?6,?7,?8,?9);", -1, &replay->insert,
+                              NULL) == SQLITE_OK &&
+           sqlite3_prepare_v2(db, "select id from entries where uuid=?;", -1,
+                              &replay->get_id, NULL) == SQLITE_OK &&
+           sqlite3_prepare_v2(db, "update entries set timestamp=?,modified=? "
+                              "where id=?;", -1, &replay->set_time,
+                              NULL) == SQLITE_OK &&
+           sqlite3_prepare_v2(db, "delete from entries where uuid=?;", -1,
+                              &replay->delete, NULL) == SQLITE_OK &&
+           sqlite3_prepare_v2(db, "insert or replace into tombstones"
+                              "(uuid,id,deleted) values(?,?,?);", -1,
+                              &replay->tombstone, NULL) == SQLITE_OK;
+}
+
+static void finalize_replay(Replay_t *replay)
+{
+    sqlite3_finalize(replay->update);
+    sqlite3_finalize(replay->insert);
+    sqlite3_finalize(replay->get_id);
+    sqlite3_finalize(replay->set_time);
+    sqlite3_finalize(replay->delete);
+    sqlite3_finalize(replay->tombstone);
+}
+
+/* Returns true if the decrypted record is number seq of the journal
+ * of snapshot hmac and follows the record whose hmac is prev.
+ */
+static bool is_chained(const char *body, size_t len, const char *hmac,
+                       uint32_t seq, const char *prev)
+{
+    size_t pos = HMAC_SHA512_SIZE;
+    uint32_t number;
+
+    return len >= JOURNAL_RECORD_HEADER &&
+           CRYPTO_memcmp(body, hmac, HMAC_SHA512_SIZE) == 0 &&
+           get_u32(body, len, &pos, &number) && number == seq &&
+           CRYPTO_memcmp(body + pos, prev, HMAC_SHA512_SIZE) == 0;
+}
+
+/* Replays the journal of the snapshot in db, identified by hmac,
+ * onto db in a single transaction. Fails unless the journal belongs
+ * to the snapshot and every record is in the chain.
+ */
+static bool apply_journal(sqlite3 *db, Journal_files_t *vault, const char *passphrase,
+                          const char *hmac, bool finish)
+{
+    char id[JOURNAL_ID_SIZE + 1];
+    char prev[HMAC_SHA512_SIZE];
+    const char *journal_path = vault->journal_path;
+    Replay_t replay;
+    const char *record;
+    uint32_t record_len;
+    uint32_t records;
+    uint32_t seq = 0;
+    char *data;
+    size_t len;
+    size_t pos = JOURNAL_HEADER_SIZE;
+    bool ok = true;
+    Key_t key;
+
+    if(!read_journal_id(db, id) || !load_journal(vault, id, finish, &data, &len))
+        return false;
+
+    if(len == 0)
+        return true;
+
+    if(!open_header(vault->key, passphrase, data, &key))
+    {
+        fprintf(stderr, "Invalid password or tampered journal. Aborted.\n");
+        free(data);
+
+        return false;
+    }
+
+    memcpy(prev, hmac, HMAC_SHA512_SIZE);
+    pos = JOURNAL_RECORDS;
+    get_u32(data, len, &pos, &records);
+    pos = JOURNAL_HEADER_SIZE;
+
+    if(sqlite3_exec(db, "begin;", NULL, NULL, NULL) != SQLITE_OK ||
+       !prepare_replay(db, &replay))
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        ok = false;
+    }
+
+    while(ok && seq < records && next_frame(data, len, &pos, &record, &record_len))
+    {
+        char *body;
+        size_t body_len;
+
+        if(!decrypt_with_key(&key, record, record_len, &body, &body_len))
+        {
+            fprintf(stderr, "Invalid password or tampered journal. Aborted.\n");
+            ok = false;
+            break;
+        }
+
+        if(!is_chained(body, body_len, hmac, seq, prev))
+        {
+            fprintf(stderr, "Journal %s has records missing, reordered or "
+                    "of another vault. Aborted.\n", journal_path);
+            ok = false;
+        }
+        else if(!apply_record(db, &replay, body, body_len))
+        {
+            fprintf(stderr, "Malformed journal record.\n");
+            ok = false;
+        }
+
+        memcpy(prev, record + record_len - HMAC_SHA512_SIZE, HMAC_SHA512_SIZE);
+        seq++;
+
+        OPENSSL_cleanse(body, body_len);
+        free(body);
+    }
+
+    //Newest records were dropped
+    if(ok && (seq < records ||
+              CRYPTO_memcmp(prev, records > 0 ? data + JOURNAL_HEAD : hmac,
+                            HMAC_SHA512_SIZE) != 0))
+    {
+        fprintf(stderr, "Journal %s is missing its newest records. Aborted.\n",
+                journal_path);
+        ok = false;
+    }
+
+    //A crash while appending leaves the vault decrypted, not a short record
+    if(ok && pos < len)
+    {
+        fprintf(stderr, "Journal %s has an incomplete record or records "
+                "beyond its header. Aborted.\n", journal_path);
+        ok = false;
+    }
+
+    finalize_replay(&replay);
+
+    if(ok)
+        ok = sqlite3_exec(db, "commit;", NULL, NULL, NULL) == SQLITE_OK;
+
+    if(!ok)
+        sqlite3_exec(db, "rollback;", NULL, NULL, NULL);
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    free(data);
+
+    return ok;
+}
+
+static void put_text(FILE *fp, sqlite3_stmt *stmt, int column)
+{
+    const char *value = (const char *)sqlite3_column_text(stmt, column);
+    uint32_t len = sqlite3_column_bytes(stmt, column);
+
+    put_u32(fp, value ? len : JOURNAL_NULL);
+
+    if(value)
+        fwrite(value, 1, len, fp);
+}
+
+/* Writes operations for rows of stmt into fp. Deletions are rows
+ * of id, uuid and time, updates rows of id, the columns and tags.
+ */
+static bool write_operations(sqlite3 *db, sqlite3_stmt *stmt, char op,
+                             FILE *fp, int *count)
+{
+    int rc;
+
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        fputc(op, fp);
+        put_u32(fp, sqlite3_column_int(stmt, 0));
+
+        if(op == 'D')
+        {
+            put_text(fp, stmt, 1);
+            put_u32(fp, sqlite3_column_int64(stmt, 2));
+        }
+        else
+        {
+            for(int i = 1; i <= JOURNAL_COLUMNS + 1; i++)
+                put_text(fp, stmt, i);
+        }
+
+        (*count)++;
+    }
+
+    if(rc != SQLITE_DONE)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+
+    sqlite3_finalize(stmt);
+
+    return rc == SQLITE_DONE;
+}
+
+/* Writes entries listed in the changes table into body of record
+ * number seq, following the record whose hmac is prev. Tombstones of
+ * every changed id are written first, an id may have been given to a
+ * new entry after its entry was deleted. Caller must free *body.
+ * Count is the number of operations.
+ */
+static bool collect_changes(sqlite3 *db, const char *hmac, uint32_t seq,
+                            const char *prev, char **body, size_t *body_len,
+                            int *count)
+{
+    sqlite3_stmt *deleted = NULL;
+    sqlite3_stmt *updated = NULL;
+    FILE *fp;
+    bool ok;
+
+    *count = 0;
+
+    if(sqlite3_prepare_v2(db, "select t.id,t.uuid,t.deleted from tombstones t "
+                          "where t.id in (select id from changes) "
+                          "order by t.deleted;", -1, &deleted, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(db, "select e.id,e.title,e.user,e.url,e.password,"
+                          "e.notes,e.timestamp,e.modified,e.uuid,"
+                          "(select group_concat(t.name) from "
+                          "entry_tags et join tags t on t.id=et.tag "
+                          "where et.entry=e.id) "
+                          "from changes c join entries e on e.id=c.id "
+                          "order by c.id;", -1, &updated, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(deleted);
+
+        return false;
+    }
+
+    fp = open_memstream(body, body_len);
+
+    if(!fp)
+    {
+        sqlite3_finalize(deleted);
+        sqlite3_finalize(updated);
+
+        return false;
+    }
+
+    fwrite(hmac, 1, HMAC_SHA512_SIZE, fp);
+    put_u32(fp, seq);
+    fwrite(prev, 1, HMAC_SHA512_SIZE, fp);
+
+    ok = write_operations(db, deleted, 'D', fp, count);
+
+    if(ok)
+        ok = write_operations(db, updated, 'U', fp, count);
+    else
+        sqlite3_finalize(updated);
+
+    fclose(fp);
+
+    return ok;
+}
+
+/* Appends record to the journal after its last counted frame,
+ * dropping a record an earlier crash left behind, and then replaces
+ * the journal header with header counting the record.
+ */
+static bool append_record(const char *journal_path, size_t valid_len,
+                          const char *header, const char *record,
+                          size_t record_len)
+{
+    char *frame;
+    FILE *fp;
+    size_t frame_len;
+    bool ok;
+    int fd;
+
+    fp = open_memstream(&frame, &frame_len);
+
+    if(!fp)
+        return false;
+
+    fwrite(JOURNAL_MAGIC, 1, 4, fp);
+    put_u32(fp, record_len);
+    fwrite(record, 1, record_len, fp);
+    fclose(fp);
+
+    fd = open(journal_path, O_WRONLY | O_CREAT, 0600);
+
+    if(fd == -1)
+    {
+        fprintf(stderr, "Unable to open %s for writing.\n", journal_path);
+        free(frame);
+        return false;
+    }
+
+    //Record is on disk before the header counts it
+    ok = ftruncate(fd, valid_len) == 0 &&
+         lseek(fd, valid_len, SEEK_SET) != -1 &&
+         write(fd, frame, frame_len) == (ssize_t)frame_len &&
+         fsync(fd) == 0 &&
+         pwrite(fd, header, JOURNAL_HEADER_SIZE, 0) == JOURNAL_HEADER_SIZE &&
+         fsync(fd) == 0;
+
+    stats_add(STATS_BYTES_WRITTEN, frame_len + JOURNAL_HEADER_SIZE);
+
+    if(!ok)
+        fprintf(stderr, "Unable to write %s.\n", journal_path);
+
+    close(fd);
+    free(frame);
+
+    return ok;
+}
+
+/* Builds the header of the journal of snapshot id into header,
+ * counting records of which the last one ends with head. Head is
+ * NULL if there are no records.
+ */
+static void make_header(const Key_t *key, const char *id, uint32_t records,
+                        const char *head, char *header)
+{
+    size_t len = JOURNAL_HEADER_SIZE - HMAC_SHA512_SIZE;
+
+    memcpy(header, JOURNAL_HEADER_MAGIC, 4);
+    memcpy(header + 4, id, JOURNAL_ID_SIZE);
+    memcpy(header + JOURNAL_SALT, key->salt, SALT_SIZE);
+    store_u32(header + JOURNAL_RECORDS, records);
+
+    if(head)
+        memcpy(header + JOURNAL_HEAD, head, HMAC_SHA512_SIZE);
+    else
+        memset(header + JOURNAL_HEAD, 0, HMAC_SHA512_SIZE);
+
+    key_hmac(key, header, len, header + len);
+}
+
+/* Writes a new, empty journal of the snapshot id into path */
+static bool write_header(const Key_t *key, const char *id, const char *path)
+{
+    char header[JOURNAL_HEADER_SIZE];
+    bool ok;
+    int fd;
+
+    make_header(key, id, 0, NULL, header);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if(fd == -1)
+    {
+        fprintf(stderr, "Unable to open %s for writing.\n", path);
+        return false;
+    }
+
+    ok = write(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+         fsync(fd) == 0;
+
+    stats_add(STATS_BYTES_WRITTEN, sizeof(header));
+
+    if(!ok)
+        fprintf(stderr, "Unable to write %s.\n", path);
+
+    close(fd);
+
+    return ok;
+}
+
+/* Gives the decrypted vault a new journal id, written into id */
+static bool new_journal_id(Journal_files_t *vault, char *id)
+{
+    sqlite3 *db = db_open(vault->path, vault->lock_timeout);
+    bool ok;
+
+    if(!db)
+        return false;
+
+    ok = sqlite3_exec(db, "delete from journal;insert into journal "
+                      "values(lower(hex(randomblob(16))));", NULL, NULL,
+                      NULL) == SQLITE_OK && read_journal_id(db, id) &&
+         id[0] != '\0';
+
+    db_close(db);
+
+    //Write-ahead log must be merged before the vault is encrypted
+    return ok && db_checkpoint(vault->path);
+}
+
+/* Encrypts the whole vault into a new snapshot followed by a new,
+ * empty journal. Journal is written aside first and takes the place
+ * of the old one once the snapshot is in place.
+ */
+static bool compact(Journal_files_t *vault, const char *passphrase)
+{
+    char id[JOURNAL_ID_SIZE + 1];
+    Key_t key;
+    bool ok;
+
+    ok = new_journal_id(vault, id) &&
+         session_key(vault->key, passphrase, NULL, &key) &&
+         write_header(&key, id, vault->pending_path);
+
+    OPENSSL_cleanse(&key, sizeof(key));
+
+    if(!ok || !encrypt_file(passphrase, vault->path))
+        return false;
+
+    if(rename(vault->pending_path, vault->journal_path) != 0)
+        fprintf(stderr, "WARNING: Unable to rename %s, it is renamed when "
+                "the vault is decrypted.\n", vault->pending_path);
+
+    unlink(vault->snapshot_path);
+
+    return true;
+}
+
+static bool unlock_vault(Journal_files_t *vault, const char *passphrase)
+{
+    char hmac[HMAC_SHA512_SIZE];
+    sqlite3 *db;
+    bool ok;
+
+    if(!read_file_hmac(vault->path, hmac))
+    {
+        fprintf(stderr, "Unable to read %s.\n", vault->path);
+        return false;
+    }
+
+    //Snapshot is a second name of the encrypted file, nothing is copied
+    unlink(vault->snapshot_path);
+
+    if(link(vault->path, vault->snapshot_path) != 0)
+        fprintf(stderr, "WARNING: Unable to keep snapshot %s, vault will be "
+                "rewritten when encrypted.\n", vault->snapshot_path);
+
+    if(!decrypt_file(passphrase, vault->path))
+    {
+        unlink(vault->snapshot_path);
+        return false;
+    }
+
+    db = db_open(vault->path, vault->lock_timeout);
+
+    //Changes of the session start from an empty list
+    ok = db && apply_journal(db, vault, passphrase, hmac, true) &&
+         sqlite3_exec(db, "delete from changes;delete from attachment_changes;",
+                      NULL, NULL, NULL) == SQLITE_OK;
+
+    if(db)
+        db_close(db);
+
+    //Put the encrypted vault back rather than lose journaled changes
+    if(!ok && file_exists(vault->snapshot_path))
+    {
+        remove(vault->path);
+        rename(vault->snapshot_path, vault->path);
+    }
+
+    return ok;
+}
+
+/* Decrypts the vault at path in place and replays its journal. The
+ * encrypted snapshot is kept for journal_lock. Key caches the key of
+ * the journal if not NULL.
+ */
+bool journal_unlock(const char *passphrase, const char *path, int lock_timeout,
+                    Journal_key_t *key)
+{
+    Journal_files_t vault;
+    bool ok;
+
+    vault_init(&vault, path, lock_timeout, key);
+    ok = unlock_vault(&vault, passphrase);
+    vault_free(&vault);
+
+    return ok;
+}
+
+/* Attachments are too large for the journal, a session that
+ * changed them rewrites the vault.
+ */
+static bool attachments_changed(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    bool changed = true;
+
+    if(sqlite3_prepare_v2(db, "select exists(select 1 from attachment_changes);",
+                          -1, &stmt, NULL) == SQLITE_OK &&
+       sqlite3_step(stmt) == SQLITE_ROW)
+        changed = sqlite3_column_int(stmt, 0);
+
+    sqlite3_finalize(stmt);
+
+    return changed;
+}
+
+/* Finds the end of the records the header of the journal data
+ * counts, their number and the hmac of the last one, or hmac if
+ * there are none. Returns false if records are missing at the end.
+ */
+static bool journal_head(const char *data, size_t len, const char *hmac,
+                         size_t *valid_len, uint32_t *records, char *head)
+{
+    const char *record;
+    uint32_t record_len;
+    uint32_t count;
+    size_t pos = JOURNAL_RECORDS;
+
+    *valid_len = JOURNAL_HEADER_SIZE;
+    *records = 0;
+    memcpy(head, hmac, HMAC_SHA512_SIZE);
+
+    if(!get_u32(data, len, &pos, &count))
+        return false;
+
+    while(*records < count &&
+          next_frame(data, len, valid_len, &record, &record_len))
+    {
+        memcpy(head, record + record_len - HMAC_SHA512_SIZE, HMAC_SHA512_SIZE);
+        (*records)++;
+    }
+
+    return *records == count &&
+           (count == 0 ||
+            CRYPTO_memcmp(head, data + JOURNAL_HEAD, HMAC_SHA512_SIZE) == 0);
+}
+
+/* Appends record, if not NULL, to the journal after valid_len with
+ * header counting it and puts the snapshot back in place of the
+ * decrypted vault. Vault is compacted instead if rewrite is set or
+ * the journal has grown too large.
+ */
+static bool store_record(Journal_files_t *vault, const char *passphrase,
+                         size_t valid_len, uint32_t records, const char *header,
+                         const char *record, size_t record_len, bool rewrite)
+{
+    struct stat st;
+
+    if(rewrite || stat(vault->snapshot_path, &st) != 0 ||
+       records >= JOURNAL_MAX_RECORDS ||
+       (valid_len + record_len) * JOURNAL_COMPACT_RATIO > (size_t)st.st_size)
+        return compact(vault, passphrase);
+
+    if(record && !append_record(vault->journal_path, valid_len, header,
+                                record, record_len))
+        return false;
+
+    //Record an earlier crash left beyond the header is not replayed
+    if(!record && truncate(vault->journal_path, valid_len) != 0)
+    {
+        fprintf(stderr, "Unable to write %s.\n", vault->journal_path);
+        return false;
+    }
+
+    if(remove(vault->path) != 0)
+        fprintf(stderr, "WARNING: Error deleting plain file %s.", vault->path);
+
+    return rename(vault->snapshot_path, vault->path) == 0;
+}
+
+/* Reads the journal of the snapshot and gets its key. Returns false
+ * if the journal does not apply and the vault must be compacted.
+ */
+static bool open_journal(Journal_files_t *vault, sqlite3 *db, const char *passphrase,
+                         char **data, size_t *len, Key_t *key)
+{
+    char id[JOURNAL_ID_SIZE + 1];
+
+    *data = NULL;
+
+    if(!read_journal_id(db, id) || id[0] == '\0' ||
+       !read_journal(vault->journal_path, data, len))
+        return false;
+
+    //Passphrase is checked against the journal, not the whole snapshot
+    return is_journal_of(*data, *len, id) &&
+           open_header(vault->key, passphrase, *data, key);
+}
+
+static bool lock_vault(Journal_files_t *vault, const char *passphrase)
+{
+    char hmac[HMAC_SHA512_SIZE];
+    char head[HMAC_SHA512_SIZE];
+    char header[JOURNAL_HEADER_SIZE];
+    char *data = NULL;
+    char *body = NULL;
+    char *record = NULL;
+    size_t len = 0;
+    size_t body_len = 0;
+    size_t record_len = 0;
+    size_t valid_len;
+    uint32_t records;
+    int count = 0;
+    sqlite3 *db;
+    bool rewrite;
+    bool ok;
+    Key_t key;
+
+    if(!file_exists(vault->snapshot_path) ||
+       !read_file_hmac(vault->snapshot_path, hmac))
+        return compact(vault, passphrase);
+
+    db = db_open(vault->path, vault->lock_timeout);
+
+    if(!db)
+        return false;
+
+    //New vault, passphrase changed or journal lost, journal does not apply
+    if(!open_journal(vault, db, passphrase, &data, &len, &key))
+    {
+        db_close(db);
+        free(data);
+
+        return compact(vault, passphrase);
+    }
+
+    //Decrypted vault holds the records the journal has lost
+    if(!journal_head(data, len, hmac, &valid_len, &records, head))
+    {
+        db_close(db);
+        free(data);
+        OPENSSL_cleanse(&key, sizeof(key));
+
+        return compact(vault, passphrase);
+    }
+
+    ok = collect_changes(db, hmac, records, head, &body, &body_len, &count);
+    rewrite = attachments_changed(db);
+    db_close(db);
+
+    //Write-ahead log must be merged before the vault is encrypted
+    ok = ok && db_checkpoint(vault->path);
+
+    if(ok && count > 0 && !rewrite)
+        ok = encrypt_with_key(&key, body, body_len, &record, &record_len);
+
+    if(record)
+        make_header(&key, data + 4, records + 1,
+                    record + record_len - HMAC_SHA512_SIZE, header);
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    free(data);
+
+    if(body)
+    {
+        OPENSSL_cleanse(body, body_len);
+        free(body);
+    }
+
+    if(ok)
+        ok = store_record(vault, passphrase, valid_len, records, header,
+                          record, record_len, rewrite);
+
+    free(record);
+
+    return ok;
+}
+
+/* Encrypts the decrypted vault at path. Changes of the session are
+ * appended to the journal and the snapshot is put back, or the vault
+ * is compacted into a new snapshot if there is no snapshot or
+ * journal, the passphrase has changed or the journal has grown too
+ * large. Key caches the key of the journal if not NULL.
+ */
+bool journal_lock(const char *passphrase, const char *path, int lock_timeout,
+                  Journal_key_t *key)
+{
+    Journal_files_t vault;
+    bool ok;
+
+    vault_init(&vault, path, lock_timeout, key);
+    ok = lock_vault(&vault, passphrase);
+    vault_free(&vault);
+
+    return ok;
+}
+
+/* Replays the journal of the encrypted vault at path onto its
+ * snapshot decrypted into memory, replacing *image.
+ */
+bool journal_replay_image(const char *passphrase, const char *path,
+                          char **image, size_t *image_len)
+{
+    char hmac[HMAC_SHA512_SIZE];
+    unsigned char *copy;
+    sqlite3 *db = NULL;
+    sqlite3_int64 size;
+    Journal_files_t vault;
+    bool ok;
+
+    vault_init(&vault, path, 0, NULL);
+
+    ok = read_file_hmac(path, hmac) &&
+         sqlite3_open(":memory:", &db) == SQLITE_OK &&
+         (copy = sqlite3_malloc64(*image_len)) != NULL;
+
+    if(ok)
+    {
+        memcpy(copy, *image, *image_len);
+        ok = sqlite3_deserialize(db, "main", copy, *image_len, *image_len,
+                                 SQLITE_DESERIALIZE_FREEONCLOSE |
+                                 SQLITE_DESERIALIZE_RESIZEABLE) == SQLITE_OK &&
+             db_migrate(db) && apply_journal(db, &vault, passphrase, hmac, false);
+    }
+
+    unsigned char *replayed = ok ? sqlite3_serialize(db, "main", &size, 0) : NULL;
+
+    if(replayed)
+    {
+        OPENSSL_cleanse(*image, *image_len);
+        free(*image);
+
+        *image = tmalloc(size);
+        *image_len = size;
+        memcpy(*image, replayed, size);
+
+        OPENSSL_cleanse(replayed, size);
+        sqlite3_free(replayed);
+    }
+
+    db_close(db);
+    vault_free(&vault);
+
+    return replayed != NULL;
+}
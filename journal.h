@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+/* Journal is compacted into a new snapshot when it has more
+ * records than this or is larger than the snapshot divided by
+ * JOURNAL_COMPACT_RATIO.
+ */
+#define JOURNAL_MAX_RECORDS   (32)
+#define JOURNAL_COMPACT_RATIO (4)
+
+/* Key of a journal kept between journal_unlock and journal_lock, so
+ * it is derived once per session.
+ */
+typedef struct _journal_key Journal_key_t;
+
+Journal_key_t *journal_key_new(void);
+void journal_key_free(Journal_key_t *key);
+bool journal_unlock(const char *passphrase, const char *path, int lock_timeout,
+                    Journal_key_t *key);
+bool journal_lock(const char *passphrase, const char *path, int lock_timeout,
+                  Journal_key_t *key);
+bool journal_replay_image(const char *passphrase, const char *path,
+                          char **image, size_t *image_len);
+
+#endif
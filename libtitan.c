@@ -0,0 +1,630 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <openssl/crypto.h>
+#include "entry.h"
+#include "format.h"
+#include "state.h"
+#include "db.h"
+#include "crypto.h"
+#include "lock.h"
+#include "utils.h"
+#include "journal.h"
+#include "query.h"
+#include "libtitan.h"
+#include "libtitan_state.h"
+
+/* Statements are prepared once per unlocked context, so repeated
+ * lookups skip parsing and planning. Searches are compiled into a
+ * statement of their own on every call.
+ */
+#define STMT_GET     (0)
+#define STMT_EACH    (1)
+#define STMT_INSERT  (2)
+#define STMT_UPDATE  (3)
+#define STMT_DELETE  (4)
+#define STMT_COUNT   (5)
+
+#define SELECT_ENTRIES "select id,title,user,url,password,notes," \
+                       "datetime(modified,'unixepoch','localtime') from entries"
+
+static const char *statements[STMT_COUNT] =
+{
+    SELECT_ENTRIES " where id=?1;",
+
+    SELECT_ENTRIES " order by id;",
+
+    "insert into entries(title,user,url,password,notes,modified) "
+    "values(?1,?2,?3,?4,?5,strftime('%s','now'));",
+
+    "update entries set title=?1,user=?2,url=?3,password=?4,notes=?5,"
+    "timestamp=datetime('now','localtime'),modified=strftime('%s','now') "
+    "where id=?6;",
+
+    "delete from entries where id=?1;"
+};
+
+struct _titan
+{
+    char *path;
+    int lock_timeout;
+    /* NULL while the vault is encrypted */
+    sqlite3 *db;
+    sqlite3_stmt *stmts[STMT_COUNT];
+    /* Journal key, derived once for unlocking and locking again */
+    Journal_key_t *key;
+    /* State of the titan program, NULL for other callers */
+    State_t *state;
+    pthread_mutex_t mutex;
+};
+
+static void titan_disconnect(Titan_t *titan)
+{
+    for(int i = 0; i < STMT_COUNT; i++)
+    {
+        sqlite3_finalize(titan->stmts[i]);
+        titan->stmts[i] = NULL;
+    }
+
+    if(titan->db)
+        db_close(titan->db);
+
+    titan->db = NULL;
+}
+
+static bool titan_connect(Titan_t *titan)
+{
+    if(titan->state)
+        titan->db = db_open_active(titan->state);
+    else
+        titan->db = db_open(titan->path, titan->lock_timeout);
+
+    if(!titan->db)
+        return false;
+
+    for(int i = 0; i < STMT_COUNT; i++)
+    {
+        if(sqlite3_prepare_v3(titan->db, statements[i], -1,
+                              SQLITE_PREPARE_PERSISTENT, &titan->stmts[i],
+                              NULL) != SQLITE_OK)
+        {
+            fprintf(stderr, "Error: %s\n", sqlite3_errmsg(titan->db));
+            titan_disconnect(titan);
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Takes the context mutex and the database lock. Returns the lock
+ * descriptor or -1 with the mutex released on failure.
+ */
+static int titan_begin(Titan_t *titan, int mode)
+{
+    int lock;
+
+    pthread_mutex_lock(&titan->mutex);
+
+    if(!titan->db)
+    {
+        fprintf(stderr, "Vault %s is locked.\n", titan->path);
+        pthread_mutex_unlock(&titan->mutex);
+
+        return -1;
+    }
+
+    lock = lock_database(titan->path, mode, titan->lock_timeout);
+
+    if(lock != -1 &&
+       (!file_exists(titan->path) || is_file_encrypted(titan->path)))
+    {
+        fprintf(stderr, "Vault %s was encrypted by another process.\n",
+                titan->path);
+        titan_disconnect(titan);
+        unlock_database(lock);
+        lock = -1;
+    }
+
+    if(lock == -1)
+        pthread_mutex_unlock(&titan->mutex);
+
+    return lock;
+}
+
+static void titan_end(Titan_t *titan, int lock)
+{
+    unlock_database(lock);
+    pthread_mutex_unlock(&titan->mutex);
+}
+
+/* Shows the plan of sql when the titan program runs with --explain */
+static void titan_explain(Titan_t *titan, const char *sql, Query_t *query)
+{
+    if(titan->state && titan->state->explain)
+        db_explain(titan->db, sql, query);
+}
+
+static void row_to_entry(sqlite3_stmt *stmt, Titan_entry_t *entry)
+{
+    entry->id = sqlite3_column_int(stmt, 0);
+    entry->title = (const char *)sqlite3_column_text(stmt, 1);
+    entry->user = (const char *)sqlite3_column_text(stmt, 2);
+    entry->url = (const char *)sqlite3_column_text(stmt, 3);
+    entry->password = (const char *)sqlite3_column_text(stmt, 4);
+    entry->notes = (const char *)sqlite3_column_text(stmt, 5);
+    entry->modified = (const char *)sqlite3_column_text(stmt, 6);
+    entry->tags = NULL;
+}
+
+/* Steps stmt passing every row to fn, then resets it */
+static bool titan_rows(Titan_t *titan, sqlite3_stmt *stmt,
+                       Titan_entry_fn fn, void *data)
+{
+    Titan_entry_t entry;
+    int rc;
+
+    while((rc = db_step(stmt)) == SQLITE_ROW)
+    {
+        row_to_entry(stmt, &entry);
+
+        if(!fn(data, &entry))
+        {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    if(rc != SQLITE_DONE)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(titan->db));
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    return rc == SQLITE_DONE;
+}
+
+/* Converts options of the API to those of the queries in db.c */
+static bool list_options(const Titan_options_t *options, List_options_t *list)
+{
+    memset(list, 0, sizeof(List_options_t));
+    list->sort = SORT_ID;
+    list->limit = -1;
+
+    if(!options)
+        return true;
+
+    //TITAN_SORT_* are the same as SORT_*
+    if(options->sort < TITAN_SORT_ID || options->sort > TITAN_SORT_MODIFIED)
+    {
+        fprintf(stderr, "Unknown sort %d.\n", options->sort);
+        return false;
+    }
+
+    list->sort = options->sort;
+    list->reverse = options->reverse;
+    list->limit = options->limit < 0 ? -1 : options->limit;
+    list->offset = options->offset > 0 ? options->offset : 0;
+    list->with_tags = options->with_tags;
+
+    return true;
+}
+
+static Titan_t *titan_new(const char *path, int lock_timeout, State_t *state)
+{
+    Titan_t *titan;
+
+    if(!file_exists(path))
+    {
+        fprintf(stderr, "Vault %s does not exist.\n", path);
+        return NULL;
+    }
+
+    titan = calloc(1, sizeof(Titan_t));
+
+    if(!titan)
+        return NULL;
+
+    titan->path = strdup(path);
+    titan->key = journal_key_new();
+    titan->lock_timeout = lock_timeout;
+    titan->state = state;
+    pthread_mutex_init(&titan->mutex, NULL);
+
+    if(!titan->path || !titan->key)
+    {
+        titan_close(titan);
+        return NULL;
+    }
+
+    if(!is_file_encrypted(path))
+    {
+        int lock = lock_database(path, TITAN_LOCK_SHARED, titan->lock_timeout);
+
+        if(lock == -1 || !titan_connect(titan))
+        {
+            unlock_database(lock);
+            titan_close(titan);
+
+            return NULL;
+        }
+
+        unlock_database(lock);
+    }
+
+    return titan;
+}
+
+/* Opens the vault at path. An encrypted vault must be unlocked
+ * with titan_unlock before its entries can be used. Lock timeout
+ * is in milliseconds, zero or less uses the default. Returns NULL
+ * on failure, otherwise the context must be closed with titan_close.
+ */
+Titan_t *titan_open(const char *path, int lock_timeout)
+{
+    return titan_new(path, lock_timeout > 0 ? lock_timeout : TITAN_LOCK_TIMEOUT,
+                     NULL);
+}
+
+/* Opens the active vault of the titan program */
+Titan_t *titan_open_state(State_t *state)
+{
+    return titan_new(state->db_path, state->lock_timeout, state);
+}
+
+void titan_close(Titan_t *titan)
+{
+    if(!titan)
+        return;
+
+    titan_disconnect(titan);
+    pthread_mutex_destroy(&titan->mutex);
+    journal_key_free(titan->key);
+    free(titan->path);
+    free(titan);
+}
+
+bool titan_is_locked(Titan_t *titan)
+{
+    bool locked;
+
+    pthread_mutex_lock(&titan->mutex);
+    locked = titan->db == NULL;
+    pthread_mutex_unlock(&titan->mutex);
+
+    return locked;
+}
+
+/* Decrypts the vault in place and replays its journal, like
+ * titan --decrypt.
+ */
+bool titan_unlock(Titan_t *titan, const char *passphrase)
+{
+    bool ok = false;
+    int lock;
+
+    pthread_mutex_lock(&titan->mutex);
+
+    if(titan->db)
+    {
+        pthread_mutex_unlock(&titan->mutex);
+        return true;
+    }
+
+    lock = lock_database(titan->path, TITAN_LOCK_EXCLUSIVE, titan->lock_timeout);
+
+    if(lock != -1)
+    {
+        ok = journal_unlock(passphrase, titan->path, titan->lock_timeout,
+                            titan->key) &&
+             titan_connect(titan);
+        unlock_database(lock);
+    }
+
+    pthread_mutex_unlock(&titan->mutex);
+
+    return ok;
+}
+
+/* Encrypts the vault in place, appending changes to its journal,
+ * like titan --encrypt. Entries cannot be used until the vault is
+ * unlocked again.
+ */
+bool titan_lock(Titan_t *titan, const char *passphrase)
+{
+    int lock = titan_begin(titan, TITAN_LOCK_EXCLUSIVE);
+    bool ok;
+
+    if(lock == -1)
+        return false;
+
+    titan_disconnect(titan);
+    ok = journal_lock(passphrase, titan->path, titan->lock_timeout, titan->key);
+
+    if(!ok)
+        titan_connect(titan);
+
+    titan_end(titan, lock);
+
+    return ok;
+}
+
+/* Bytes a field takes when copied, nothing if it is not set */
+static size_t field_size(const char *field)
+{
+    return field ? strlen(field) + 1 : 0;
+}
+
+static bool copy_entry(void *data, const Titan_entry_t *entry)
+{
+    Titan_entry_t **copy = data;
+    const char *fields[6] =
+    {
+        entry->title, entry->user, entry->url, entry->password,
+        entry->notes, entry->modified
+    };
+    const char **targets[6];
+    size_t size = sizeof(Titan_entry_t);
+    char *p;
+
+    for(int i = 0; i < 6; i++)
+        size += field_size(fields[i]);
+
+    //Strings are stored after the entry in the same allocation
+    *copy = malloc(size);
+
+    if(!*copy)
+    {
+        fprintf(stderr, "Unable to allocate memory.\n");
+        return false;
+    }
+
+    (*copy)->id = entry->id;
+    (*copy)->tags = NULL;
+    targets[0] = &(*copy)->title;
+    targets[1] = &(*copy)->user;
+    targets[2] = &(*copy)->url;
+    targets[3] = &(*copy)->password;
+    targets[4] = &(*copy)->notes;
+    targets[5] = &(*copy)->modified;
+
+    p = (char *)(*copy + 1);
+
+    for(int i = 0; i < 6; i++)
+    {
+        size_t len = field_size(fields[i]);
+
+        *targets[i] = NULL;
+
+        if(!fields[i])
+            continue;
+
+        memcpy(p, fields[i], len);
+        *targets[i] = p;
+        p += len;
+    }
+
+    return false;
+}
+
+/* Returns the entry with id or NULL if there is none. Caller
+ * must free the return value with titan_entry_free.
+ */
+Titan_entry_t *titan_get(Titan_t *titan, int id)
+{
+    Titan_entry_t *entry = NULL;
+    int lock = titan_begin(titan, TITAN_LOCK_SHARED);
+
+    if(lock == -1)
+        return NULL;
+
+    titan_explain(titan, statements[STMT_GET], NULL);
+    sqlite3_bind_int(titan->stmts[STMT_GET], 1, id);
+    titan_rows(titan, titan->stmts[STMT_GET], copy_entry, &entry);
+    titan_end(titan, lock);
+
+    return entry;
+}
+
+void titan_entry_free(Titan_entry_t *entry)
+{
+    size_t size = sizeof(Titan_entry_t);
+
+    if(!entry)
+        return;
+
+    //Wipe the password along with the rest of the allocation
+    size += field_size(entry->title) + field_size(entry->user) +
+            field_size(entry->url) + field_size(entry->password) +
+            field_size(entry->notes) + field_size(entry->modified);
+
+    OPENSSL_cleanse(entry, size);
+    free(entry);
+}
+
+/* Adds entry if its id is zero or less, otherwise replaces the
+ * entry with the same id. Tags of the entry, if given, change in
+ * the same transaction. Returns id of the entry or -1 on failure.
+ */
+int titan_put(Titan_t *titan, const Titan_entry_t *entry)
+{
+    sqlite3_stmt *stmt;
+    int lock = titan_begin(titan, TITAN_LOCK_EXCLUSIVE);
+    int which = entry->id > 0 ? STMT_UPDATE : STMT_INSERT;
+    int id = -1;
+
+    if(lock == -1)
+        return -1;
+
+    stmt = titan->stmts[which];
+    titan_explain(titan, statements[which], NULL);
+
+    sqlite3_bind_text(stmt, 1, entry->title, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, entry->user, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, entry->url, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, entry->password, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, entry->notes, -1, SQLITE_STATIC);
+
+    if(entry->id > 0)
+        sqlite3_bind_int(stmt, 6, entry->id);
+
+    if(sqlite3_exec(titan->db, "begin;", NULL, NULL, NULL) != SQLITE_OK ||
+       db_step(stmt) != SQLITE_DONE)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(titan->db));
+    else if(entry->id <= 0)
+        id = (int)sqlite3_last_insert_rowid(titan->db);
+    else if(sqlite3_changes(titan->db) > 0)
+        id = entry->id;
+    else
+        fprintf(stderr, "No entry with id %d.\n", entry->id);
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    if(id != -1 && entry->tags && !db_set_tags(titan->db, id, entry->tags))
+        id = -1;
+
+    if(id != -1 && sqlite3_exec(titan->db, "commit;", NULL, NULL, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(titan->db));
+        id = -1;
+    }
+
+    if(id == -1)
+        sqlite3_exec(titan->db, "rollback;", NULL, NULL, NULL);
+
+    titan_end(titan, lock);
+
+    return id;
+}
+
+/* Returns false on failure or if there is no entry with id */
+bool titan_remove(Titan_t *titan, int id)
+{
+    sqlite3_stmt *stmt;
+    int lock = titan_begin(titan, TITAN_LOCK_EXCLUSIVE);
+    bool ok;
+
+    if(lock == -1)
+        return false;
+
+    stmt = titan->stmts[STMT_DELETE];
+    titan_explain(titan, statements[STMT_DELETE], NULL);
+    sqlite3_bind_int(stmt, 1, id);
+
+    ok = db_step(stmt) == SQLITE_DONE;
+
+    if(!ok)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(titan->db));
+    else
+        ok = sqlite3_changes(titan->db) > 0;
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    titan_end(titan, lock);
+
+    return ok;
+}
+
+/* Runs sql, binding the parameters of query if not NULL, and passes
+ * every row to fn. Sql is freed.
+ */
+static bool titan_query(Titan_t *titan, char *sql, Query_t *query,
+                        Titan_entry_fn fn, void *data)
+{
+    sqlite3_stmt *stmt;
+    bool ok = false;
+    int lock = titan_begin(titan, TITAN_LOCK_SHARED);
+
+    if(lock == -1)
+    {
+        sqlite3_free(sql);
+        return false;
+    }
+
+    titan_explain(titan, sql, query);
+
+    if(sqlite3_prepare_v2(titan->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(titan->db));
+    }
+    else
+    {
+        if(query)
+            query_bind(query, stmt);
+
+        ok = titan_rows(titan, stmt, fn, data);
+        sqlite3_finalize(stmt);
+    }
+
+    titan_end(titan, lock);
+    sqlite3_free(sql);
+
+    return ok;
+}
+
+/* Passes entries matching search to fn, ordered and paged as
+ * specified by options. Search has the same syntax as titan --find,
+ * see query.c.
+ */
+bool titan_find(Titan_t *titan, const char *search,
+                const Titan_options_t *options, Titan_entry_fn fn, void *data)
+{
+    List_options_t list;
+    Query_t query;
+    char *sql;
+    bool ok;
+
+    if(!list_options(options, &list))
+        return false;
+
+    sql = db_build_find_query(search, &query, &list);
+
+    if(!sql)
+        return false;
+
+    ok = titan_query(titan, sql, &query, fn, data);
+    query_free(&query);
+
+    return ok;
+}
+
+/* Passes every entry to fn, ordered and paged as specified by
+ * options. Without options the prepared statement is used.
+ */
+bool titan_iterate(Titan_t *titan, const Titan_options_t *options,
+                   Titan_entry_fn fn, void *data)
+{
+    List_options_t list;
+    int lock;
+    bool ok;
+
+    if(!list_options(options, &list))
+        return false;
+
+    if(options)
+        return titan_query(titan, db_build_list_query(SELECT_ENTRIES, false,
+                                                      &list),
+                           NULL, fn, data);
+
+    lock = titan_begin(titan, TITAN_LOCK_SHARED);
+
+    if(lock == -1)
+        return false;
+
+    titan_explain(titan, statements[STMT_EACH], NULL);
+    ok = titan_rows(titan, titan->stmts[STMT_EACH], fn, data);
+    titan_end(titan, lock);
+
+    return ok;
+}
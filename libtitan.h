@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __LIBTITAN_H
+#define __LIBTITAN_H
+
+#include <stdbool.h>
+
+/* Embeddable Titan. Every function takes the context returned by
+ * titan_open, there is no other state and environment variables or
+ * the lock file in HOME are never read. Calls on one context are
+ * serialized so it may be shared between threads; callbacks must
+ * not call back into the same context. Contexts on the same vault
+ * take the same database locks as separate titan processes, so they
+ * exclude each other as processes do. Errors are written to stderr.
+ *
+ * The titan command line program shows, adds, edits, finds and
+ * lists entries through this API.
+ */
+
+typedef struct _titan Titan_t;
+
+/* Fields not set in the vault are NULL */
+typedef struct _titan_entry
+{
+    /* Zero or less when passed to titan_put adds a new entry */
+    int id;
+    const char *title;
+    const char *user;
+    const char *url;
+    const char *password;
+    const char *notes;
+    /* Local time of the last change, ignored by titan_put */
+    const char *modified;
+    /* Comma separated tags replacing those of the entry when passed
+     * to titan_put, NULL keeps them. Always NULL in entries returned.
+     */
+    const char *tags;
+
+} Titan_entry_t;
+
+#define TITAN_SORT_ID       (0)
+#define TITAN_SORT_TITLE    (1)
+#define TITAN_SORT_URL      (2)
+#define TITAN_SORT_MODIFIED (3)
+
+/* Order and paging of titan_find and titan_iterate. Passing NULL
+ * options returns every entry in id order.
+ */
+typedef struct _titan_options
+{
+    /* TITAN_SORT_*, ties are ordered by id */
+    int sort;
+    bool reverse;
+    /* Negative for no limit */
+    int limit;
+    int offset;
+    /* Comma separated tags every entry must have, or NULL */
+    const char *with_tags;
+
+} Titan_options_t;
+
+/* Called for each entry found, return false to stop. Entry is
+ * valid only during the call.
+ */
+typedef bool (*Titan_entry_fn)(void *data, const Titan_entry_t *entry);
+
+Titan_t *titan_open(const char *path, int lock_timeout);
+void titan_close(Titan_t *titan);
+bool titan_is_locked(Titan_t *titan);
+bool titan_unlock(Titan_t *titan, const char *passphrase);
+bool titan_lock(Titan_t *titan, const char *passphrase);
+Titan_entry_t *titan_get(Titan_t *titan, int id);
+void titan_entry_free(Titan_entry_t *entry);
+int titan_put(Titan_t *titan, const Titan_entry_t *entry);
+bool titan_remove(Titan_t *titan, int id);
+bool titan_find(Titan_t *titan, const char *search,
+                const Titan_options_t *options, Titan_entry_fn fn, void *data);
+bool titan_iterate(Titan_t *titan, const Titan_options_t *options,
+                   Titan_entry_fn fn, void *data);
+
+#endif
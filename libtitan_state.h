@@ -0,0 +1,15 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __LIBTITAN_STATE_H
+#define __LIBTITAN_STATE_H
+
+/* Not installed with libtitan.h. Contexts of the titan program use
+ * the lock timeout of its state, show plans and profiles asked for
+ * with --explain and --profile-sql, and check the integrity of the
+ * database only once per run.
+ */
+Titan_t *titan_open_state(State_t *state);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "lock.h"
+#include "utils.h"
+#include "stats.h"
+
+/* Locks are taken on a separate file next to the database.
+ * Locking the database file itself would interfere with sqlite's
+ * own fcntl locks, which are dropped when any descriptor of the
+ * file is closed. Caller must free the return value.
+ */
+static char *get_lock_path(const char *db_path)
+{
+    char *path = tmalloc(strlen(db_path) + 6);
+
+    strcpy(path, db_path);
+    strcat(path, ".lock");
+
+    return path;
+}
+
+static long elapsed_ms(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Takes an advisory lock for the database. Shared locks may be held
+ * by any number of readers, exclusive lock by a single writer.
+ * Waits at most timeout_ms milliseconds for other holders to
+ * release their locks. Returns a descriptor to pass to
+ * unlock_database or -1 on failure.
+ *
+ * flock locks belong to the open lock file, unlike fcntl record
+ * locks which belong to the process and are all dropped when any
+ * of its descriptors of the file is closed. Every call therefore
+ * holds its own lock, so threads of one process exclude each other
+ * as separate processes do and releasing one lock leaves the
+ * others held.
+ */
+int lock_database(const char *db_path, int mode, int timeout_ms)
+{
+    char *path = NULL;
+    struct timespec start;
+    struct timespec delay = { 0, 1000000 };
+    double wait_start = stats_start();
+    int fd;
+
+    path = get_lock_path(db_path);
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+
+    if(fd == -1)
+    {
+        fprintf(stderr, "Unable to open lock file %s.\n", path);
+        free(path);
+        return -1;
+    }
+
+    int operation = mode == TITAN_LOCK_EXCLUSIVE ? LOCK_EX : LOCK_SH;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Poll with a growing delay instead of a blocking flock,
+     * which cannot be given a timeout.
+     */
+    while(flock(fd, operation | LOCK_NB) == -1)
+    {
+        if((errno != EWOULDBLOCK && errno != EINTR) ||
+           elapsed_ms(&start) >= timeout_ms)
+        {
+            fprintf(stderr, "Database %s is locked by another process or thread.\n", db_path);
+            close(fd);
+            free(path);
+            return -1;
+        }
+
+        nanosleep(&delay, NULL);
+
+        if(delay.tv_nsec < 100000000)
+            delay.tv_nsec *= 2;
+    }
+
+    stats_stop(STATS_LOCK_WAIT, wait_start);
+    free(path);
+
+    return fd;
+}
+
+void unlock_database(int fd)
+{
+    if(fd != -1)
+        close(fd);
+}
@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __LOCK_H
+#define __LOCK_H
+
+#define TITAN_LOCK_SHARED    (0)
+#define TITAN_LOCK_EXCLUSIVE (1)
+
+/* Default time to wait for a lock in milliseconds */
+#define TITAN_LOCK_TIMEOUT (10000)
+
+int lock_database(const char *db_path, int mode, int timeout_ms);
+void unlock_database(int fd);
+
+#endif
@@ -0,0 +1,756 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <openssl/evp.h>
+#include "entry.h"
+#include "format.h"
+#include "state.h"
+#include "db.h"
+#include "utils.h"
+#include "merge.h"
+
+/* Differences of two copies of a vault are found without reading
+ * every entry. Each entry has a content hash, and entries are grouped
+ * into buckets by the leading hex digits of their uuid: 16 buckets of
+ * one digit, 256 of two and 4096 of three. Hash of a bucket covers
+ * the hashes of its children and the root covers the 16 top buckets.
+ * Hashes are kept in the database and only those cleared by changes
+ * since the last merge are computed again, see migration 4 in db.c.
+ * Merge descends from the root into buckets whose hashes differ and
+ * compares the entries of differing leaf buckets only.
+ *
+ * Entry changed on one side is resolved against the common ancestor
+ * when one is given: the side still matching the ancestor did not
+ * change, so the other side wins. Entry changed on both sides, or
+ * any difference without an ancestor, is a conflict won by the newer
+ * modification. Entry missing from one side is added, unless the
+ * ancestor or a tombstone shows it was deleted there and the other
+ * side did not change it since, in which case the deletion wins.
+ *
+ * Tags of an entry are hashed as a sorted list along with its other
+ * values and copied with the entry, so a tag change is a change of
+ * the entry.
+ *
+ * Entries are matched by uuid only. Uuids are random, given when an
+ * entry is added or when an older vault is upgraded, so both copies
+ * must descend from the same upgraded vault. Two copies upgraded
+ * separately share no uuids and merging them adds every entry of
+ * one side to the other.
+ */
+
+#define MERGE_HASH_SIZE (32)
+#define MERGE_UUID_SIZE (33)
+#define MERGE_FANOUT (16)
+/* Root, 16, 256 and 4096 buckets */
+#define MERGE_NODES (1 + 16 + 256 + 4096)
+/* title, user, url, password, notes and tags */
+#define MERGE_HASHED_COLUMNS (6)
+#define MERGE_NULL (0xffffffff)
+
+/* Comma separated tags of the entry sorted by name, NULL if none */
+#define MERGE_TAGS "(select group_concat(name,',') from " \
+                   "(select name from tags join entry_tags on tag=tags.id " \
+                   "where entry=entries.id order by name collate nocase))"
+
+static const int level_offset[MERGE_LEVELS + 1] = { 0, 1, 17, 273 };
+
+typedef struct _merkle
+{
+    unsigned char hash[MERGE_NODES][MERGE_HASH_SIZE];
+    bool valid[MERGE_NODES];
+
+} Merkle_t;
+
+typedef struct _merge_row
+{
+    char uuid[MERGE_UUID_SIZE];
+    unsigned char hash[MERGE_HASH_SIZE];
+    sqlite3_int64 modified;
+    char *title;
+
+} Merge_row_t;
+
+typedef struct _merge_rows
+{
+    Merge_row_t *rows;
+    int count;
+    int size;
+
+} Merge_rows_t;
+
+typedef struct _merge
+{
+    Merkle_t *local_tree;
+    Merkle_t *remote_tree;
+    /* Rows of a leaf bucket */
+    sqlite3_stmt *local_leaf;
+    sqlite3_stmt *remote_leaf;
+    /* Entry by uuid */
+    sqlite3_stmt *remote_get;
+    sqlite3_stmt *base_get;
+    sqlite3_stmt *local_id;
+    /* Restores times of a copied entry after its tags are set */
+    sqlite3_stmt *set_time;
+    /* Time of deletion by uuid */
+    sqlite3_stmt *local_tombstone;
+    sqlite3_stmt *remote_tombstone;
+    sqlite3_stmt *insert;
+    sqlite3_stmt *update;
+    sqlite3_stmt *delete;
+    Merge_rows_t local_rows;
+    Merge_rows_t remote_rows;
+    Merge_result_t *result;
+
+} Merge_t;
+
+/* Hashes columns first.. of the current row of stmt. Every column
+ * is prefixed with its length so moving text between columns
+ * changes the hash.
+ */
+static void hash_entry(sqlite3_stmt *stmt, int first, unsigned char *hash)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+    for(int i = first; i < first + MERGE_HASHED_COLUMNS; i++)
+    {
+        const unsigned char *text = sqlite3_column_text(stmt, i);
+        uint32_t len = text ? sqlite3_column_bytes(stmt, i) : MERGE_NULL;
+        unsigned char bytes[4] =
+        {
+            len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, len >> 24
+        };
+
+        EVP_DigestUpdate(ctx, bytes, sizeof(bytes));
+
+        if(text)
+            EVP_DigestUpdate(ctx, text, len);
+    }
+
+    EVP_DigestFinal_ex(ctx, hash, NULL);
+    EVP_MD_CTX_free(ctx);
+}
+
+/* Computes hashes cleared by changes to the entries. Rows are read
+ * before writing as updating the hash moves them out of the index
+ * being scanned.
+ */
+static bool update_entry_hashes(sqlite3 *db)
+{
+    sqlite3_stmt *select;
+    sqlite3_stmt *update;
+    unsigned char (*hashes)[MERGE_HASH_SIZE] = NULL;
+    sqlite3_int64 *ids = NULL;
+    int count = 0;
+    int size = 0;
+    int rc;
+
+    if(sqlite3_prepare_v2(db, "select id,title,user,url,password,notes,"
+                          MERGE_TAGS " from entries where hash is null;", -1,
+                          &select, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+
+    while((rc = sqlite3_step(select)) == SQLITE_ROW)
+    {
+        if(count == size)
+        {
+            size = size ? size * 2 : 256;
+            ids = trealloc(ids, size * sizeof(*ids));
+            hashes = trealloc(hashes, size * sizeof(*hashes));
+        }
+
+        ids[count] = sqlite3_column_int64(select, 0);
+        hash_entry(select, 1, hashes[count]);
+        count++;
+    }
+
+    sqlite3_finalize(select);
+
+    if(rc == SQLITE_DONE && count > 0)
+    {
+        rc = sqlite3_prepare_v2(db, "update entries set hash=? where id=?;",
+                                -1, &update, NULL) == SQLITE_OK ? SQLITE_DONE : rc;
+
+        for(int i = 0; rc == SQLITE_DONE && i < count; i++)
+        {
+            sqlite3_bind_blob(update, 1, hashes[i], MERGE_HASH_SIZE, SQLITE_STATIC);
+            sqlite3_bind_int64(update, 2, ids[i]);
+            rc = sqlite3_step(update);
+            sqlite3_reset(update);
+        }
+
+        sqlite3_finalize(update);
+    }
+
+    if(rc != SQLITE_DONE)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+
+    free(ids);
+    free(hashes);
+
+    return rc == SQLITE_DONE;
+}
+
+static void bucket_name(int level, int bucket, char *name)
+{
+    snprintf(name, MERGE_LEVELS + 1, "%0*x", level, bucket);
+}
+
+/* Binds the uuid range of a leaf bucket to ?1 and ?2 */
+static void bind_leaf(sqlite3_stmt *stmt, int bucket)
+{
+    char lower[MERGE_LEVELS + 1];
+    char upper[MERGE_LEVELS + 1];
+
+    bucket_name(MERGE_LEVELS, bucket, lower);
+
+    //Sorts after every uuid
+    if(bucket + 1 < MERGE_NODES - level_offset[MERGE_LEVELS])
+        bucket_name(MERGE_LEVELS, bucket + 1, upper);
+    else
+        strcpy(upper, "g");
+
+    sqlite3_bind_text(stmt, 1, lower, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, upper, -1, SQLITE_TRANSIENT);
+}
+
+static bool hash_leaf(sqlite3_stmt *stmt, int bucket, unsigned char *hash)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int rc;
+
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    bind_leaf(stmt, bucket);
+
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        EVP_DigestUpdate(ctx, sqlite3_column_text(stmt, 0),
+                         sqlite3_column_bytes(stmt, 0));
+        EVP_DigestUpdate(ctx, sqlite3_column_blob(stmt, 1),
+                         sqlite3_column_bytes(stmt, 1));
+    }
+
+    sqlite3_reset(stmt);
+    EVP_DigestFinal_ex(ctx, hash, NULL);
+    EVP_MD_CTX_free(ctx);
+
+    return rc == SQLITE_DONE;
+}
+
+static void hash_children(Merkle_t *tree, int level, int bucket)
+{
+    int first = level_offset[level + 1] + bucket * MERGE_FANOUT;
+
+    EVP_Digest(tree->hash[first], MERGE_FANOUT * MERGE_HASH_SIZE,
+               tree->hash[level_offset[level] + bucket], NULL, EVP_sha256(),
+               NULL);
+}
+
+/* Loads the stored bucket hashes of db and computes the missing
+ * ones, leaves first. Must be called in a transaction.
+ */
+static bool summarize(sqlite3 *db, Merkle_t *tree)
+{
+    sqlite3_stmt *stored;
+    sqlite3_stmt *leaf;
+    sqlite3_stmt *store;
+    char name[MERGE_LEVELS + 1];
+    bool ok = true;
+
+    memset(tree->valid, 0, sizeof(tree->valid));
+
+    if(!update_entry_hashes(db))
+        return false;
+
+    if(sqlite3_prepare_v2(db, "select bucket,hash from merkle;", -1, &stored,
+                          NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+
+    while(sqlite3_step(stored) == SQLITE_ROW)
+    {
+        const char *bucket = (const char *)sqlite3_column_text(stored, 0);
+        int level = bucket ? strlen(bucket) : 0;
+        char *end;
+        long index = level > 0 ? strtol(bucket, &end, 16) : 0;
+
+        if(level < 1 || level > MERGE_LEVELS || *end != '\0' ||
+           sqlite3_column_bytes(stored, 1) != MERGE_HASH_SIZE)
+            continue;
+
+        memcpy(tree->hash[level_offset[level] + index],
+               sqlite3_column_blob(stored, 1), MERGE_HASH_SIZE);
+        tree->valid[level_offset[level] + index] = true;
+    }
+
+    sqlite3_finalize(stored);
+
+    if(sqlite3_prepare_v2(db, "select uuid,hash from entries where uuid>=?1 "
+                          "and uuid<?2 order by uuid;", -1, &leaf,
+                          NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(db, "insert or replace into merkle values(?,?);", -1,
+                          &store, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(leaf);
+        return false;
+    }
+
+    for(int level = MERGE_LEVELS; ok && level > 0; level--)
+    {
+        int buckets = 1 << (4 * level);
+
+        for(int i = 0; ok && i < buckets; i++)
+        {
+            int node = level_offset[level] + i;
+
+            if(tree->valid[node])
+                continue;
+
+            if(level == MERGE_LEVELS)
+                ok = hash_leaf(leaf, i, tree->hash[node]);
+            else
+                hash_children(tree, level, i);
+
+            //Parent covers the new hash
+            tree->valid[level_offset[level - 1] + i / MERGE_FANOUT] = false;
+
+            bucket_name(level, i, name);
+            sqlite3_bind_text(store, 1, name, -1, SQLITE_STATIC);
+            sqlite3_bind_blob(store, 2, tree->hash[node], MERGE_HASH_SIZE,
+                              SQLITE_STATIC);
+            ok = ok && sqlite3_step(store) == SQLITE_DONE;
+            sqlite3_reset(store);
+        }
+    }
+
+    if(!ok)
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+
+    hash_children(tree, 0, 0);
+
+    sqlite3_finalize(leaf);
+    sqlite3_finalize(store);
+
+    return ok;
+}
+
+static void rows_clear(Merge_rows_t *rows)
+{
+    for(int i = 0; i < rows->count; i++)
+        free(rows->rows[i].title);
+
+    rows->count = 0;
+}
+
+static bool load_leaf(sqlite3_stmt *stmt, int bucket, Merge_rows_t *rows)
+{
+    int rc;
+
+    rows_clear(rows);
+    bind_leaf(stmt, bucket);
+
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        Merge_row_t *row;
+        const char *title = (const char *)sqlite3_column_text(stmt, 3);
+
+        if(rows->count == rows->size)
+        {
+            rows->size = rows->size ? rows->size * 2 : 64;
+            rows->rows = trealloc(rows->rows, rows->size * sizeof(Merge_row_t));
+        }
+
+        row = &rows->rows[rows->count++];
+
+        snprintf(row->uuid, MERGE_UUID_SIZE, "%s",
+                 (const char *)sqlite3_column_text(stmt, 0));
+        memset(row->hash, 0, MERGE_HASH_SIZE);
+
+        if(sqlite3_column_bytes(stmt, 1) == MERGE_HASH_SIZE)
+            memcpy(row->hash, sqlite3_column_blob(stmt, 1), MERGE_HASH_SIZE);
+
+        row->modified = sqlite3_column_int64(stmt, 2);
+        row->title = strdup(title ? title : "");
+    }
+
+    sqlite3_reset(stmt);
+
+    return rc == SQLITE_DONE;
+}
+
+/* Returns true if the ancestor has the entry, with its hash */
+static bool base_hash(Merge_t *merge, const char *uuid, unsigned char *hash)
+{
+    bool found;
+
+    if(!merge->base_get)
+        return false;
+
+    sqlite3_bind_text(merge->base_get, 1, uuid, -1, SQLITE_STATIC);
+    found = sqlite3_step(merge->base_get) == SQLITE_ROW;
+
+    if(found)
+        hash_entry(merge->base_get, 0, hash);
+
+    sqlite3_reset(merge->base_get);
+
+    return found;
+}
+
+/* Writes the remote entry into the local vault with stmt, either
+ * insert or update, and replaces its tags. Both statements take the
+ * columns of remote_get before its last one, the tags. Setting tags
+ * touches the entry, so its remote times are put back last.
+ */
+static bool copy_remote(Merge_t *merge, sqlite3_stmt *stmt, const char *uuid)
+{
+    sqlite3_stmt *get = merge->remote_get;
+    int tags = sqlite3_column_count(get) - 1;
+    bool ok;
+
+    sqlite3_bind_text(get, 1, uuid, -1, SQLITE_STATIC);
+    ok = sqlite3_step(get) == SQLITE_ROW;
+
+    for(int i = 0; ok && i < tags; i++)
+        sqlite3_bind_value(stmt, i + 1, sqlite3_column_value(get, i));
+
+    ok = ok && sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+
+    sqlite3_bind_text(merge->local_id, 1, uuid, -1, SQLITE_STATIC);
+    ok = ok && sqlite3_step(merge->local_id) == SQLITE_ROW;
+
+    if(ok)
+    {
+        const char *text = (const char *)sqlite3_column_text(get, tags);
+
+        ok = db_set_tags(sqlite3_db_handle(stmt),
+                         sqlite3_column_int(merge->local_id, 0),
+                         text ? text : "");
+
+        //Timestamp, modified and id
+        sqlite3_bind_value(merge->set_time, 1, sqlite3_column_value(get, 5));
+        sqlite3_bind_value(merge->set_time, 2, sqlite3_column_value(get, 6));
+        sqlite3_bind_int(merge->set_time, 3,
+                         sqlite3_column_int(merge->local_id, 0));
+        ok = ok && sqlite3_step(merge->set_time) == SQLITE_DONE;
+        sqlite3_reset(merge->set_time);
+    }
+
+    sqlite3_reset(merge->local_id);
+    sqlite3_reset(get);
+
+    return ok;
+}
+
+static void report_conflict(Merge_t *merge, const char *title, bool remote)
+{
+    merge->result->conflicts++;
+    fprintf(stderr, "Conflict in entry \"%s\", kept the %s version.\n", title,
+            remote ? "other" : "local");
+}
+
+static bool merge_changed(Merge_t *merge, Merge_row_t *local, Merge_row_t *remote)
+{
+    unsigned char base[MERGE_HASH_SIZE];
+    bool take_remote;
+
+    if(!base_hash(merge, local->uuid, base))
+    {
+        take_remote = remote->modified > local->modified;
+        report_conflict(merge, local->title, take_remote);
+    }
+    else if(memcmp(base, local->hash, MERGE_HASH_SIZE) == 0)
+        take_remote = true;
+    else if(memcmp(base, remote->hash, MERGE_HASH_SIZE) == 0)
+        take_remote = false;
+    else
+    {
+        take_remote = remote->modified > local->modified;
+        report_conflict(merge, local->title, take_remote);
+    }
+
+    if(!take_remote)
+        return true;
+
+    merge->result->updated++;
+
+    return copy_remote(merge, merge->update, remote->uuid);
+}
+
+/* Returns true if the entry has a tombstone of stmt from modified
+ * or later.
+ */
+static bool deleted_since(sqlite3_stmt *stmt, const char *uuid,
+                          sqlite3_int64 modified)
+{
+    bool deleted;
+
+    sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC);
+    deleted = sqlite3_step(stmt) == SQLITE_ROW &&
+              sqlite3_column_int64(stmt, 0) >= modified;
+    sqlite3_reset(stmt);
+
+    return deleted;
+}
+
+static bool merge_local_only(Merge_t *merge, Merge_row_t *local)
+{
+    unsigned char base[MERGE_HASH_SIZE];
+    bool ok;
+
+    if(base_hash(merge, local->uuid, base))
+    {
+        if(memcmp(base, local->hash, MERGE_HASH_SIZE) != 0)
+        {
+            report_conflict(merge, local->title, false);
+            return true;
+        }
+    }
+    //New on this side
+    else if(!deleted_since(merge->remote_tombstone, local->uuid,
+                           local->modified))
+        return true;
+
+    sqlite3_bind_text(merge->delete, 1, local->uuid, -1, SQLITE_STATIC);
+    ok = sqlite3_step(merge->delete) == SQLITE_DONE;
+    sqlite3_reset(merge->delete);
+
+    merge->result->deleted++;
+
+    return ok;
+}
+
+static bool merge_remote_only(Merge_t *merge, Merge_row_t *remote)
+{
+    unsigned char base[MERGE_HASH_SIZE];
+
+    if(base_hash(merge, remote->uuid, base))
+    {
+        //Deleted on this side
+        if(memcmp(base, remote->hash, MERGE_HASH_SIZE) == 0)
+            return true;
+
+        report_conflict(merge, remote->title, true);
+    }
+    else if(deleted_since(merge->local_tombstone, remote->uuid,
+                          remote->modified))
+        return true;
+
+    merge->result->added++;
+
+    return copy_remote(merge, merge->insert, remote->uuid);
+}
+
+/* Walks the rows of a leaf bucket of both sides in uuid order */
+static bool merge_leaf(Merge_t *merge, int bucket)
+{
+    Merge_rows_t *local = &merge->local_rows;
+    Merge_rows_t *remote = &merge->remote_rows;
+    int l = 0;
+    int r = 0;
+    bool ok;
+
+    merge->result->buckets++;
+
+    ok = load_leaf(merge->local_leaf, bucket, local) &&
+         load_leaf(merge->remote_leaf, bucket, remote);
+
+    while(ok && (l < local->count || r < remote->count))
+    {
+        int cmp;
+
+        if(l == local->count)
+            cmp = 1;
+        else if(r == remote->count)
+            cmp = -1;
+        else
+            cmp = strcmp(local->rows[l].uuid, remote->rows[r].uuid);
+
+        if(cmp < 0)
+            ok = merge_local_only(merge, &local->rows[l++]);
+        else if(cmp > 0)
+            ok = merge_remote_only(merge, &remote->rows[r++]);
+        else
+        {
+            if(memcmp(local->rows[l].hash, remote->rows[r].hash,
+                      MERGE_HASH_SIZE) != 0)
+                ok = merge_changed(merge, &local->rows[l], &remote->rows[r]);
+
+            l++;
+            r++;
+        }
+    }
+
+    return ok;
+}
+
+/* Descends into the children of a bucket whose hashes differ */
+static bool merge_bucket(Merge_t *merge, int level, int bucket)
+{
+    int node = level_offset[level] + bucket;
+    bool ok = true;
+
+    if(memcmp(merge->local_tree->hash[node], merge->remote_tree->hash[node],
+              MERGE_HASH_SIZE) == 0)
+        return true;
+
+    if(level == MERGE_LEVELS)
+        return merge_leaf(merge, bucket);
+
+    for(int i = 0; ok && i < MERGE_FANOUT; i++)
+        ok = merge_bucket(merge, level + 1, bucket * MERGE_FANOUT + i);
+
+    return ok;
+}
+
+static bool prepare_statements(Merge_t *merge, sqlite3 *local, sqlite3 *remote,
+                               sqlite3 *base)
+{
+    const char *leaf = "select uuid,hash,modified,title from entries "
+                       "where uuid>=?1 and uuid<?2 order by uuid;";
+    const char *tombstone = "select deleted from tombstones where uuid=?;";
+
+    if(sqlite3_prepare_v2(local, leaf, -1, &merge->local_leaf, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(local, "insert into entries(title,user,url,password,"
+                          "notes,timestamp,modified,uuid) "
+                          "values(?,?,?,?,?,?,?,?);", -1, &merge->insert,
+                          NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(local, "update entries set title=?1,user=?2,url=?3,"
+                          "password=?4,notes=?5,timestamp=?6,modified=?7 "
+                          "where uuid=?8;", -1, &merge->update, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(local, tombstone, -1, &merge->local_tombstone,
+                          NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(local, "delete from entries where uuid=?;", -1,
+                          &merge->delete, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(local, "select id from entries where uuid=?;", -1,
+                          &merge->local_id, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(local, "update entries set timestamp=?,modified=? "
+                          "where id=?;", -1, &merge->set_time, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(local));
+        return false;
+    }
+
+    if(sqlite3_prepare_v2(remote, leaf, -1, &merge->remote_leaf, NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(remote, "select title,user,url,password,notes,"
+                          "timestamp,modified,uuid," MERGE_TAGS " from entries "
+                          "where uuid=?;", -1, &merge->remote_get,
+                          NULL) != SQLITE_OK ||
+       sqlite3_prepare_v2(remote, tombstone, -1, &merge->remote_tombstone,
+                          NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(remote));
+        return false;
+    }
+
+    if(base && sqlite3_prepare_v2(base, "select title,user,url,password,notes,"
+                                  MERGE_TAGS " from entries where uuid=?;", -1,
+                                  &merge->base_get, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(base));
+        return false;
+    }
+
+    return true;
+}
+
+static void finalize_statements(Merge_t *merge)
+{
+    sqlite3_finalize(merge->local_leaf);
+    sqlite3_finalize(merge->remote_leaf);
+    sqlite3_finalize(merge->remote_get);
+    sqlite3_finalize(merge->base_get);
+    sqlite3_finalize(merge->local_id);
+    sqlite3_finalize(merge->set_time);
+    sqlite3_finalize(merge->local_tombstone);
+    sqlite3_finalize(merge->remote_tombstone);
+    sqlite3_finalize(merge->insert);
+    sqlite3_finalize(merge->update);
+    sqlite3_finalize(merge->delete);
+}
+
+/* Summarizes remote in its own transaction, its stored hashes are
+ * only a cache and kept even if the merge fails.
+ */
+static bool summarize_remote(sqlite3 *remote, Merkle_t *tree)
+{
+    bool ok = sqlite3_exec(remote, "begin immediate;", NULL, NULL, NULL) == SQLITE_OK &&
+              summarize(remote, tree);
+
+    if(ok)
+        ok = sqlite3_exec(remote, "commit;", NULL, NULL, NULL) == SQLITE_OK;
+
+    if(!ok)
+    {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(remote));
+        sqlite3_exec(remote, "rollback;", NULL, NULL, NULL);
+    }
+
+    return ok;
+}
+
+/* Merges the entries of remote into local, resolving changes made on
+ * both sides against base when it is not NULL. Local is changed in
+ * one transaction, remote and base are only read apart from cached
+ * hashes of remote. All three must be migrated databases.
+ */
+bool merge_vaults(sqlite3 *local, sqlite3 *remote, sqlite3 *base,
+                  Merge_result_t *result)
+{
+    Merge_t merge;
+    bool ok;
+
+    memset(&merge, 0, sizeof(merge));
+    memset(result, 0, sizeof(Merge_result_t));
+
+    merge.result = result;
+    merge.local_tree = tmalloc(sizeof(Merkle_t));
+    merge.remote_tree = tmalloc(sizeof(Merkle_t));
+
+    ok = summarize_remote(remote, merge.remote_tree) &&
+         sqlite3_exec(local, "begin immediate;", NULL, NULL, NULL) == SQLITE_OK;
+
+    if(ok)
+    {
+        ok = summarize(local, merge.local_tree) &&
+             prepare_statements(&merge, local, remote, base) &&
+             merge_bucket(&merge, 0, 0);
+
+        finalize_statements(&merge);
+
+        if(ok)
+            ok = sqlite3_exec(local, "commit;", NULL, NULL, NULL) == SQLITE_OK;
+
+        if(!ok)
+        {
+            fprintf(stderr, "Error: %s\n", sqlite3_errmsg(local));
+            sqlite3_exec(local, "rollback;", NULL, NULL, NULL);
+        }
+    }
+
+    rows_clear(&merge.local_rows);
+    rows_clear(&merge.remote_rows);
+    free(merge.local_rows.rows);
+    free(merge.remote_rows.rows);
+    free(merge.local_tree);
+    free(merge.remote_tree);
+
+    return ok;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __MERGE_H
+#define __MERGE_H
+
+/* Entries are summarized in buckets by the leading hex digits of
+ * their uuid, one digit per level. Leaf buckets are MERGE_LEVELS
+ * digits long.
+ */
+#define MERGE_LEVELS (3)
+
+typedef struct _merge_result
+{
+    int added;
+    int updated;
+    int deleted;
+    /* Entries changed on both sides */
+    int conflicts;
+    /* Leaf buckets whose entries were compared */
+    int buckets;
+
+} Merge_result_t;
+
+bool merge_vaults(struct sqlite3 *local, struct sqlite3 *remote,
+                  struct sqlite3 *base, Merge_result_t *result);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "stats.h"
+
+/* Statistics of libtitan. The library keeps no process wide
+ * counters, so every call only does its own work. The titan
+ * program links stats.o, which defines the same functions,
+ * before the library.
+ */
+
+bool stats_enable(const char *mode)
+{
+    (void)mode;
+    return false;
+}
+
+bool stats_enabled()
+{
+    return false;
+}
+
+double stats_start()
+{
+    return 0;
+}
+
+void stats_stop(int phase, double start)
+{
+    (void)phase;
+    (void)start;
+}
+
+void stats_add(int counter, unsigned long long value)
+{
+    (void)counter;
+    (void)value;
+}
+
+size_t stats_fread(void *ptr, size_t size, size_t nmemb, FILE *fp)
+{
+    return fread(ptr, size, nmemb, fp);
+}
+
+size_t stats_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *fp)
+{
+    return fwrite(ptr, size, nmemb, fp);
+}
+
+void stats_print()
+{
+}
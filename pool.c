@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+#include "utils.h"
+
+typedef struct _job
+{
+    Job_fn_t fn;
+    void *arg;
+    struct _job *next;
+
+} Job_t;
+
+/* Fixed size pool of worker threads running jobs from
+ * a FIFO queue.
+ */
+struct _pool
+{
+    pthread_mutex_t mutex;
+    /* Signaled when a job is queued or the pool is shutting down */
+    pthread_cond_t job_ready;
+    /* Signaled when the last pending job finishes */
+    pthread_cond_t all_done;
+    Job_t *head;
+    Job_t *tail;
+    /* Jobs queued or running */
+    int pending;
+    bool shutdown;
+    int thread_count;
+    pthread_t *threads;
+};
+
+static void *worker(void *data)
+{
+    Pool_t *pool = data;
+
+    while(true)
+    {
+        Job_t *job;
+
+        pthread_mutex_lock(&pool->mutex);
+
+        while(!pool->head && !pool->shutdown)
+            pthread_cond_wait(&pool->job_ready, &pool->mutex);
+
+        if(!pool->head)
+        {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+
+        job = pool->head;
+        pool->head = job->next;
+
+        if(!pool->head)
+            pool->tail = NULL;
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        job->fn(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->mutex);
+
+        if(--pool->pending == 0)
+            pthread_cond_broadcast(&pool->all_done);
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+/* Returns the number of online processors, at least one */
+int pool_default_size()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+}
+
+/* Starts a pool with the given number of threads. Caller
+ * must free the pool with pool_free.
+ */
+Pool_t *pool_new(int threads)
+{
+    Pool_t *pool = tmalloc(sizeof(Pool_t));
+
+    if(threads < 1)
+        threads = 1;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->pending = 0;
+    pool->shutdown = false;
+    pool->thread_count = 0;
+    pool->threads = tmalloc(threads * sizeof(pthread_t));
+
+    for(int i = 0; i < threads; i++)
+    {
+        if(pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+            break;
+
+        pool->thread_count++;
+    }
+
+    if(pool->thread_count == 0)
+    {
+        fprintf(stderr, "Unable to start worker threads. Abort.\n");
+        abort();
+    }
+
+    return pool;
+}
+
+void pool_submit(Pool_t *pool, Job_fn_t fn, void *arg)
+{
+    Job_t *job = tmalloc(sizeof(Job_t));
+
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if(pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+
+    pool->tail = job;
+    pool->pending++;
+
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Blocks until every submitted job has finished */
+void pool_wait(Pool_t *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    while(pool->pending > 0)
+        pthread_cond_wait(&pool->all_done, &pool->mutex);
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Finishes queued jobs, stops the threads and frees the pool */
+void pool_free(Pool_t *pool)
+{
+    if(!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->threads);
+    free(pool);
+}
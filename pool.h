@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __POOL_H
+#define __POOL_H
+
+typedef void (*Job_fn_t)(void *arg);
+
+typedef struct _pool Pool_t;
+
+int pool_default_size();
+Pool_t *pool_new(int threads);
+void pool_submit(Pool_t *pool, Job_fn_t fn, void *arg);
+void pool_wait(Pool_t *pool);
+void pool_free(Pool_t *pool);
+
+#endif
@@ -6,77 +6,224 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <time.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include "utils.h"
-#ifdef __MACH__
-#include <mach/clock.h>
-#include <mach/mach.h>
-#endif
+#include "format.h"
+#include "rng.h"
+#include "wordlist.h"
+#include "pwd-gen.h"
 
-/*Generates random number between 0 and max.
- *Function should generate uniform distribution.
+/* Character classes passwords are built from. Each character
+ * appears only once so none of them is more likely than others.
  */
-static unsigned int rand_between(unsigned int min, unsigned int max)
+static const char *class_names[PWD_CLASS_COUNT] =
 {
-    int r;
-    const unsigned int range = 1 + max - min;
-    const unsigned int buckets = RAND_MAX / range;
-    const unsigned int limit = buckets * range;
-
-    /*Create equal size buckets all in a row, then fire randomly towards
-     *the buckets until you land in one of them. All buckets are equally
-     *likely. If you land off the end of the line of buckets, try again.
-     */
-    do
+    "lower", "upper", "digit", "symbol"
+};
+
+static const char *class_chars[PWD_CLASS_COUNT] =
+{
+    "abcdefghijklmnopqrstuvwxyz",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+    "0123456789",
+    "!#%()/=?"
+};
+
+/* Parses comma separated list of class names into a bit mask of
+ * PWD_CLASS_* bits. Returns -1 if spec contains an unknown class.
+ */
+int pwd_classes_parse(const char *spec)
+{
+    int mask = 0;
+
+    while(*spec != '\0')
     {
-        r = rand();
-    } while (r >= limit);
+        size_t len = strcspn(spec, ",");
+        int found = -1;
+
+        for(int i = 0; i < PWD_CLASS_COUNT; i++)
+        {
+            if(strlen(class_names[i]) == len &&
+               strncmp(spec, class_names[i], len) == 0)
+                found = i;
+        }
+
+        if(found == -1)
+        {
+            fprintf(stderr, "Unknown character class '%.*s'.\n", (int)len, spec);
+            return -1;
+        }
 
-    return min + (r / buckets);
+        mask |= 1 << found;
+        spec += len;
+
+        if(*spec == ',')
+            spec++;
+    }
+
+    return mask;
 }
 
-/* Simply generate secure password
- * and output it to the stdout, use clock_gettime for
- * seeding srand
+/* Returns true if pass contains a character of every
+ * class in the required mask.
  */
-void generate_password(int length)
+static bool meets_requirements(const char *pass, int length, int required)
 {
-    if(length < 1 || length > RAND_MAX)
-        return;
+    int found = 0;
 
-    char *pass = NULL;
-    char *alpha = "abcdefghijklmnopqrstuvwxyz" \
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZ" \
-    "0123456789?)(/%#!?)=";
+    for(int i = 0; i < length; i++)
+    {
+        for(int j = 0; j < PWD_CLASS_COUNT; j++)
+        {
+            if(strchr(class_chars[j], pass[i]))
+                found |= 1 << j;
+        }
+    }
+
+    return (found & required) == required;
+}
+
+/* Generates count passwords of length characters drawn uniformly
+ * from the classes in policy and writes them to stdout, one per line.
+ * Passwords missing a required class are thrown away as a whole and
+ * generated again, which keeps the result uniform over all passwords
+ * meeting the policy.
+ */
+bool generate_passwords(Pwd_policy_t *policy, int length, int count)
+{
+    char alpha[128];
     unsigned int max;
     unsigned int number;
-    struct timespec tspec;
-
-#ifdef __MACH__
-    /*OS X does not have clock_gettime, use clock_get_time*/
-    clock_serv_t cclock;
-    mach_timespec_t mts;
-    host_get_clock_service(mach_host_self(), SYSTEM_CLOCK, &cclock);
-    clock_get_time(cclock, &mts);
-    mach_port_deallocate(mach_task_self(), cclock);
-    tspec.tv_sec = mts.tv_sec;
-    tspec.tv_nsec = mts.tv_nsec;
-#else
-    clock_gettime(CLOCK_MONOTONIC, &tspec);
-#endif
-
-    srand(tspec.tv_nsec);
-    max = strlen(alpha) - 1;
+    int required_count = 0;
+    char *pass = NULL;
+    Writer_t writer;
+    Rng_t rng;
+    bool ok = true;
+
+    if(length < 1)
+    {
+        fprintf(stderr, "Password length must be at least one.\n");
+        return false;
+    }
+
+    if((policy->required & ~policy->classes) != 0)
+    {
+        fprintf(stderr, "Required character classes must be enabled.\n");
+        return false;
+    }
+
+    alpha[0] = '\0';
+
+    for(int i = 0; i < PWD_CLASS_COUNT; i++)
+    {
+        if(policy->classes & (1 << i))
+            strcat(alpha, class_chars[i]);
+
+        if(policy->required & (1 << i))
+            required_count++;
+    }
+
+    max = strlen(alpha);
+
+    if(max == 0)
+    {
+        fprintf(stderr, "No character classes enabled.\n");
+        return false;
+    }
+
+    if(required_count > length)
+    {
+        fprintf(stderr, "Password is too short for the required classes.\n");
+        return false;
+    }
+
     pass = tmalloc((length + 1) * sizeof(char));
+    pass[length] = '\n';
+
+    rng_init(&rng);
+    writer_init(&writer, stdout);
 
-    for(int j = 0; j < length; j++)
+    for(int i = 0; i < count && ok; i++)
     {
-        number = rand_between(0, max);
-        pass[j] = alpha[number];
+        do
+        {
+            for(int j = 0; j < length; j++)
+            {
+                if(!rng_uniform(&rng, max, &number))
+                {
+                    ok = false;
+                    break;
+                }
+
+                pass[j] = alpha[number];
+            }
+        } while(ok && !meets_requirements(pass, length, policy->required));
+
+        if(ok)
+            writer_write(&writer, pass, length + 1);
     }
 
-    fprintf(stdout, "%s\n", pass);
+    if(!writer_flush(&writer))
+        ok = false;
+
+    memset(pass, 0, length + 1);
     free(pass);
+    rng_wipe(&rng);
+
+    return ok;
+}
+
+/* Generates count passphrases of words words drawn uniformly from the
+ * wordlist and writes them to stdout, one per line.
+ */
+bool generate_passphrases(int words, const char *separator, int count)
+{
+    Wordlist_t list;
+    Writer_t writer;
+    Rng_t rng;
+    unsigned int number;
+    size_t separator_len = strlen(separator);
+    bool ok = true;
+
+    if(words < 1)
+    {
+        fprintf(stderr, "Passphrase must have at least one word.\n");
+        return false;
+    }
+
+    if(!wordlist_open(&list))
+        return false;
+
+    rng_init(&rng);
+    writer_init(&writer, stdout);
+
+    for(int i = 0; i < count && ok; i++)
+    {
+        for(int j = 0; j < words; j++)
+        {
+            if(!rng_uniform(&rng, list.count, &number))
+            {
+                ok = false;
+                break;
+            }
+
+            if(j > 0)
+                writer_write(&writer, separator, separator_len);
+
+            writer_write(&writer, list.data + list.words[number].offset,
+                         list.words[number].length);
+        }
+
+        writer_putc(&writer, '\n');
+    }
+
+    if(!writer_flush(&writer))
+        ok = false;
+
+    rng_wipe(&rng);
+    wordlist_close(&list);
+
+    return ok;
 }
@@ -5,6 +5,25 @@
 #ifndef __PWD_GEN_H
 #define __PWD_GEN_H
 
-void generate_password(int length);
+#define PWD_CLASS_LOWER  (1 << 0)
+#define PWD_CLASS_UPPER  (1 << 1)
+#define PWD_CLASS_DIGIT  (1 << 2)
+#define PWD_CLASS_SYMBOL (1 << 3)
+#define PWD_CLASS_ALL    (0x0f)
+#define PWD_CLASS_COUNT  (4)
+
+/* Bit masks of PWD_CLASS_* values */
+typedef struct _pwd_policy
+{
+    /* Classes characters are drawn from */
+    int classes;
+    /* Classes every password must contain */
+    int required;
+
+} Pwd_policy_t;
+
+int pwd_classes_parse(const char *spec);
+bool generate_passwords(Pwd_policy_t *policy, int length, int count);
+bool generate_passphrases(int words, const char *separator, int count);
 
 #endif
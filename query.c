@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <sqlite3.h>
+#include "utils.h"
+#include "query.h"
+
+/* Searches are whitespace separated terms, all of which must match:
+ *
+ *   word               word in title, user, url or notes
+ *   field:text         text in the field
+ *   field:pattern      whole field matches pattern, * is any text
+ *                      and ? any character
+ *   field=text         field is text
+ *   tag:name           entry has the tag
+ *   modified<time      also <=, >, >= and =, time as in --changed-since
+ *   -term              term does not match
+ *
+ * Fields are title, user, url and notes, text and patterns ignore
+ * case and values with spaces can be quoted. A term of unknown field
+ * is searched as a word.
+ *
+ * Values are bound as parameters. Title and url have indexes of their
+ * own, sqlite uses them for exact matches and for patterns not
+ * starting with a wildcard once it has prepared the statement again
+ * with the bound value. Tags and modified times are always looked up
+ * through indexes. User, notes and words scan every entry.
+ */
+
+#define QUERY_ESCAPE '\\'
+
+static const char *text_fields[] = { "title", "user", "url", "notes", NULL };
+
+static const char *comparisons[] = { "<=", ">=", "<", ">", "=", NULL };
+
+typedef struct _term
+{
+    bool negate;
+    /* NULL for a word */
+    const char *field;
+    const char *op;
+    char *value;
+
+} Term_t;
+
+static bool is_text_field(const char *name, size_t len)
+{
+    for(int i = 0; text_fields[i]; i++)
+    {
+        if(strlen(text_fields[i]) == len && strncmp(name, text_fields[i], len) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* Returns the operator at pos valid for field name, or NULL */
+static const char *term_operator(const char *name, size_t len, const char *pos)
+{
+    if(is_text_field(name, len) || (len == 3 && strncmp(name, "tag", 3) == 0))
+    {
+        if(*pos == ':')
+            return ":";
+        if(*pos == '=')
+            return "=";
+
+        return NULL;
+    }
+
+    if(len == 8 && strncmp(name, "modified", 8) == 0)
+    {
+        for(int i = 0; comparisons[i]; i++)
+        {
+            if(strncmp(pos, comparisons[i], strlen(comparisons[i])) == 0)
+                return comparisons[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Reads a value at *pos, quoted or up to the next space. Caller
+ * must free the return value.
+ */
+static char *read_value(const char **pos)
+{
+    const char *start = *pos;
+    size_t len;
+
+    if(*start == '"')
+    {
+        const char *end = strchr(start + 1, '"');
+
+        if(!end)
+            return NULL;
+
+        *pos = end + 1;
+
+        return strndup(start + 1, end - start - 1);
+    }
+
+    len = strcspn(start, " \t\n");
+    *pos = start + len;
+
+    return strndup(start, len);
+}
+
+/* Reads the next term at *pos. Returns false at the end of the
+ * search, sets *error on a malformed term.
+ */
+static bool next_term(const char **pos, Term_t *term, bool *error)
+{
+    const char *p = *pos;
+    size_t len;
+
+    while(isspace((unsigned char)*p))
+        p++;
+
+    if(*p == '\0')
+        return false;
+
+    memset(term, 0, sizeof(Term_t));
+
+    if(*p == '-' && p[1] != '\0' && !isspace((unsigned char)p[1]))
+    {
+        term->negate = true;
+        p++;
+    }
+
+    len = 0;
+
+    while(islower((unsigned char)p[len]))
+        len++;
+
+    term->op = len > 0 ? term_operator(p, len, p + len) : NULL;
+
+    if(term->op)
+    {
+        term->field = strndup(p, len);
+        p += len + strlen(term->op);
+    }
+
+    term->value = read_value(&p);
+    *pos = p;
+
+    if(!term->value || (term->field && term->value[0] == '\0'))
+    {
+        free((char *)term->field);
+        free(term->value);
+        *error = true;
+
+        return false;
+    }
+
+    return true;
+}
+
+static void term_free(Term_t *term)
+{
+    free((char *)term->field);
+    free(term->value);
+}
+
+/* Adds a parameter and returns its number */
+static int add_param(Query_t *query, bool is_number, long long number,
+                     char *text)
+{
+    query->params = trealloc(query->params,
+                             (query->count + 1) * sizeof(Query_param_t));
+
+    query->params[query->count].is_number = is_number;
+    query->params[query->count].number = number;
+    query->params[query->count].text = text;
+
+    return ++query->count;
+}
+
+/* Turns value into a LIKE pattern. Wildcards of the query become
+ * LIKE wildcards if glob is set, anything else matches literally.
+ */
+static char *like_pattern(const char *value, bool glob, bool contains)
+{
+    char *pattern = tmalloc(strlen(value) * 2 + 3);
+    char *p = pattern;
+
+    if(contains)
+        *p++ = '%';
+
+    for(; *value; value++)
+    {
+        if(glob && *value == '*')
+            *p++ = '%';
+        else if(glob && *value == '?')
+            *p++ = '_';
+        else
+        {
+            if(*value == '%' || *value == '_' || *value == QUERY_ESCAPE)
+                *p++ = QUERY_ESCAPE;
+
+            *p++ = *value;
+        }
+    }
+
+    if(contains)
+        *p++ = '%';
+
+    *p = '\0';
+
+    return pattern;
+}
+
+/* Returns the condition of term, NULL if its value is invalid.
+ * Caller must free the return value with sqlite3_free.
+ */
+static char *compile_term(Term_t *term, Query_t *query)
+{
+    long long time;
+    int n;
+
+    if(!term->field)
+    {
+        n = add_param(query, false, 0, like_pattern(term->value, false, true));
+
+        return sqlite3_mprintf("(title like ?%d escape '\\' or "
+                               "user like ?%d escape '\\' or "
+                               "url like ?%d escape '\\' or "
+                               "notes like ?%d escape '\\')", n, n, n, n);
+    }
+
+    if(strcmp(term->field, "tag") == 0)
+    {
+        n = add_param(query, false, 0, strdup(term->value));
+
+        return sqlite3_mprintf("id in (select entry from entry_tags where "
+                               "tag=(select id from tags where name=?%d))", n);
+    }
+
+    if(strcmp(term->field, "modified") == 0)
+    {
+        if(!parse_time(term->value, &time))
+            return NULL;
+
+        n = add_param(query, true, time, NULL);
+
+        return sqlite3_mprintf("modified%s?%d", term->op, n);
+    }
+
+    if(strcmp(term->op, "=") == 0)
+    {
+        n = add_param(query, false, 0, strdup(term->value));
+
+        return sqlite3_mprintf("%s=?%d collate nocase", term->field, n);
+    }
+
+    bool glob = strpbrk(term->value, "*?") != NULL;
+
+    n = add_param(query, false, 0, like_pattern(term->value, glob, !glob));
+
+    return sqlite3_mprintf("%s like ?%d escape '\\'", term->field, n);
+}
+
+/* Compiles search into query. Empty search matches every entry.
+ * Returns false with a message on a malformed search, query must be
+ * freed with query_free either way.
+ */
+bool query_compile(const char *search, Query_t *query)
+{
+    const char *pos = search;
+    bool error = false;
+    Term_t term;
+
+    query->where = sqlite3_mprintf("1");
+    query->params = NULL;
+    query->count = 0;
+
+    while(next_term(&pos, &term, &error))
+    {
+        char *condition = compile_term(&term, query);
+        char *where;
+
+        if(!condition)
+        {
+            fprintf(stderr, "Invalid time %s.\n", term.value);
+            term_free(&term);
+
+            return false;
+        }
+
+        //Unset values of a negated term don't match either
+        if(term.negate)
+            where = sqlite3_mprintf("%s and not ifnull(%s,0)", query->where,
+                                    condition);
+        else
+            where = sqlite3_mprintf("%s and %s", query->where, condition);
+
+        sqlite3_free(query->where);
+        sqlite3_free(condition);
+        term_free(&term);
+
+        query->where = where;
+    }
+
+    if(error)
+        fprintf(stderr, "Invalid search term at '%s'.\n", pos);
+
+    return !error;
+}
+
+bool query_bind(Query_t *query, sqlite3_stmt *stmt)
+{
+    int rc = SQLITE_OK;
+
+    for(int i = 0; i < query->count && rc == SQLITE_OK; i++)
+    {
+        if(query->params[i].is_number)
+            rc = sqlite3_bind_int64(stmt, i + 1, query->params[i].number);
+        else
+            rc = sqlite3_bind_text(stmt, i + 1, query->params[i].text, -1,
+                                   SQLITE_STATIC);
+    }
+
+    return rc == SQLITE_OK;
+}
+
+void query_free(Query_t *query)
+{
+    for(int i = 0; i < query->count; i++)
+        free(query->params[i].text);
+
+    free(query->params);
+    sqlite3_free(query->where);
+
+    query->where = NULL;
+    query->params = NULL;
+    query->count = 0;
+}
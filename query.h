@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __QUERY_H
+#define __QUERY_H
+
+typedef struct _query_param
+{
+    bool is_number;
+    long long number;
+    char *text;
+
+} Query_param_t;
+
+/* Search compiled into a condition on the entries table. Parameters
+ * are numbered ?1.. in the condition, in the order of params.
+ */
+typedef struct _query
+{
+    char *where;
+    Query_param_t *params;
+    int count;
+
+} Query_t;
+
+bool query_compile(const char *search, Query_t *query);
+bool query_bind(Query_t *query, struct sqlite3_stmt *stmt);
+void query_free(Query_t *query);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/rand.h>
+#include "rng.h"
+
+void rng_init(Rng_t *rng)
+{
+    //Buffer is filled on first use
+    rng->pos = RNG_BUFFER_SIZE;
+}
+
+static bool rng_bytes(Rng_t *rng, unsigned char *out, size_t len)
+{
+    while(len > 0)
+    {
+        if(rng->pos == RNG_BUFFER_SIZE)
+        {
+            if(RAND_bytes(rng->buffer, RNG_BUFFER_SIZE) != 1)
+            {
+                fprintf(stderr, "Unable to generate random data.\n");
+                return false;
+            }
+
+            rng->pos = 0;
+        }
+
+        size_t n = RNG_BUFFER_SIZE - rng->pos;
+
+        if(n > len)
+            n = len;
+
+        memcpy(out, rng->buffer + rng->pos, n);
+        //Used random data must not be left behind
+        memset(rng->buffer + rng->pos, 0, n);
+        rng->pos += n;
+        out += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/* Returns an unbiased random number between 0 and n - 1 in result.
+ * Draws falling outside of the largest multiple of n are rejected
+ * and drawn again, so every number is equally likely. Single bytes
+ * are used when n fits into one.
+ */
+bool rng_uniform(Rng_t *rng, unsigned int n, unsigned int *result)
+{
+    if(n == 0)
+        return false;
+
+    if(n <= 256)
+    {
+        const unsigned int limit = 256 - (256 % n);
+        unsigned char byte;
+
+        do
+        {
+            if(!rng_bytes(rng, &byte, 1))
+                return false;
+        } while(byte >= limit);
+
+        *result = byte % n;
+    }
+    else
+    {
+        const uint32_t limit = UINT32_MAX - (UINT32_MAX % n);
+        uint32_t value;
+
+        do
+        {
+            if(!rng_bytes(rng, (unsigned char *)&value, sizeof(value)))
+                return false;
+        } while(value >= limit);
+
+        *result = value % n;
+    }
+
+    return true;
+}
+
+void rng_wipe(Rng_t *rng)
+{
+    memset(rng->buffer, 0, RNG_BUFFER_SIZE);
+    rng->pos = RNG_BUFFER_SIZE;
+}
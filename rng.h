@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __RNG_H
+#define __RNG_H
+
+#define RNG_BUFFER_SIZE (4096)
+
+/* Buffered cryptographically secure random numbers. Random bytes
+ * are drawn from OpenSSL in batches instead of one call per number.
+ */
+typedef struct _rng
+{
+    unsigned char buffer[RNG_BUFFER_SIZE];
+    size_t pos;
+
+} Rng_t;
+
+void rng_init(Rng_t *rng);
+bool rng_uniform(Rng_t *rng, unsigned int n, unsigned int *result);
+void rng_wipe(Rng_t *rng);
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "entry.h"
+#include "format.h"
+#include "state.h"
+#include "db.h"
+#include "search.h"
+#include "crypto.h"
+#include "lock.h"
+#include "pool.h"
+#include "utils.h"
+#include "journal.h"
+
+/* Copies a found row into the results of the job */
+static void collect_row(void *data, const char **values)
+{
+    Search_job_t *job = data;
+
+    if(job->row_count == job->row_alloc)
+    {
+        job->row_alloc = job->row_alloc ? job->row_alloc * 2 : 16;
+        job->values = trealloc(job->values, job->row_alloc *
+                               ENTRY_FIELD_COUNT * sizeof(char *));
+    }
+
+    char **row = job->values + job->row_count * ENTRY_FIELD_COUNT;
+
+    for(int i = 0; i < ENTRY_FIELD_COUNT; i++)
+        row[i] = values[i] ? strdup(values[i]) : NULL;
+
+    job->row_count++;
+}
+
+/* Runs in a worker thread. Encrypted vaults are decrypted into
+ * memory only, so the key derivation of each vault runs in parallel
+ * and nothing is written to disk.
+ */
+static void run_search(void *data)
+{
+    Search_job_t *job = data;
+    char *image = NULL;
+    size_t image_len = 0;
+    int lock;
+
+    //Vault was not found
+    if(!job->path)
+        return;
+
+    lock = lock_database(job->path, TITAN_LOCK_SHARED, job->lock_timeout);
+
+    if(lock == -1)
+        return;
+
+    if(job->passphrase)
+    {
+        if(!decrypt_to_memory(job->passphrase, job->path, &image, &image_len) ||
+           !journal_replay_image(job->passphrase, job->path, &image, &image_len))
+        {
+            fprintf(stderr, "Failed to decrypt %s.\n", job->path);
+            unlock_database(lock);
+            free(image);
+            return;
+        }
+
+        //Decrypted copy is enough, release the file early
+        unlock_database(lock);
+        lock = -1;
+    }
+
+    job->ok = db_search(job->path, image, image_len, job->search,
+                        job->options, collect_row, job);
+
+    unlock_database(lock);
+
+    if(image)
+    {
+        memset(image, 0, image_len);
+        free(image);
+    }
+}
+
+/* Searches all vaults concurrently, at most one thread per
+ * processor. Returns when every search has finished, results
+ * are stored into the jobs. Each vault is searched for the rows
+ * up to the end of the page of options, search_merge pages the
+ * merged rows.
+ */
+void search_vaults(Search_job_t *jobs, int count, List_options_t *options)
+{
+    int threads = pool_default_size();
+    List_options_t vault_options = *options;
+    Pool_t *pool;
+
+    vault_options.offset = 0;
+
+    if(options->limit >= 0)
+        vault_options.limit = options->offset + options->limit;
+
+    if(count < threads)
+        threads = count;
+
+    pool = pool_new(threads);
+
+    for(int i = 0; i < count; i++)
+    {
+        jobs[i].options = &vault_options;
+        pool_submit(pool, run_search, &jobs[i]);
+    }
+
+    pool_wait(pool);
+    pool_free(pool);
+}
+
+/* Compares like the nocase collation of sqlite, NULL first */
+static int compare_nocase(const char *a, const char *b)
+{
+    if(!a || !b)
+        return (a != NULL) - (b != NULL);
+
+    for(;; a++, b++)
+    {
+        int ca = (*a >= 'A' && *a <= 'Z') ? *a + 32 : (unsigned char)*a;
+        int cb = (*b >= 'A' && *b <= 'Z') ? *b + 32 : (unsigned char)*b;
+
+        if(ca != cb || ca == 0)
+            return ca - cb;
+    }
+}
+
+/* Compares rows in the order of the sort of options and then id, as
+ * the query of each vault orders them. Modified is compared as the
+ * local time the rows have.
+ */
+static int compare_rows(char **a, char **b, List_options_t *options)
+{
+    long long id_a = atoll(a[FIELD_ID]);
+    long long id_b = atoll(b[FIELD_ID]);
+    int result = 0;
+
+    switch(options->sort)
+    {
+    case SORT_TITLE:
+        result = compare_nocase(a[FIELD_TITLE], b[FIELD_TITLE]);
+        break;
+    case SORT_URL:
+        result = compare_nocase(a[FIELD_URL], b[FIELD_URL]);
+        break;
+    case SORT_MODIFIED:
+        if(!a[FIELD_MODIFIED] || !b[FIELD_MODIFIED])
+            result = (a[FIELD_MODIFIED] != NULL) - (b[FIELD_MODIFIED] != NULL);
+        else
+            result = strcmp(a[FIELD_MODIFIED], b[FIELD_MODIFIED]);
+        break;
+    }
+
+    if(result == 0)
+        result = (id_a > id_b) - (id_a < id_b);
+
+    return options->reverse ? -result : result;
+}
+
+/* Merges the sorted results of the jobs into one listing, ordered
+ * and paged as specified by options, and passes each row to fn.
+ * Equal rows are taken in the order of the jobs.
+ */
+void search_merge(Search_job_t *jobs, int count, List_options_t *options,
+                  Search_row_fn_t fn, void *data)
+{
+    int *next = tmalloc(count * sizeof(int));
+    int skip = options->offset;
+    int left = options->limit;
+
+    memset(next, 0, count * sizeof(int));
+
+    while(left != 0)
+    {
+        Search_job_t *first = NULL;
+        char **row = NULL;
+
+        for(int i = 0; i < count; i++)
+        {
+            char **candidate;
+
+            if(next[i] == jobs[i].row_count)
+                continue;
+
+            candidate = jobs[i].values + next[i] * ENTRY_FIELD_COUNT;
+
+            if(!first || compare_rows(candidate, row, options) < 0)
+            {
+                first = &jobs[i];
+                row = candidate;
+            }
+        }
+
+        if(!first)
+            break;
+
+        next[first - jobs]++;
+
+        if(skip > 0)
+        {
+            skip--;
+            continue;
+        }
+
+        fn(data, first, (const char **)row);
+
+        if(left > 0)
+            left--;
+    }
+
+    free(next);
+}
+
+void search_job_free(Search_job_t *job)
+{
+    for(int i = 0; i < job->row_count * ENTRY_FIELD_COUNT; i++)
+    {
+        if(job->values[i])
+        {
+            memset(job->values[i], 0, strlen(job->values[i]));
+            free(job->values[i]);
+        }
+    }
+
+    free(job->values);
+
+    if(job->passphrase)
+    {
+        memset(job->passphrase, 0, strlen(job->passphrase));
+        free(job->passphrase);
+    }
+
+    job->values = NULL;
+    job->passphrase = NULL;
+    job->row_count = 0;
+    job->row_alloc = 0;
+}
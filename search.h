@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __SEARCH_H
+#define __SEARCH_H
+
+/* Search of a single vault run by search_vaults */
+typedef struct _search_job
+{
+    /* Vault name or path as given by the user */
+    const char *label;
+    const char *path;
+    /* Passphrase if the vault is encrypted, NULL otherwise */
+    char *passphrase;
+    const char *search;
+    List_options_t *options;
+    int lock_timeout;
+
+    /* Results, ENTRY_FIELD_COUNT strings per row */
+    char **values;
+    int row_count;
+    int row_alloc;
+    bool ok;
+
+} Search_job_t;
+
+/* Called for each merged row with the job it was found by */
+typedef void (*Search_row_fn_t)(void *data, Search_job_t *job,
+                                const char **values);
+
+void search_vaults(Search_job_t *jobs, int count, List_options_t *options);
+void search_merge(Search_job_t *jobs, int count, List_options_t *options,
+                  Search_row_fn_t fn, void *data);
+void search_job_free(Search_job_t *job);
+
+#endif
@@ -0,0 +1,636 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sqlite3.h>
+#include "entry.h"
+#include "format.h"
+#include "state.h"
+#include "db.h"
+#include "crypto.h"
+#include "lock.h"
+#include "pool.h"
+#include "utils.h"
+#include "server.h"
+
+/* Query server of titan --serve. Clients connect to a Unix socket
+ * and send one request per line:
+ *
+ *   get <id>
+ *   find <search>
+ *   list
+ *
+ * Each request is answered with the matching entries as JSON lines,
+ * followed by {"status":"ok","count":N} or
+ * {"status":"error","message":"..."}. The database is held in
+ * memory as an image shared by read only connections of the workers,
+ * so a request costs a query instead of opening and checking the
+ * database. No file is kept open between requests. The image is
+ * loaded again when the file has changed and dropped when the vault
+ * has been encrypted, requests are then refused.
+ *
+ * A worker serves one client until it disconnects. Clients beyond
+ * the number of workers are answered with an error and closed
+ * instead of waiting for a worker without notice.
+ */
+
+#define REQUEST_GET  (0)
+#define REQUEST_FIND (1)
+#define REQUEST_LIST (2)
+
+/* Serialized database shared by the connections made from it */
+typedef struct _image
+{
+    unsigned char *data;
+    sqlite3_int64 size;
+    int refs;
+
+} Image_t;
+
+typedef struct _connection
+{
+    sqlite3 *db;
+    /* Image db was made from, NULL if not made yet */
+    Image_t *image;
+
+} Connection_t;
+
+typedef struct _server
+{
+    State_t *state;
+    Fields_t fields;
+    bool mask_password;
+    pthread_mutex_t mutex;
+    /* Signaled when a connection is released */
+    pthread_cond_t released;
+    /* Current image, NULL if the vault is encrypted */
+    Image_t *image;
+    /* Database file and its write-ahead log when image was loaded */
+    struct stat db_stat;
+    struct stat wal_stat;
+    /* Idle connections */
+    Connection_t *connections;
+    int idle;
+    /* Sockets of connected clients, shut down when stopping */
+    int *clients;
+    int client_count;
+    int client_alloc;
+    /* Number of workers, each serving one client */
+    int max_clients;
+
+} Server_t;
+
+typedef struct _client
+{
+    Server_t *server;
+    int fd;
+
+} Client_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal)
+{
+    (void)signal;
+    stopping = 1;
+}
+
+/* Drops a reference to image. Called with the mutex held. */
+static void release_image(Image_t *image)
+{
+    if(image && --image->refs == 0)
+    {
+        sqlite3_free(image->data);
+        free(image);
+    }
+}
+
+/* Reads the database at path into a new image */
+static Image_t *load_image(const char *path, int lock_timeout)
+{
+    sqlite3 *db = db_open_readonly(path, lock_timeout);
+    Image_t *image;
+
+    if(!db)
+        return NULL;
+
+    image = tmalloc(sizeof(Image_t));
+    image->refs = 1;
+    image->data = sqlite3_serialize(db, "main", &image->size, 0);
+    db_close(db);
+
+    if(!image->data || image->size < 100)
+    {
+        fprintf(stderr, "Failed to read %s into memory.\n", path);
+        sqlite3_free(image->data);
+        free(image);
+
+        return NULL;
+    }
+
+    /* The file uses a write-ahead log, which an image in memory
+     * cannot have. Mark it as a rollback journal database.
+     */
+    image->data[18] = 1;
+    image->data[19] = 1;
+
+    return image;
+}
+
+/* Stats path, zeroing st if it does not exist */
+static void stat_file(const char *path, struct stat *st)
+{
+    if(stat(path, st) != 0)
+        memset(st, 0, sizeof(struct stat));
+}
+
+static bool same_file(struct stat *a, struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Closes connection if it was made from an image other than the
+ * current one. Called with the mutex held.
+ */
+static void close_stale(Server_t *server, Connection_t *connection)
+{
+    if(connection->image == server->image)
+        return;
+
+    db_close(connection->db);
+    release_image(connection->image);
+    connection->db = NULL;
+    connection->image = NULL;
+}
+
+/* Loads the image again if the database has changed since it was
+ * loaded. Called with the mutex and a shared lock on the database
+ * held. Returns false if there is no image to serve.
+ */
+static bool refresh_image(Server_t *server)
+{
+    State_t *state = server->state;
+    char wal_path[strlen(state->db_path) + 5];
+    struct stat db_stat;
+    struct stat wal_stat;
+
+    sprintf(wal_path, "%s-wal", state->db_path);
+    stat_file(state->db_path, &db_stat);
+    stat_file(wal_path, &wal_stat);
+
+    if(server->image && same_file(&db_stat, &server->db_stat) &&
+       same_file(&wal_stat, &server->wal_stat))
+        return true;
+
+    release_image(server->image);
+    server->image = NULL;
+    server->db_stat = db_stat;
+    server->wal_stat = wal_stat;
+
+    if(db_stat.st_ino != 0 && !is_file_encrypted(state->db_path))
+        server->image = load_image(state->db_path, state->lock_timeout);
+
+    //Old images are freed as soon as no connection uses them
+    for(int i = 0; i < server->idle; i++)
+        close_stale(server, &server->connections[i]);
+
+    return server->image != NULL;
+}
+
+/* Returns an idle connection made from the current image, or one
+ * with a NULL db if it could not be made.
+ */
+static Connection_t acquire_connection(Server_t *server)
+{
+    Connection_t connection;
+
+    while(server->idle == 0)
+        pthread_cond_wait(&server->released, &server->mutex);
+
+    connection = server->connections[--server->idle];
+
+    if(connection.db && connection.image == server->image)
+        return connection;
+
+    close_stale(server, &connection);
+
+    if(sqlite3_open(":memory:", &connection.db) != SQLITE_OK ||
+       sqlite3_deserialize(connection.db, "main", server->image->data,
+                           server->image->size, server->image->size,
+                           SQLITE_DESERIALIZE_READONLY) != SQLITE_OK)
+    {
+        fprintf(stderr, "Failed to open image: %s\n",
+                sqlite3_errmsg(connection.db));
+        db_close(connection.db);
+        connection.db = NULL;
+
+        return connection;
+    }
+
+    connection.image = server->image;
+    connection.image->refs++;
+
+    return connection;
+}
+
+static void release_connection(Server_t *server, Connection_t connection)
+{
+    pthread_mutex_lock(&server->mutex);
+    close_stale(server, &connection);
+    server->connections[server->idle++] = connection;
+    pthread_cond_signal(&server->released);
+    pthread_mutex_unlock(&server->mutex);
+}
+
+/* Returns false if every worker is already serving a client */
+static bool add_client(Server_t *server, int fd)
+{
+    pthread_mutex_lock(&server->mutex);
+
+    if(server->client_count >= server->max_clients)
+    {
+        pthread_mutex_unlock(&server->mutex);
+        return false;
+    }
+
+    if(server->client_count == server->client_alloc)
+    {
+        server->client_alloc = server->client_alloc ? server->client_alloc * 2 : 16;
+        server->clients = trealloc(server->clients,
+                                   server->client_alloc * sizeof(int));
+    }
+
+    server->clients[server->client_count++] = fd;
+    pthread_mutex_unlock(&server->mutex);
+
+    return true;
+}
+
+static void remove_client(Server_t *server, int fd)
+{
+    pthread_mutex_lock(&server->mutex);
+
+    for(int i = 0; i < server->client_count; i++)
+    {
+        if(server->clients[i] == fd)
+        {
+            server->clients[i] = server->clients[--server->client_count];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static void reply_error(FILE *out, const char *message)
+{
+    fprintf(out, "{\"status\":\"error\",\"message\":\"%s\"}\n", message);
+}
+
+/* Returns REQUEST_* or -1 if request is not known. Get and find
+ * take an argument, list does not.
+ */
+static int request_kind(const char *request, const char *arg)
+{
+    if(strcmp(request, "get") == 0 && arg)
+        return REQUEST_GET;
+
+    if(strcmp(request, "find") == 0 && arg)
+        return REQUEST_FIND;
+
+    if(strcmp(request, "list") == 0 && !arg)
+        return REQUEST_LIST;
+
+    return -1;
+}
+
+static void handle_request(Server_t *server, char *request, FILE *out)
+{
+    State_t *state = server->state;
+    Formatter_t formatter;
+    char *arg = strchr(request, ' ');
+    Connection_t connection;
+    sqlite3 *db;
+    int kind;
+    int lock;
+    bool ok = false;
+
+    if(arg)
+        *arg++ = '\0';
+
+    kind = request_kind(request, arg);
+
+    if(kind == -1)
+    {
+        reply_error(out, "Unknown request");
+        return;
+    }
+
+    lock = lock_database(state->db_path, TITAN_LOCK_SHARED, state->lock_timeout);
+
+    if(lock == -1)
+    {
+        reply_error(out, "Database is locked");
+        return;
+    }
+
+    pthread_mutex_lock(&server->mutex);
+
+    if(!refresh_image(server))
+    {
+        pthread_mutex_unlock(&server->mutex);
+        unlock_database(lock);
+        reply_error(out, "Database is not decrypted");
+
+        return;
+    }
+
+    connection = acquire_connection(server);
+    pthread_mutex_unlock(&server->mutex);
+    unlock_database(lock);
+
+    db = connection.db;
+
+    if(!db)
+    {
+        release_connection(server, connection);
+        reply_error(out, "Query failed");
+
+        return;
+    }
+
+    formatter_init(&formatter, out, TITAN_FORMAT_JSONL, &server->fields,
+                   server->mask_password);
+
+    switch(kind)
+    {
+    case REQUEST_GET:
+        ok = db_write_by_id(db, atoi(arg), &formatter);
+        break;
+    case REQUEST_FIND:
+        ok = db_write_found(db, arg, &formatter, &state->list_options);
+        break;
+    case REQUEST_LIST:
+        ok = db_write_all(db, &formatter, &state->list_options);
+        break;
+    }
+
+    release_connection(server, connection);
+
+    if(ok)
+        fprintf(out, "{\"status\":\"ok\",\"count\":%ld}\n", formatter.rows);
+    else
+        reply_error(out, "Query failed");
+}
+
+/* Answers requests of one client until it disconnects */
+static void serve_client(void *arg)
+{
+    Client_t *client = arg;
+    int out_fd = dup(client->fd);
+    FILE *in = fdopen(client->fd, "r");
+    FILE *out = out_fd != -1 ? fdopen(out_fd, "w") : NULL;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while(in && out && (len = getline(&line, &size, in)) != -1)
+    {
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+
+        handle_request(client->server, line, out);
+
+        if(fflush(out) != 0)
+            break;
+    }
+
+    remove_client(client->server, client->fd);
+    free(line);
+
+    if(out)
+        fclose(out);
+    else if(out_fd != -1)
+        close(out_fd);
+
+    if(in)
+        fclose(in);
+    else
+        close(client->fd);
+
+    free(client);
+}
+
+/* Tells a client over the limit why it is not served */
+static void refuse_client(int fd)
+{
+    static const char *reply =
+        "{\"status\":\"error\",\"message\":\"Too many clients\"}\n";
+
+    if(write(fd, reply, strlen(reply)) == -1)
+        fprintf(stderr, "Unable to refuse client: %s\n", strerror(errno));
+
+    close(fd);
+}
+
+static int listen_socket(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int fd;
+
+    if(strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long.\n", socket_path);
+        return -1;
+    }
+
+    //Left behind by a server which did not exit cleanly
+    if(stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd == -1)
+    {
+        fprintf(stderr, "Unable to create socket.\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    //Only the owner of the vault may connect
+    mask = umask(0077);
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+       listen(fd, SERVER_BACKLOG) == -1)
+    {
+        fprintf(stderr, "Unable to listen on %s: %s\n", socket_path,
+                strerror(errno));
+        umask(mask);
+        close(fd);
+
+        return -1;
+    }
+
+    umask(mask);
+
+    return fd;
+}
+
+static void close_connections(Server_t *server)
+{
+    for(int i = 0; i < server->idle; i++)
+    {
+        db_close(server->connections[i].db);
+        release_image(server->connections[i].image);
+    }
+
+    release_image(server->image);
+    free(server->connections);
+}
+
+/* Serves the active database of state on socket_path until
+ * interrupted. Entries are written with the given fields.
+ */
+bool server_run(State_t *state, const char *socket_path, Fields_t *fields,
+                bool mask_password)
+{
+    Server_t server;
+    struct sigaction action;
+    sigset_t signals;
+    Pool_t *pool;
+    sqlite3 *db;
+    bool ok;
+    int threads = pool_default_size() * SERVER_THREADS_PER_CPU;
+    int lock;
+    int fd;
+
+    memset(&server, 0, sizeof(server));
+    server.state = state;
+    server.fields = *fields;
+    server.mask_password = mask_password;
+    server.max_clients = threads;
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.released, NULL);
+
+    //Check and migrate the database once before serving it
+    lock = lock_database(state->db_path, TITAN_LOCK_SHARED, state->lock_timeout);
+
+    if(lock == -1)
+        return false;
+
+    db = db_open(state->db_path, state->lock_timeout);
+
+    if(db)
+        db_close(db);
+
+    //Connections are made from the image when first needed
+    server.connections = tmalloc(threads * sizeof(Connection_t));
+    memset(server.connections, 0, threads * sizeof(Connection_t));
+    server.idle = threads;
+
+    ok = db && refresh_image(&server);
+    unlock_database(lock);
+
+    if(!ok)
+    {
+        close_connections(&server);
+        return false;
+    }
+
+    fd = listen_socket(socket_path);
+
+    if(fd == -1)
+    {
+        close_connections(&server);
+        return false;
+    }
+
+    //Only the accepting thread handles signals
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pool = pool_new(threads);
+
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    //Accept is interrupted instead of restarted
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Serving %s on %s\n", state->db_path, socket_path);
+
+    while(!stopping)
+    {
+        int client_fd = accept(fd, NULL, NULL);
+
+        if(client_fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if(!add_client(&server, client_fd))
+        {
+            refuse_client(client_fd);
+            continue;
+        }
+
+        Client_t *client = tmalloc(sizeof(Client_t));
+
+        client->server = &server;
+        client->fd = client_fd;
+
+        pool_submit(pool, serve_client, client);
+    }
+
+    close(fd);
+    unlink(socket_path);
+
+    //Wake up workers waiting for requests of idle clients
+    pthread_mutex_lock(&server.mutex);
+
+    for(int i = 0; i < server.client_count; i++)
+        shutdown(server.clients[i], SHUT_RDWR);
+
+    pthread_mutex_unlock(&server.mutex);
+
+    pool_wait(pool);
+    pool_free(pool);
+
+    close_connections(&server);
+    free(server.clients);
+    pthread_cond_destroy(&server.released);
+    pthread_mutex_destroy(&server.mutex);
+
+    return true;
+}
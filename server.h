@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __SERVER_H
+#define __SERVER_H
+
+/* Worker threads per processor. Each connected client keeps a
+ * worker busy, so there are more workers than processors.
+ */
+#define SERVER_THREADS_PER_CPU (4)
+#define SERVER_BACKLOG (64)
+
+bool server_run(State_t *state, const char *socket_path, Fields_t *fields,
+                bool mask_password);
+
+#endif
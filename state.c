@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "format.h"
+#include "state.h"
+#include "utils.h"
+#include "crypto.h"
+#include "lock.h"
+
+/* Returns the path of ~/.titan.lock file or NULL if
+ * HOME is not set. Caller must free the return value.
+ */
+static char *get_lockfile_path()
+{
+    char *home = NULL;
+    char *path = NULL;
+
+    home = getenv("HOME");
+
+    if(!home)
+        return NULL;
+
+    /* /home/user/.titan.lock */
+    path = tmalloc(sizeof(char) * (strlen(home) + 13));
+
+    strcpy(path, home);
+    strcat(path, "/.titan.lock");
+
+    return path;
+}
+
+static void free_vaults(State_t *state)
+{
+    for(int i = 0; i < state->vault_count; i++)
+    {
+        free(state->vaults[i].name);
+        free(state->vaults[i].path);
+    }
+
+    free(state->vaults);
+    state->vaults = NULL;
+    state->vault_count = 0;
+}
+
+static void add_vault(State_t *state, const char *name, const char *path)
+{
+    Vault_t *vaults = trealloc(state->vaults,
+                               (state->vault_count + 1) * sizeof(Vault_t));
+
+    vaults[state->vault_count].name = strdup(name);
+    vaults[state->vault_count].path = strdup(path);
+
+    state->vaults = vaults;
+    state->vault_count++;
+}
+
+static Vault_t *find_vault(State_t *state, const char *name)
+{
+    for(int i = 0; i < state->vault_count; i++)
+    {
+        if(strcmp(state->vaults[i].name, name) == 0)
+            return &state->vaults[i];
+    }
+
+    return NULL;
+}
+
+/* Reads the registry of unlocked vaults from the lock file. Each
+ * line is "name<TAB>path". A line without a name is the default
+ * vault, which is how older versions of Titan wrote the file.
+ */
+static void read_vaults(State_t *state)
+{
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t nread;
+
+    free_vaults(state);
+
+    fp = fopen(state->lockfile_path, "r");
+
+    if(!fp)
+        return;
+
+    while((nread = getline(&line, &len, fp)) > 0)
+    {
+        char *tab;
+
+        if(line[nread - 1] == '\n')
+            line[--nread] = '\0';
+
+        if(nread == 0)
+            continue;
+
+        tab = strchr(line, '\t');
+
+        if(tab)
+        {
+            *tab = '\0';
+            add_vault(state, line, tab + 1);
+        }
+        else
+            add_vault(state, TITAN_DEFAULT_VAULT, line);
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+/* Writes the registry to a temporary file and renames it over
+ * the lock file so readers never see a partially written file.
+ */
+static bool write_vaults(State_t *state)
+{
+    FILE *fp = NULL;
+    char *tmp_path = NULL;
+
+    if(state->vault_count == 0)
+    {
+        unlink(state->lockfile_path);
+        return true;
+    }
+
+    tmp_path = tmalloc(strlen(state->lockfile_path) + 5);
+    strcpy(tmp_path, state->lockfile_path);
+    strcat(tmp_path, ".tmp");
+
+    fp = fopen(tmp_path, "w");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Error creating lock file\n");
+        free(tmp_path);
+        return false;
+    }
+
+    for(int i = 0; i < state->vault_count; i++)
+        fprintf(fp, "%s\t%s\n", state->vaults[i].name, state->vaults[i].path);
+
+    if(fclose(fp) != 0 || rename(tmp_path, state->lockfile_path) != 0)
+    {
+        fprintf(stderr, "Error writing lock file\n");
+        unlink(tmp_path);
+        free(tmp_path);
+        return false;
+    }
+
+    free(tmp_path);
+
+    return true;
+}
+
+/* Database is active if it exists and is not encrypted */
+static bool is_active_database(const char *db_path)
+{
+    if(!db_path || !file_exists(db_path))
+        return false;
+
+    return !is_file_encrypted(db_path);
+}
+
+/* Points db_path to the selected vault */
+static void select_vault(State_t *state)
+{
+    Vault_t *vault = find_vault(state, state->vault_name);
+
+    free(state->db_path);
+    state->db_path = vault ? strdup(vault->path) : NULL;
+    state->db_active = is_active_database(state->db_path);
+    state->db_checked = false;
+}
+
+void state_init(State_t *state)
+{
+    memset(state, 0, sizeof(State_t));
+
+    state->vault_name = TITAN_DEFAULT_VAULT;
+    state->list_options.limit = -1;
+    state->list_options.offset = 0;
+    state->list_options.sort = SORT_ID;
+    state->list_options.reverse = false;
+    state->list_options.with_tags = NULL;
+    state->count = 1;
+    state->separator = " ";
+}
+
+/* Resolves the lock file and the active database of the selected
+ * vault. Settings set before calling this are left untouched.
+ */
+void state_load(State_t *state)
+{
+    char *timeout = getenv("TITAN_LOCK_TIMEOUT");
+
+    state->lock_timeout = timeout ? atoi(timeout) : TITAN_LOCK_TIMEOUT;
+    state->lockfile_path = get_lockfile_path();
+
+    if(state->lockfile_path)
+        read_vaults(state);
+
+    select_vault(state);
+}
+
+void state_free(State_t *state)
+{
+    free_vaults(state);
+    free(state->lockfile_path);
+    free(state->db_path);
+    free(state->profile);
+
+    state->lockfile_path = NULL;
+    state->db_path = NULL;
+    state->profile = NULL;
+}
+
+/* Updates the registry under a lock. Registry is read again so
+ * changes other processes made since startup are not lost. If
+ * db_path is NULL the selected vault is removed from the registry.
+ */
+static bool update_vaults(State_t *state, const char *db_path)
+{
+    Vault_t *vault;
+    bool ok;
+    int lock;
+
+    if(!state->lockfile_path)
+    {
+        fprintf(stderr, "Unable to retrieve the lock file path.\n");
+        return false;
+    }
+
+    lock = lock_database(state->lockfile_path, TITAN_LOCK_EXCLUSIVE,
+                         state->lock_timeout);
+
+    if(lock == -1)
+        return false;
+
+    read_vaults(state);
+    vault = find_vault(state, state->vault_name);
+
+    if(db_path && vault)
+    {
+        free(vault->path);
+        vault->path = strdup(db_path);
+    }
+    else if(db_path)
+    {
+        add_vault(state, state->vault_name, db_path);
+    }
+    else if(vault)
+    {
+        free(vault->name);
+        free(vault->path);
+
+        int index = vault - state->vaults;
+
+        memmove(vault, vault + 1,
+                (state->vault_count - index - 1) * sizeof(Vault_t));
+        state->vault_count--;
+    }
+
+    ok = write_vaults(state);
+    unlock_database(lock);
+
+    select_vault(state);
+
+    return ok;
+}
+
+/* Stores db_path into the lock file as the path of the selected
+ * vault and makes it the active database. Returns false on failure.
+ */
+bool state_set_active_database(State_t *state, const char *db_path)
+{
+    return update_vaults(state, db_path);
+}
+
+/* Removes the selected vault from the lock file. This way we allow
+ * Titan to create a new database or open another one in its place.
+ */
+void state_clear_active_database(State_t *state)
+{
+    update_vaults(state, NULL);
+}
+
+/* Returns true if name can be used as a vault name */
+bool state_valid_vault_name(const char *name)
+{
+    if(name[0] == '\0')
+        return false;
+
+    return strpbrk(name, "\t\n") == NULL;
+}
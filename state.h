@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __STATE_H
+#define __STATE_H
+
+#define TITAN_DEFAULT_VAULT "default"
+
+/* Unlocked vault registered in the lock file */
+typedef struct _vault
+{
+    char *name;
+    char *path;
+
+} Vault_t;
+
+/* Everything a command needs to know about the environment.
+ * Loaded once at startup and passed to the commands so the lock
+ * file and the database are only looked at once per run.
+ */
+typedef struct _state
+{
+    /* ~/.titan.lock, NULL if HOME is not set */
+    char *lockfile_path;
+    /* Unlocked vaults registered in the lock file */
+    Vault_t *vaults;
+    int vault_count;
+    /* Vault selected with --vault */
+    const char *vault_name;
+    /* Database path of the selected vault, NULL if none */
+    char *db_path;
+    /* True if db_path points to an existing decrypted database */
+    bool db_active;
+    /* True once integrity of db_path has been checked */
+    bool db_checked;
+    /* Milliseconds to wait for database locks */
+    int lock_timeout;
+
+    /* Settings from the command line */
+    int show_password;
+    int auto_encrypt;
+    int force;
+    const char *format;
+    const char *fields;
+    /* Tags of added or edited entry */
+    const char *tags;
+    List_options_t list_options;
+    /* Number of passwords or passphrases to generate */
+    int count;
+    /* Separator between passphrase words */
+    const char *separator;
+    /* Report statements and query plans on stderr */
+    int profile_sql;
+    int explain;
+    /* Statements being reported by --profile-sql, see db.c */
+    struct _profile *profile;
+
+} State_t;
+
+void state_init(State_t *state);
+void state_load(State_t *state);
+void state_free(State_t *state);
+bool state_set_active_database(State_t *state, const char *db_path);
+void state_clear_active_database(State_t *state);
+bool state_valid_vault_name(const char *name);
+
+#endif
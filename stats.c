@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+/* Process wide statistics of the titan program, enabled with
+ * --stats or TITAN_STATS. Not part of libtitan, see nostats.c.
+ * Phases are timed with the monotonic clock. When statistics are
+ * off every call returns right away, so the instrumented code
+ * does not slow down.
+ */
+
+static const char *phase_names[STATS_PHASES] =
+{
+    "kdf", "cipher", "file_io", "lock_wait", "db_open",
+    "integrity_check", "query"
+};
+
+static const char *counter_names[STATS_COUNTERS] =
+{
+    "bytes_read", "bytes_written", "sqlite_pages_read",
+    "allocations", "allocated_bytes"
+};
+
+static int stats_mode = STATS_OFF;
+static double started;
+static double phase_ms[STATS_PHASES];
+static unsigned long phase_calls[STATS_PHASES];
+static unsigned long long counters[STATS_COUNTERS];
+/* Searches and audits update statistics from worker threads */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Mode is text, json or 1 which means text. Returns false
+ * if mode is not known.
+ */
+bool stats_enable(const char *mode)
+{
+    if(mode == NULL || strcmp(mode, "text") == 0 || strcmp(mode, "1") == 0)
+        stats_mode = STATS_TEXT;
+    else if(strcmp(mode, "json") == 0)
+        stats_mode = STATS_JSON;
+    else if(strcmp(mode, "0") == 0)
+        stats_mode = STATS_OFF;
+    else
+    {
+        fprintf(stderr, "Unknown statistics mode %s.\n", mode);
+        return false;
+    }
+
+    started = now_ms();
+
+    return true;
+}
+
+bool stats_enabled()
+{
+    return stats_mode != STATS_OFF;
+}
+
+/* Returns start time of a phase to pass to stats_stop */
+double stats_start()
+{
+    return stats_mode != STATS_OFF ? now_ms() : 0;
+}
+
+void stats_stop(int phase, double start)
+{
+    double elapsed;
+
+    if(stats_mode == STATS_OFF)
+        return;
+
+    elapsed = now_ms() - start;
+
+    pthread_mutex_lock(&stats_mutex);
+    phase_ms[phase] += elapsed;
+    phase_calls[phase]++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_add(int counter, unsigned long long value)
+{
+    if(stats_mode == STATS_OFF)
+        return;
+
+    pthread_mutex_lock(&stats_mutex);
+    counters[counter] += value;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/* fread counting the bytes and time as file I/O */
+size_t stats_fread(void *ptr, size_t size, size_t nmemb, FILE *fp)
+{
+    double start = stats_start();
+    size_t count = fread(ptr, size, nmemb, fp);
+
+    stats_stop(STATS_FILE_IO, start);
+    stats_add(STATS_BYTES_READ, (unsigned long long)count * size);
+
+    return count;
+}
+
+/* fwrite counting the bytes and time as file I/O */
+size_t stats_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *fp)
+{
+    double start = stats_start();
+    size_t count = fwrite(ptr, size, nmemb, fp);
+
+    stats_stop(STATS_FILE_IO, start);
+    stats_add(STATS_BYTES_WRITTEN, (unsigned long long)count * size);
+
+    return count;
+}
+
+/* Prints the summary to stderr if statistics are enabled */
+void stats_print()
+{
+    struct rusage usage;
+    long peak_rss = 0;
+    double total;
+
+    if(stats_mode == STATS_OFF)
+        return;
+
+    total = now_ms() - started;
+
+    //Kilobytes on Linux
+    if(getrusage(RUSAGE_SELF, &usage) == 0)
+        peak_rss = usage.ru_maxrss;
+
+    if(stats_mode == STATS_JSON)
+    {
+        fprintf(stderr, "{\"total_ms\":%.3f,\"phases\":{", total);
+
+        for(int i = 0; i < STATS_PHASES; i++)
+            fprintf(stderr, "%s\"%s\":{\"ms\":%.3f,\"calls\":%lu}", i > 0 ? "," : "",
+                    phase_names[i], phase_ms[i], phase_calls[i]);
+
+        fprintf(stderr, "},\"counters\":{");
+
+        for(int i = 0; i < STATS_COUNTERS; i++)
+            fprintf(stderr, "%s\"%s\":%llu", i > 0 ? "," : "", counter_names[i],
+                    counters[i]);
+
+        fprintf(stderr, "},\"peak_rss_kb\":%ld}\n", peak_rss);
+
+        return;
+    }
+
+    fprintf(stderr, "%-20s %12.3f ms\n", "total", total);
+
+    for(int i = 0; i < STATS_PHASES; i++)
+    {
+        if(phase_calls[i] > 0)
+            fprintf(stderr, "%-20s %12.3f ms %8lu calls\n", phase_names[i],
+                    phase_ms[i], phase_calls[i]);
+    }
+
+    for(int i = 0; i < STATS_COUNTERS; i++)
+        fprintf(stderr, "%-20s %12llu\n", counter_names[i], counters[i]);
+
+    fprintf(stderr, "%-20s %12ld kB\n", "peak_rss", peak_rss);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+/* Timed phases of a command */
+#define STATS_KDF       (0)
+#define STATS_CIPHER    (1)
+#define STATS_FILE_IO   (2)
+#define STATS_LOCK_WAIT (3)
+#define STATS_DB_OPEN   (4)
+#define STATS_INTEGRITY (5)
+#define STATS_QUERY     (6)
+#define STATS_PHASES    (7)
+
+/* Counters */
+#define STATS_BYTES_READ      (0)
+#define STATS_BYTES_WRITTEN   (1)
+#define STATS_PAGES_READ      (2)
+#define STATS_ALLOCATIONS     (3)
+#define STATS_ALLOCATED_BYTES (4)
+#define STATS_COUNTERS        (5)
+
+#define STATS_OFF  (0)
+#define STATS_TEXT (1)
+#define STATS_JSON (2)
+
+bool stats_enable(const char *mode);
+bool stats_enabled();
+double stats_start();
+void stats_stop(int phase, double start);
+void stats_add(int counter, unsigned long long value);
+size_t stats_fread(void *ptr, size_t size, size_t nmemb, FILE *fp);
+size_t stats_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *fp);
+void stats_print();
+
+#endif
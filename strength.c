@@ -0,0 +1,693 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include "utils.h"
+#include "wordlist.h"
+#include "strength.h"
+
+/* Password strength is estimated the same way as zxcvbn does it.
+ * Password is split into known patterns (dictionary words, sequences,
+ * repeats, keyboard walks and years) and characters that match no
+ * pattern. Each pattern has an estimated number of guesses and the
+ * split needing the fewest guesses in total is the estimate.
+ */
+
+/* Most used passwords, most common first. Rank in this list is
+ * the number of guesses needed to find the password.
+ */
+static const char *common_passwords[] =
+{
+    "123456", "password", "123456789", "12345678", "12345", "qwerty",
+    "1234567", "111111", "1234567890", "123123", "abc123", "1234",
+    "password1", "iloveyou", "1q2w3e4r", "000000", "qwerty123",
+    "zaq12wsx", "dragon", "sunshine", "princess", "letmein", "654321",
+    "monkey", "1qaz2wsx", "123321", "qwertyuiop", "superman",
+    "asdfghjkl", "trustno1", "welcome", "football", "baseball",
+    "shadow", "master", "michael", "jordan", "hello", "charlie",
+    "login", "admin", "starwars", "whatever", "freedom", "ninja",
+    "mustang", "access", "flower", "hunter", "batman", "secret",
+    "computer", "internet", "cookie", "summer", "winter", "love",
+    "lovely", "pokemon", "soccer", "hockey", "ranger", "thomas",
+    "daniel", "andrew", "joshua", "jessica", "ashley", "amanda",
+    "harley", "buster", "tigger", "pepper", "ginger", "maggie",
+    "samsung", "google", "matrix", "orange", "purple", "banana",
+    "chocolate", "cheese", "hello123", "welcome1", "admin123", "root",
+    "toor", "test", "guest", "changeme", "default", "letmein1",
+    "passpass", "qazwsx", "killer", "zxcvbnm", "asdfgh", "987654321",
+    "121212", "666666", "777777", "888888", "999999", "112233",
+    "123qwe", "qwe123", "1qazxsw2", "q1w2e3r4", "passport", "pass",
+    NULL
+};
+
+/* Keyboard rows, unshifted and shifted. Offsets are in half keys
+ * so that keys of adjacent rows are one unit apart horizontally.
+ */
+static const char *keyboard_rows[][2] =
+{
+    { "`1234567890-=", "~!@#$%^&*()_+" },
+    { "qwertyuiop[]\\", "QWERTYUIOP{}|" },
+    { "asdfghjkl;'", "ASDFGHJKL:\"" },
+    { "zxcvbnm,./", "ZXCVBNM<>?" }
+};
+
+static const int keyboard_offsets[] = { 0, 3, 4, 5 };
+
+#define KEYBOARD_ROWS (4)
+#define KEYBOARD_KEYS (94)
+#define KEYBOARD_DEGREE (4.6)
+
+/* Submatches must cost at least this many guesses, otherwise
+ * splitting a password into many tiny matches would look cheap.
+ */
+#define MIN_SUBMATCH_GUESSES (50)
+
+static const char *pattern_names[PATTERN_COUNT] =
+{
+    "dictionary", "sequence", "repeat", "keyboard", "year", "bruteforce"
+};
+
+static int word_compare(const char *a, uint32_t alen, const char *b,
+                        uint32_t blen)
+{
+    uint32_t len = alen < blen ? alen : blen;
+
+    for(uint32_t i = 0; i < len; i++)
+    {
+        int diff = tolower((unsigned char)a[i]) - tolower((unsigned char)b[i]);
+
+        if(diff != 0)
+            return diff;
+    }
+
+    if(alen == blen)
+        return 0;
+
+    return alen < blen ? -1 : 1;
+}
+
+static int dict_word_compare(const void *a, const void *b)
+{
+    const Dict_word_t *wa = a;
+    const Dict_word_t *wb = b;
+
+    return word_compare(wa->word, wa->length, wb->word, wb->length);
+}
+
+/* Builds a sorted dictionary from the passphrase wordlist and the
+ * most common passwords. Words found in both keep the lower rank.
+ */
+bool dictionary_open(Dictionary_t *dict)
+{
+    uint32_t common_count = 0;
+    uint32_t count = 0;
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if(!wordlist_open(&dict->list))
+        return false;
+
+    while(common_passwords[common_count] != NULL)
+        common_count++;
+
+    dict->words = tmalloc((dict->list.count + common_count) * sizeof(Dict_word_t));
+
+    for(uint32_t i = 0; i < dict->list.count; i++)
+    {
+        dict->words[count].word = dict->list.data + dict->list.words[i].offset;
+        dict->words[count].length = dict->list.words[i].length;
+        dict->words[count].rank = dict->list.count;
+        count++;
+    }
+
+    for(uint32_t i = 0; i < common_count; i++)
+    {
+        dict->words[count].word = common_passwords[i];
+        dict->words[count].length = strlen(common_passwords[i]);
+        dict->words[count].rank = i + 1;
+        count++;
+    }
+
+    qsort(dict->words, count, sizeof(Dict_word_t), dict_word_compare);
+
+    dict->count = 0;
+    dict->max_length = 0;
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        Dict_word_t *last = dict->count ? &dict->words[dict->count - 1] : NULL;
+
+        if(last && dict_word_compare(last, &dict->words[i]) == 0)
+        {
+            if(dict->words[i].rank < last->rank)
+                last->rank = dict->words[i].rank;
+
+            continue;
+        }
+
+        dict->words[dict->count++] = dict->words[i];
+
+        if(dict->words[i].length > dict->max_length)
+            dict->max_length = dict->words[i].length;
+    }
+
+    localtime_r(&now, &tm);
+    dict->year = tm.tm_year + 1900;
+
+    return true;
+}
+
+void dictionary_close(Dictionary_t *dict)
+{
+    free(dict->words);
+    dict->words = NULL;
+    dict->count = 0;
+    wordlist_close(&dict->list);
+}
+
+/* Returns rank of word or 0 if it's not in the dictionary. Prefix
+ * is set to false if no word of the dictionary starts with word, so
+ * the caller knows longer words cannot be found either.
+ */
+static uint32_t dictionary_rank(Dictionary_t *dict, const char *word,
+                                uint32_t length, bool *prefix)
+{
+    uint32_t low = 0;
+    uint32_t high = dict->count;
+    Dict_word_t *w;
+
+    //Find the first word not sorting before word
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        w = &dict->words[mid];
+
+        if(word_compare(w->word, w->length, word, length) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *prefix = false;
+
+    if(low == dict->count)
+        return 0;
+
+    w = &dict->words[low];
+
+    if(w->length < length || word_compare(w->word, length, word, length) != 0)
+        return 0;
+
+    *prefix = true;
+
+    return w->length == length ? w->rank : 0;
+}
+
+static double n_choose_k(int n, int k)
+{
+    double result = 1;
+
+    if(k > n)
+        return 0;
+
+    for(int i = 1; i <= k; i++)
+        result = result * (n - k + i) / i;
+
+    return result;
+}
+
+/* Guesses needed to find the variation of two character kinds
+ * used, like upper and lower case letters. Counts are the number
+ * of characters of each kind.
+ */
+static double variations(int a, int b)
+{
+    double result = 0;
+    int min = a < b ? a : b;
+
+    if(a == 0 || b == 0)
+        return 1;
+
+    for(int i = 1; i <= min; i++)
+        result += n_choose_k(a + b, i);
+
+    return result;
+}
+
+/* Guesses for a dictionary word of password[start..end), whose
+ * capitalization is checked from the original password.
+ */
+static double case_variations(const char *password, int start, int end)
+{
+    int upper = 0;
+    int lower = 0;
+
+    for(int i = start; i < end; i++)
+    {
+        if(isupper((unsigned char)password[i]))
+            upper++;
+        else if(islower((unsigned char)password[i]))
+            lower++;
+    }
+
+    if(upper == 0)
+        return 1;
+
+    //Capitalized or all upper case words are the first ones tried
+    if(lower == 0 || (upper == 1 && isupper((unsigned char)password[start])))
+        return 2;
+
+    return variations(upper, lower);
+}
+
+static int cardinality(char c)
+{
+    unsigned char u = (unsigned char)c;
+
+    if(isdigit(u))
+        return 10;
+    if(islower(u) || isupper(u))
+        return 26;
+    if(u < 0x80)
+        return 33;
+
+    return 100;
+}
+
+/* Returns character class used by sequences or -1 */
+static int char_class(char c)
+{
+    unsigned char u = (unsigned char)c;
+
+    if(isdigit(u))
+        return 0;
+    if(islower(u))
+        return 1;
+    if(isupper(u))
+        return 2;
+
+    return -1;
+}
+
+static bool key_position(char c, int *x, int *y, bool *shifted)
+{
+    for(int row = 0; row < KEYBOARD_ROWS; row++)
+    {
+        for(int shift = 0; shift < 2; shift++)
+        {
+            const char *key = strchr(keyboard_rows[row][shift], c);
+
+            if(c != '\0' && key)
+            {
+                *x = keyboard_offsets[row] + 2 * (key - keyboard_rows[row][shift]);
+                *y = row;
+                *shifted = shift == 1;
+
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* Guesses of a keyboard walk of length keys with turns
+ * changes of direction.
+ */
+static double keyboard_guesses(int length, int turns)
+{
+    double guesses = 0;
+
+    for(int i = 2; i <= length; i++)
+    {
+        int max_turns = turns < i - 1 ? turns : i - 1;
+
+        for(int j = 1; j <= max_turns; j++)
+            guesses += n_choose_k(i - 1, j - 1) * KEYBOARD_KEYS * pow(KEYBOARD_DEGREE, j);
+    }
+
+    return guesses;
+}
+
+/* Undoes common character substitutions, like 4 for a and $ for s.
+ * Returns true if anything was substituted. One is read either
+ * as i or l.
+ */
+static bool unleet(const char *lowered, char *out, int length, char one)
+{
+    static const char *from = "4@8360!5$7+2";
+    static const char *to   = "aabegoissttz";
+    bool changed = false;
+
+    for(int i = 0; i < length; i++)
+    {
+        const char *p = strchr(from, lowered[i]);
+
+        out[i] = lowered[i];
+
+        if(lowered[i] == '1')
+        {
+            out[i] = one;
+            changed = true;
+        }
+        else if(lowered[i] != '\0' && p)
+        {
+            out[i] = to[p - from];
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+typedef struct _estimate
+{
+    /* log10 of guesses of the best split of each prefix */
+    double best[STRENGTH_MAX_LENGTH + 1];
+    int from[STRENGTH_MAX_LENGTH + 1];
+    int kind[STRENGTH_MAX_LENGTH + 1];
+    int length;
+
+} Estimate_t;
+
+static void relax(Estimate_t *e, int start, int end, double guesses, int kind)
+{
+    double cost;
+
+    //Whole password may be as cheap as it gets, parts may not
+    if(kind != PATTERN_BRUTEFORCE && (start > 0 || end < e->length) &&
+       guesses < MIN_SUBMATCH_GUESSES)
+        guesses = MIN_SUBMATCH_GUESSES;
+
+    cost = e->best[start] + log10(guesses);
+
+    if(cost < e->best[end])
+    {
+        e->best[end] = cost;
+        e->from[end] = start;
+        e->kind[end] = kind;
+    }
+}
+
+static double estimate(Dictionary_t *dict, const char *password, int length,
+                       int *patterns);
+
+static void match_dictionary(Dictionary_t *dict, Estimate_t *e,
+                             const char *password, const char *lowered,
+                             const char *leet_i, const char *leet_l,
+                             bool leet, int i)
+{
+    //Substituted words take a few more guesses
+    const char *variants[] = { lowered, leet_i, leet_l };
+    const double multipliers[] = { 1, 2, 2 };
+    bool active[] = { true, leet, leet };
+
+    for(int end = i + 3; end <= e->length && end - i <= (int)dict->max_length; end++)
+    {
+        bool any = false;
+
+        for(int v = 0; v < 3; v++)
+        {
+            const char *word = variants[v] + i;
+            uint32_t rank;
+
+            if(!active[v])
+                continue;
+
+            //Nothing substituted, same as the plain word
+            if(v > 0 && memcmp(word, lowered + i, end - i) == 0)
+                continue;
+
+            rank = dictionary_rank(dict, word, end - i, &active[v]);
+
+            if(rank > 0)
+                relax(e, i, end, rank * multipliers[v] *
+                      case_variations(password, i, end), PATTERN_DICTIONARY);
+
+            any = any || active[v];
+        }
+
+        if(!any)
+            break;
+    }
+}
+
+static void match_sequence(Estimate_t *e, const char *password, int i)
+{
+    int delta;
+    int class = char_class(password[i]);
+    double base;
+
+    if(i + 2 >= e->length || class == -1)
+        return;
+
+    delta = (unsigned char)password[i + 1] - (unsigned char)password[i];
+
+    if(delta == 0 || delta < -5 || delta > 5)
+        return;
+
+    if(strchr("aAzZ019", password[i]))
+        base = 4;
+    else if(class == 0)
+        base = 10;
+    else
+        base = 26;
+
+    //Descending sequences are tried after ascending ones
+    if(delta < 0)
+        base *= 2;
+
+    for(int end = i + 1; end < e->length; end++)
+    {
+        if(char_class(password[end]) != class ||
+           (unsigned char)password[end] - (unsigned char)password[end - 1] != delta)
+            break;
+
+        if(end + 1 - i >= 3)
+            relax(e, i, end + 1, base * (end + 1 - i), PATTERN_SEQUENCE);
+    }
+}
+
+static void match_repeat(Dictionary_t *dict, Estimate_t *e,
+                         const char *password, int i)
+{
+    int end;
+
+    //Same character repeated
+    for(end = i + 1; end < e->length && password[end] == password[i]; end++)
+    {
+        if(end + 1 - i >= 3)
+            relax(e, i, end + 1, cardinality(password[i]) * (end + 1 - i),
+                  PATTERN_REPEAT);
+    }
+
+    //Shortest block of several characters repeated
+    for(int block = 2; i + 2 * block <= e->length; block++)
+    {
+        int repeats = 1;
+        double guesses;
+        int unused;
+
+        while(i + (repeats + 1) * block <= e->length &&
+              memcmp(password + i, password + i + repeats * block, block) == 0)
+            repeats++;
+
+        if(repeats < 2)
+            continue;
+
+        guesses = pow(10, estimate(dict, password + i, block, &unused));
+        relax(e, i, i + repeats * block, guesses * repeats, PATTERN_REPEAT);
+        break;
+    }
+}
+
+static void match_keyboard(Estimate_t *e, const char *password, int i)
+{
+    int x, y, last_x, last_y;
+    int dx = 0, dy = 0;
+    int turns = 0;
+    int shifted = 0;
+    bool shift;
+
+    if(!key_position(password[i], &last_x, &last_y, &shift))
+        return;
+
+    shifted += shift;
+
+    for(int end = i + 1; end < e->length; end++)
+    {
+        int ndx, ndy;
+
+        if(!key_position(password[end], &x, &y, &shift))
+            break;
+
+        ndx = x - last_x;
+        ndy = y - last_y;
+
+        if(ndy < -1 || ndy > 1 || (ndy == 0 && abs(ndx) != 2) ||
+           (ndy != 0 && abs(ndx) != 1))
+            break;
+
+        if(ndx != dx || ndy != dy)
+            turns++;
+
+        dx = ndx;
+        dy = ndy;
+        last_x = x;
+        last_y = y;
+        shifted += shift;
+
+        if(end + 1 - i >= 3)
+        {
+            int keys = end + 1 - i;
+
+            relax(e, i, end + 1, keyboard_guesses(keys, turns) *
+                  variations(shifted, keys - shifted) * (shifted == keys ? 2 : 1),
+                  PATTERN_KEYBOARD);
+        }
+    }
+}
+
+static void match_year(Dictionary_t *dict, Estimate_t *e,
+                       const char *password, int i)
+{
+    int year = 0;
+
+    if(i + 4 > e->length)
+        return;
+
+    for(int j = i; j < i + 4; j++)
+    {
+        if(!isdigit((unsigned char)password[j]))
+            return;
+
+        year = year * 10 + password[j] - '0';
+    }
+
+    if(year >= 1900 && year <= 2099)
+    {
+        int distance = abs(year - dict->year);
+
+        relax(e, i, i + 4, distance < 20 ? 20 : distance, PATTERN_YEAR);
+    }
+}
+
+/* Returns log10 of guesses needed for the first length bytes of
+ * password, at most STRENGTH_MAX_LENGTH. Patterns of the best
+ * split are stored into patterns.
+ */
+static double estimate(Dictionary_t *dict, const char *password, int length,
+                       int *patterns)
+{
+    Estimate_t e;
+    char lowered[STRENGTH_MAX_LENGTH];
+    char leet_i[STRENGTH_MAX_LENGTH];
+    char leet_l[STRENGTH_MAX_LENGTH];
+    bool leet;
+
+    e.length = length;
+    e.best[0] = 0;
+
+    for(int i = 1; i <= length; i++)
+        e.best[i] = HUGE_VAL;
+
+    for(int i = 0; i < length; i++)
+        lowered[i] = tolower((unsigned char)password[i]);
+
+    leet = unleet(lowered, leet_i, length, 'i');
+    unleet(lowered, leet_l, length, 'l');
+
+    //Every match starting at i is known once best[i] is final
+    for(int i = 0; i < length; i++)
+    {
+        relax(&e, i, i + 1, cardinality(password[i]), PATTERN_BRUTEFORCE);
+        match_dictionary(dict, &e, password, lowered, leet_i, leet_l, leet, i);
+        match_sequence(&e, password, i);
+        match_repeat(dict, &e, password, i);
+        match_keyboard(&e, password, i);
+        match_year(dict, &e, password, i);
+    }
+
+    *patterns = 0;
+
+    for(int end = length; end > 0; end = e.from[end])
+        *patterns |= e.kind[end];
+
+    memset(lowered, 0, sizeof(lowered));
+    memset(leet_i, 0, sizeof(leet_i));
+    memset(leet_l, 0, sizeof(leet_l));
+
+    return e.best[length];
+}
+
+/* Estimates strength of password. Dictionary is only read so
+ * several threads may estimate passwords at the same time.
+ */
+void strength_estimate(Dictionary_t *dict, const char *password,
+                       Strength_t *strength)
+{
+    size_t length = strlen(password);
+    double guesses = 0;
+
+    strength->patterns = 0;
+
+    if(length > STRENGTH_MAX_LENGTH)
+    {
+        //Rest of a very long password is counted as random characters
+        for(size_t i = STRENGTH_MAX_LENGTH; i < length; i++)
+            guesses += log10(cardinality(password[i]));
+
+        strength->patterns |= PATTERN_BRUTEFORCE;
+
+        length = STRENGTH_MAX_LENGTH;
+    }
+
+    if(length > 0)
+    {
+        int patterns;
+
+        guesses += estimate(dict, password, length, &patterns);
+        strength->patterns |= patterns;
+    }
+
+    strength->guesses_log10 = guesses;
+
+    if(guesses < 3)
+        strength->score = 0;
+    else if(guesses < 6)
+        strength->score = 1;
+    else if(guesses < 8)
+        strength->score = 2;
+    else if(guesses < 10)
+        strength->score = 3;
+    else
+        strength->score = 4;
+}
+
+/* Writes comma separated names of patterns into buf */
+void strength_pattern_names(int patterns, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = '\0';
+
+    for(int i = 0; i < PATTERN_COUNT; i++)
+    {
+        if(!(patterns & (1 << i)))
+            continue;
+
+        len += snprintf(buf + len, len < size ? size - len : 0, "%s%s",
+                        len > 0 ? "," : "", pattern_names[i]);
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __STRENGTH_H
+#define __STRENGTH_H
+
+/* Patterns found in a password, bit mask */
+#define PATTERN_DICTIONARY (1 << 0)
+#define PATTERN_SEQUENCE   (1 << 1)
+#define PATTERN_REPEAT     (1 << 2)
+#define PATTERN_KEYBOARD   (1 << 3)
+#define PATTERN_YEAR       (1 << 4)
+/* Characters not part of any other pattern */
+#define PATTERN_BRUTEFORCE (1 << 5)
+#define PATTERN_COUNT      (6)
+
+/* Only this many bytes of a password are matched against
+ * patterns, the rest is counted as random characters.
+ */
+#define STRENGTH_MAX_LENGTH (256)
+
+/* Word of the dictionary with the number of guesses
+ * an attacker needs to find it.
+ */
+typedef struct _dict_word
+{
+    const char *word;
+    uint32_t length;
+    uint32_t rank;
+
+} Dict_word_t;
+
+/* Sorted dictionary shared read only by every thread
+ * estimating passwords.
+ */
+typedef struct _dictionary
+{
+    Wordlist_t list;
+    Dict_word_t *words;
+    uint32_t count;
+    uint32_t max_length;
+    int year;
+
+} Dictionary_t;
+
+typedef struct _strength
+{
+    /* 0 (too guessable) to 4 (very unguessable) */
+    int score;
+    double guesses_log10;
+    /* PATTERN_* bits of the best guess */
+    int patterns;
+
+} Strength_t;
+
+bool dictionary_open(Dictionary_t *dict);
+void dictionary_close(Dictionary_t *dict);
+void strength_estimate(Dictionary_t *dict, const char *password,
+                       Strength_t *strength);
+void strength_pattern_names(int patterns, char *buf, size_t size);
+
+#endif
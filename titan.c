@@ -5,17 +5,96 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <getopt.h>
-#include "cmd_ui.h"
 #include "entry.h"
+#include "format.h"
+#include "state.h"
 #include "db.h"
+#include "cmd_ui.h"
 #include "utils.h"
 #include "pwd-gen.h"
 #include "crypto.h"
+#include "stats.h"
+
+static State_t state;
+static int reverse = 0;
+static Pwd_policy_t pwd_policy = { PWD_CLASS_ALL, 0 };
+
+/* Long only options taking an argument */
+#define OPT_FORMAT (256)
+#define OPT_FIELDS (257)
+#define OPT_LIMIT  (258)
+#define OPT_OFFSET (259)
+#define OPT_SORT   (260)
+#define OPT_VAULT  (261)
+#define OPT_LIST_VAULTS (262)
+#define OPT_FIND_ALL (263)
+#define OPT_COUNT    (264)
+#define OPT_CLASSES  (265)
+#define OPT_REQUIRE  (266)
+#define OPT_WORDS    (267)
+#define OPT_SEPARATOR (268)
+#define OPT_AUDIT    (269)
+#define OPT_STATS    (270)
+#define OPT_SERVE    (271)
+#define OPT_MERGE    (272)
+#define OPT_CHANGED_SINCE (273)
+#define OPT_ATTACH   (274)
+#define OPT_EXTRACT  (275)
+#define OPT_TAG      (276)
+#define OPT_WITH_TAG (277)
+
+static const char *short_options = "i:d:ear:f:c:l:Asu:hVg:q:x:";
 
-static int show_password = 0;
-static int force = 0;
-static int auto_encrypt = 0;
+static struct option long_options[] =
+{
+    {"init",                  required_argument, 0, 'i'},
+    {"decrypt",               required_argument, 0, 'd'},
+    {"encrypt",               no_argument,       0, 'e'},
+    {"add",                   no_argument,       0, 'a'},
+    {"remove",                required_argument, 0, 'r'},
+    {"find",                  required_argument, 0, 'f'},
+    {"edit",                  required_argument, 0, 'c'},
+    {"list-entry",            required_argument, 0, 'l'},
+    {"use-db",                required_argument, 0, 'u'},
+    {"list-all",              no_argument,       0, 'A'},
+    {"help",                  no_argument,       0, 'h'},
+    {"version",               no_argument,       0, 'V'},
+    {"show-db-path",          no_argument,       0, 's'},
+    {"gen-password",          required_argument, 0, 'g'},
+    {"quick",                 required_argument, 0, 'q'},
+    {"export",                required_argument, 0, 'x'},
+    {"format",                required_argument, 0, OPT_FORMAT},
+    {"fields",                required_argument, 0, OPT_FIELDS},
+    {"limit",                 required_argument, 0, OPT_LIMIT},
+    {"offset",                required_argument, 0, OPT_OFFSET},
+    {"sort",                  required_argument, 0, OPT_SORT},
+    {"reverse",               no_argument,       &reverse, 1},
+    {"vault",                 required_argument, 0, OPT_VAULT},
+    {"list-vaults",           no_argument,       0, OPT_LIST_VAULTS},
+    {"find-all",              required_argument, 0, OPT_FIND_ALL},
+    {"count",                 required_argument, 0, OPT_COUNT},
+    {"classes",               required_argument, 0, OPT_CLASSES},
+    {"require",               required_argument, 0, OPT_REQUIRE},
+    {"words",                 required_argument, 0, OPT_WORDS},
+    {"separator",             required_argument, 0, OPT_SEPARATOR},
+    {"audit",                 required_argument, 0, OPT_AUDIT},
+    {"stats",                 optional_argument, 0, OPT_STATS},
+    {"serve",                 required_argument, 0, OPT_SERVE},
+    {"merge",                 required_argument, 0, OPT_MERGE},
+    {"changed-since",         required_argument, 0, OPT_CHANGED_SINCE},
+    {"attach",                required_argument, 0, OPT_ATTACH},
+    {"extract",               required_argument, 0, OPT_EXTRACT},
+    {"tag",                   required_argument, 0, OPT_TAG},
+    {"with-tag",              required_argument, 0, OPT_WITH_TAG},
+    {"auto-encrypt",          no_argument,       &state.auto_encrypt,  1},
+    {"show-passwords",        no_argument,       &state.show_password, 1},
+    {"force",                 no_argument,       &state.force, 1},
+    {"profile-sql",           no_argument,       &state.profile_sql, 1},
+    {"explain",               no_argument,       &state.explain, 1},
+    {0, 0, 0, 0}
+};
 
 static void version()
 {
@@ -32,20 +111,68 @@ SYNOPSIS\n\
 OPTIONS\n\
 \n\
     -i --init         <path>         Initialize new database\n\
-    -e --encrypt                     Encrypt current database\n\
+    -e --encrypt                     Encrypt current database. Changes are\n\
+                                     appended to <path>.journal, copy it\n\
+                                     along with the database\n\
     -d --decrypt      <path>         Decrypt database\n\
     -a --add                         Add new entry\n\
     -s --show-db-path                Show current database path\n\
+    --list-vaults                    List unlocked vaults and their paths\n\
     -u --use-db                      Switch using another database\n\
     -r --remove       <id>           Remove entry pointed by id\n\
-    -f --find         <search>       Search entries\n\
+    -f --find         <search>       Search entries, see SEARCH\n\
+    --find-all        <search> [vault...]\n\
+                                     Search several vaults concurrently.\n\
+                                     Vaults are names of unlocked vaults or\n\
+                                     database paths, all unlocked vaults\n\
+                                     are searched if none are given\n\
     -c --edit         <id>           Edit entry pointed by id\n\
     -l --list-entry   <id>           List entry pointed by id\n\
+    --attach          <id> <file>    Attach file to entry pointed by id,\n\
+                                     replacing an attachment of the same name\n\
+    --extract         <id> <name>    Write attachment name of entry pointed\n\
+                                     by id to standard output\n\
     -A --list-all                    List all entries\n\
+    --changed-since   <time>         List entries changed or deleted since\n\
+                                     time, as seconds since the epoch or\n\
+                                     \"YYYY-MM-DD[ HH:MM[:SS]]\" local time.\n\
+                                     JSON lines by default, deleted entries\n\
+                                     have change \"deleted\" and no values\n\
+    --audit           strength       Estimate strength of every password,\n\
+                                     weakest first. Score is from 0 (too\n\
+                                     guessable) to 4 (very unguessable)\n\
+    --audit           reuse          List groups of entries sharing the same\n\
+                                     password, largest groups first\n\
+    --audit           breached <hashfile>\n\
+                                     List entries whose password is in the\n\
+                                     sorted SHA-1 hash file, such as the\n\
+                                     Have I Been Pwned password dump. An\n\
+                                     index is saved as <hashfile>.idx\n\
+    --serve           <socket>       Answer requests for the database on a\n\
+                                     Unix socket until interrupted. Requests\n\
+                                     are lines \"get <id>\", \"find <search>\"\n\
+                                     or \"list\", answered with JSON lines\n\
+                                     ending in a status line. The database\n\
+                                     is held in memory and read again when\n\
+                                     it changes, requests are refused once\n\
+                                     it is encrypted. See --fields,\n\
+                                     --sort, --limit and --show-passwords\n\
+    --merge           <other> [base] Merge changes of another decrypted copy\n\
+                                     of the database into this one. With the\n\
+                                     common ancestor copy as base, entries\n\
+                                     changed on one side only merge without\n\
+                                     conflicts and deletions are kept.\n\
+                                     Copies must be made from the same\n\
+                                     vault after upgrading to this version\n\
     -h --help                        Show short help and exit. This page\n\
-    -g --gen-password <length>       Generate password\n\
+    -g --gen-password <length>       Generate password. See --count,\n\
+                                     --classes and --require\n\
+    --words           <count>        Generate diceware passphrase of count\n\
+                                     words. See --separator and --count\n\
     -q --quick        <search>       This is the same as running\n\
                                      --auto-encrypt --show-passwords -f\n\
+    -x --export       <file>         Export all entries into file, use - for\n\
+                                     stdout. See --format and --fields\n\
 \n\
     -V --version                     Show version number of program\n\
 \n\
@@ -53,8 +180,75 @@ FLAGS\n\
 \n\
     --auto-encrypt                   Automatically encrypt after exit\n\
     --show-passwords                 Show passwords in listings\n\
+    --vault           <name>         Run the command against the named vault.\n\
+                                     Each vault can have its own database\n\
+                                     decrypted at the same time. Default\n\
+                                     vault is used if not given\n\
     --force                          Ignore everything and force operation\n\
                                      --force only works with --init option\n\
+    --format          <format>       Output format for listings and export:\n\
+                                     text, table, json, jsonl, tsv or csv.\n\
+                                     Listings default to text, export to jsonl\n\
+    --fields          <list>         Comma separated list of fields to output\n\
+                                     id,title,user,url,password,notes,modified\n\
+    --sort            <field>        Sort listings by id (default), title,\n\
+                                     url or modified\n\
+    --reverse                        Reverse the sort order\n\
+    --limit           <count>        Output at most count entries\n\
+    --offset          <count>        Skip count entries before output\n\
+    --with-tag        <list>         List and search only entries having\n\
+                                     every tag of the comma separated list\n\
+    --tag             <list>         Replace tags of the added or edited\n\
+                                     entry with the comma separated list\n\
+    --count           <count>        Number of passwords or passphrases\n\
+                                     to generate\n\
+    --separator       <string>       Separator between passphrase words.\n\
+                                     Default is a space\n\
+    --classes         <list>         Comma separated list of character\n\
+                                     classes for generated passwords:\n\
+                                     lower,upper,digit,symbol (default all)\n\
+    --require         <list>         Character classes every generated\n\
+                                     password must contain\n\
+    --stats[=json]                   Print time spent in key derivation,\n\
+                                     encryption, file I/O, locking and\n\
+                                     queries, bytes read and written, pages\n\
+                                     read by sqlite, allocations and peak\n\
+                                     memory use to stderr on exit\n\
+    --profile-sql                    Print time, rows, VM steps, full scan\n\
+                                     steps, sorts and automatic indexes of\n\
+                                     every SQL statement to stderr\n\
+    --explain                        Print the query plan of every query\n\
+                                     to stderr before running it\n\
+\n\
+SEARCH\n\
+\n\
+    Searches are space separated terms, entries must match all of them.\n\
+    Fields are title, user, url and notes, matching ignores case\n\
+\n\
+    word                             Word in any field\n\
+    field:text                       Text in field\n\
+    field:pattern                    Whole field matches pattern, * is any\n\
+                                     text and ? any character\n\
+    field=text                       Field is text\n\
+    tag:name                         Entry has the tag\n\
+    modified>time                    Also <, <=, >= and =, time as in\n\
+                                     --changed-since\n\
+    -term                            Entry does not match term\n\
+\n\
+    For example: title:gitlab user:deploy url:*.corp -tag:old\n\
+    \"modified>2026-01-01\"\n\
+\n\
+ENVIRONMENT\n\
+\n\
+    TITAN_LOCK_TIMEOUT               Milliseconds to wait for another Titan\n\
+                                     process to release the database.\n\
+                                     Default is 10000\n\
+    TITAN_WORDLIST                   Wordlist for passphrases, one word or\n\
+                                     diceware line per line. Default is\n\
+                                     /usr/share/titan/eff_large_wordlist.txt\n\
+                                     or the built in list if it's missing\n\
+    TITAN_STATS                      Same as --stats when set to 1, text\n\
+                                     or json\n\
 \n\
 For more information and examples see man titan(1).\n\
 \n\
@@ -64,9 +258,104 @@ AUTHORS\n\
     printf(HELP);
 }
 
+/* Flags and settings such as --format apply to every command on the
+ * command line no matter where they are given, so collect them in a
+ * separate pass before running any of the commands.
+ */
+static bool parse_settings(int argc, char *argv[])
+{
+    int c;
+
+    opterr = 0;
+
+    while((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1)
+    {
+        switch(c)
+        {
+        case OPT_FORMAT:
+            state.format = optarg;
+            break;
+        case OPT_FIELDS:
+            state.fields = optarg;
+            break;
+        case OPT_LIMIT:
+            state.list_options.limit = atoi(optarg);
+            break;
+        case OPT_OFFSET:
+            state.list_options.offset = atoi(optarg);
+            break;
+        case OPT_VAULT:
+            state.vault_name = optarg;
+
+            if(!state_valid_vault_name(optarg))
+            {
+                fprintf(stderr, "Invalid vault name.\n");
+                return false;
+            }
+            break;
+        case OPT_SORT:
+            state.list_options.sort = db_sort_from_name(optarg);
+
+            if(state.list_options.sort == -1)
+            {
+                fprintf(stderr, "Cannot sort by %s.\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_COUNT:
+            state.count = atoi(optarg);
+
+            if(state.count < 1)
+            {
+                fprintf(stderr, "Count must be at least one.\n");
+                return false;
+            }
+            break;
+        case OPT_SEPARATOR:
+            state.separator = optarg;
+            break;
+        case OPT_TAG:
+            state.tags = optarg;
+            break;
+        case OPT_WITH_TAG:
+            state.list_options.with_tags = optarg;
+            break;
+        case OPT_STATS:
+            if(!stats_enable(optarg))
+                return false;
+            break;
+        case OPT_CLASSES:
+            pwd_policy.classes = pwd_classes_parse(optarg);
+
+            if(pwd_policy.classes == -1)
+                return false;
+            break;
+        case OPT_REQUIRE:
+            pwd_policy.required = pwd_classes_parse(optarg);
+
+            if(pwd_policy.required == -1)
+                return false;
+            break;
+        }
+    }
+
+    state.list_options.reverse = reverse == 1;
+
+    opterr = 1;
+    optind = 0;
+
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     int c;
+    char *find_all_search = NULL;
+    bool audit_breached = false;
+    char *merge_other = NULL;
+    char *attach_id = NULL;
+    char *extract_id = NULL;
+    int status = EXIT_SUCCESS;
 
     if(argc == 1)
     {
@@ -74,34 +363,21 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if(getenv("TITAN_STATS"))
+        stats_enable(getenv("TITAN_STATS"));
+
+    state_init(&state);
+
+    if(!parse_settings(argc, argv))
+        return 1;
+
+    state_load(&state);
+
     while(true)
     {
-        static struct option long_options[] =
-        {
-            {"init",                  required_argument, 0, 'i'},
-            {"decrypt",               required_argument, 0, 'd'},
-            {"encrypt",               no_argument,       0, 'e'},
-            {"add",                   no_argument,       0, 'a'},
-            {"remove",                required_argument, 0, 'r'},
-            {"find",                  required_argument, 0, 'f'},
-            {"edit",                  required_argument, 0, 'c'},
-            {"list-entry",            required_argument, 0, 'l'},
-            {"use-db",                required_argument, 0, 'u'},
-            {"list-all",              no_argument,       0, 'A'},
-            {"help",                  no_argument,       0, 'h'},
-            {"version",               no_argument,       0, 'V'},
-            {"show-db-path",          no_argument,       0, 's'},
-            {"gen-password",          required_argument, 0, 'g'},
-            {"quick",                 required_argument, 0, 'q'},
-            {"auto-encrypt",          no_argument,       &auto_encrypt,  1},
-            {"show-passwords",        no_argument,       &show_password, 1},
-            {"force",                 no_argument,       &force, 1},
-            {0, 0, 0, 0}
-        };
-
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "i:d:ear:f:c:l:Asu:hVg:q:", long_options, &option_index);
+        c = getopt_long(argc, argv, short_options, long_options, &option_index);
 
         if(c == -1)
             break;
@@ -111,58 +387,150 @@ int main(int argc, char *argv[])
         case 0:
             /* Handle flags here automatically */
             break;
+        case OPT_FORMAT:
+        case OPT_FIELDS:
+        case OPT_LIMIT:
+        case OPT_OFFSET:
+        case OPT_SORT:
+        case OPT_VAULT:
+        case OPT_COUNT:
+        case OPT_CLASSES:
+        case OPT_REQUIRE:
+        case OPT_SEPARATOR:
+        case OPT_TAG:
+        case OPT_WITH_TAG:
+        case OPT_STATS:
+            /* Already handled by parse_settings */
+            break;
+        case OPT_LIST_VAULTS:
+            list_vaults(&state);
+            break;
+        case OPT_AUDIT:
+            //Hash file is the remaining argument, run after parsing
+            if(strcmp(optarg, "breached") == 0)
+                audit_breached = true;
+            else
+                audit(&state, optarg, NULL);
+            break;
+        case OPT_SERVE:
+            serve(&state, optarg);
+            break;
+        case OPT_CHANGED_SINCE:
+            changed_since(&state, optarg);
+            break;
+        case OPT_ATTACH:
+            //File is the remaining argument, run after parsing
+            attach_id = optarg;
+            break;
+        case OPT_EXTRACT:
+            //Name is the remaining argument, run after parsing
+            extract_id = optarg;
+            break;
+        case OPT_MERGE:
+            //Base is the remaining argument, run after parsing
+            merge_other = optarg;
+            break;
+        case OPT_WORDS:
+            generate_passphrases(atoi(optarg), state.separator, state.count);
+            break;
+        case OPT_FIND_ALL:
+            //Vaults are the remaining arguments, run after parsing
+            find_all_search = optarg;
+            break;
         case 'i':
-            init_database(optarg, force, auto_encrypt);
+            init_database(&state, optarg);
             break;
         case 'd': //decrypt
-            decrypt_database(optarg);
+            decrypt_database(&state, optarg);
             break;
         case 'e': //encrypt
-            encrypt_database();
+            if(!encrypt_database(&state))
+                status = EXIT_FAILURE;
             break;
         case 'a':
-            add_new_entry(auto_encrypt);
+            add_new_entry(&state);
             break;
         case 's':
-            show_current_db_path();
+            show_current_db_path(&state);
             break;
         case 'h':
             usage();
             break;
         case 'r':
-            remove_entry(atoi(optarg), auto_encrypt);
+            remove_entry(&state, atoi(optarg));
             break;
         case 'u':
-            set_use_db(optarg);
+            set_use_db(&state, optarg);
+            break;
         case 'f':
-            find(optarg, show_password, auto_encrypt);
+            find(&state, optarg);
             break;
         case 'c':
-            edit_entry(atoi(optarg), auto_encrypt);
+            edit_entry(&state, atoi(optarg));
             break;
         case 'l':
-            list_by_id(atoi(optarg), show_password, auto_encrypt);
+            list_by_id(&state, atoi(optarg));
             break;
         case 'A':
-            list_all(show_password, auto_encrypt);
+            list_all(&state);
             break;
         case 'V':
             version();
             break;
         case 'g':
-            generate_password(atoi(optarg));
+            generate_passwords(&pwd_policy, atoi(optarg), state.count);
             break;
         case 'q':
-            auto_encrypt = 1;
-            show_password = 1;
-            find(optarg, show_password, auto_encrypt); //TODO: implement auto_encrypt. it's only possible to use it if database is encrypted
+            state.auto_encrypt = 1;
+            state.show_password = 1;
+            find(&state, optarg); //TODO: implement auto_encrypt. it's only possible to use it if database is encrypted
             //first decrypt, then keep the passphrase in a stack and use it to encrypt after the operation
             break;
+        case 'x':
+            if(!export_database(&state, optarg))
+                status = EXIT_FAILURE;
+            break;
         case '?':
             usage();
             break;
         }
     }
 
-    return 0;
+    if(audit_breached)
+    {
+        if(optind < argc)
+            audit(&state, "breached", argv[optind]);
+        else
+            fprintf(stderr, "Hash file is missing.\n");
+    }
+
+    if(attach_id)
+    {
+        if(optind < argc)
+            attach_file(&state, atoi(attach_id), argv[optind]);
+        else
+            fprintf(stderr, "File to attach is missing.\n");
+    }
+
+    if(extract_id)
+    {
+        if(optind < argc)
+            extract_file(&state, atoi(extract_id), argv[optind]);
+        else
+            fprintf(stderr, "Attachment name is missing.\n");
+    }
+
+    if(merge_other)
+        merge(&state, merge_other, optind < argc ? argv[optind] : NULL);
+
+    if(find_all_search)
+    {
+        find_all(&state, find_all_search, argc - optind,
+                 optind < argc ? argv + optind : NULL);
+    }
+
+    stats_print();
+    state_free(&state);
+
+    return status;
 }
@@ -8,9 +8,10 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include "utils.h"
-#include "crypto.h"
+#include "stats.h"
 
 bool file_exists(const char *path)
 {
@@ -22,139 +23,75 @@ bool file_exists(const char *path)
     return true;
 }
 
-/* Function checks that we have a valid path
- * in our lock file and if the database is not
- * encrypted.
- */
-bool has_active_database()
+//Simple malloc wrapper to prevent enormous error
+//checking every where in the code
+void *tmalloc(size_t size)
 {
-    char *path = NULL;
-
-    path = get_lockfile_path();
-
-    if(!path)
-        return false;
-
-    struct stat buf;
+    void *data = NULL;
 
-    if(stat(path, &buf) != 0)
-    {
-        free(path);
-        return false;
-    }
+    data = malloc(size);
 
-    //If the database is encrypted, it's not active so return false
-    if(is_file_encrypted(path))
+    if(data == NULL)
     {
-        free(path);
-        return false;
+        fprintf(stderr, "Malloc failed. Abort.\n");
+        abort();
     }
 
-    free(path);
+    stats_add(STATS_ALLOCATIONS, 1);
+    stats_add(STATS_ALLOCATED_BYTES, size);
 
-    return true;
-}
-
-/* Returns the path of ~/.titan.lock file.
- * Caller must free the return value */
-char *get_lockfile_path()
-{
-    char *home = NULL;
-    char *path = NULL;
-
-    home = getenv("HOME");
-
-    if(!home)
-        return NULL;
-
-    /* /home/user/.titan.lock */
-    path = tmalloc(sizeof(char) * (strlen(home) + 13));
-
-    strcpy(path, home);
-    strcat(path, "/.titan.lock");
-
-    return path;
+    return data;
 }
 
-/* Reads and returns the path of currently decrypted
- * database. Caller must free the return value */
-char *read_active_database_path()
+//Same for realloc, data is NULL or returned by tmalloc or trealloc
+void *trealloc(void *data, size_t size)
 {
-    FILE *fp = NULL;
-    char *path = NULL;
-    char *lockpath = NULL;
-    size_t len;
-
-    path = get_lockfile_path();
+    data = realloc(data, size);
 
-    if(!path)
-        return NULL;
-
-    fp = fopen(path, "r");
-
-    if(!fp)
-    {
-        free(path);
-        return NULL;
-    }
-
-    /* We only need the first line from the file */
-
-    if(getline(&lockpath, &len, fp) < 0)
+    if(data == NULL)
     {
-        if(lockpath)
-            free(lockpath);
-
-        fclose(fp);
-        free(path);
-
-        return NULL;
+        fprintf(stderr, "Malloc failed. Abort.\n");
+        abort();
     }
 
-    fclose(fp);
-    free(path);
+    stats_add(STATS_ALLOCATIONS, 1);
+    stats_add(STATS_ALLOCATED_BYTES, size);
 
-    return lockpath;
+    return data;
 }
 
-void write_active_database_path(const char *db_path)
+/* Parses seconds since the epoch or local time as
+ * "YYYY-MM-DD[ HH:MM[:SS]]".
+ */
+bool parse_time(const char *str, long long *time)
 {
-    FILE *fp = NULL;
-    char *path = NULL;
+    static const char *formats[] =
+    {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d", NULL
+    };
 
-    path = get_lockfile_path();
+    char *end;
 
-    if(!path)
-        return;
+    *time = strtoll(str, &end, 10);
 
-    fp = fopen(path, "w");
+    if(end != str && *end == '\0')
+        return true;
 
-    if(!fp)
+    for(int i = 0; formats[i]; i++)
     {
-        fprintf(stderr, "Error creating lock file\n");
-        free(path);
-        return;
-    }
+        struct tm tm;
 
-    fprintf(fp, "%s", db_path);
-    fclose(fp);
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(str, formats[i], &tm);
 
-    free(path);
-}
-
-//Simple malloc wrapper to prevent enormous error
-//checking every where in the code
-void *tmalloc(size_t size)
-{
-    void *data = NULL;
+        if(end && *end == '\0')
+        {
+            tm.tm_isdst = -1;
+            *time = mktime(&tm);
 
-    data = malloc(size);
-
-    if(data == NULL)
-    {
-        fprintf(stderr, "Malloc failed. Abort.\n");
-        abort();
+            return *time != -1;
+        }
     }
 
-    return data;
+    return false;
 }
@@ -8,11 +8,9 @@
 
 #include <stdbool.h>
 
-char *get_lockfile_path();
-void write_active_database_path(const char *db_path);
-char *read_active_database_path();
-bool has_active_database();
 void *tmalloc(size_t size);
+void *trealloc(void *data, size_t size);
 bool file_exists(const char *path);
+bool parse_time(const char *str, long long *time);
 
 #endif
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "wordlist.h"
+
+/* Built into the program from wordlist.txt by the Makefile, used when
+ * no wordlist file is installed.
+ */
+static const char builtin_words[] =
+#include "wordlist.inc"
+;
+
+/* Builds the word index in a single pass over the data. Lines are
+ * either plain words or diceware lines where the word follows the
+ * dice numbers, like in the EFF lists.
+ */
+static bool build_index(Wordlist_t *list)
+{
+    const char *p = list->data;
+    const char *end = list->data + list->size;
+    uint32_t alloc = 0;
+
+    list->words = NULL;
+    list->count = 0;
+
+    while(p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *word;
+
+        if(!eol)
+            eol = end;
+
+        word = p;
+
+        while(word < eol && isdigit((unsigned char)*word))
+            word++;
+
+        while(word < eol && isspace((unsigned char)*word))
+            word++;
+
+        //Lines without dice numbers are words as is
+        if(word == eol)
+            word = p;
+
+        const char *word_end = eol;
+
+        while(word_end > word && isspace((unsigned char)word_end[-1]))
+            word_end--;
+
+        if(word_end > word)
+        {
+            if(list->count == alloc)
+            {
+                alloc = alloc ? alloc * 2 : 8192;
+                list->words = trealloc(list->words, alloc * sizeof(Word_t));
+            }
+
+            list->words[list->count].offset = word - list->data;
+            list->words[list->count].length = word_end - word;
+            list->count++;
+        }
+
+        p = eol + 1;
+    }
+
+    if(list->count < 2)
+    {
+        fprintf(stderr, "Wordlist does not contain enough words.\n");
+        free(list->words);
+        list->words = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/* Maps the wordlist from TITAN_WORDLIST or from the default location.
+ * Falls back to the built in list if the default file does not exist.
+ * A wordlist given with TITAN_WORDLIST must exist.
+ */
+bool wordlist_open(Wordlist_t *list)
+{
+    const char *path = getenv("TITAN_WORDLIST");
+    bool required = path != NULL;
+    struct stat st;
+    void *data;
+    int fd;
+
+    if(!path)
+        path = TITAN_WORDLIST;
+
+    list->data = builtin_words;
+    list->size = sizeof(builtin_words) - 1;
+    list->mapped = false;
+
+    fd = open(path, O_RDONLY);
+
+    if(fd == -1)
+    {
+        if(required)
+        {
+            fprintf(stderr, "Cannot open wordlist %s.\n", path);
+            return false;
+        }
+
+        return build_index(list);
+    }
+
+    if(fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > UINT32_MAX)
+    {
+        fprintf(stderr, "Invalid wordlist %s.\n", path);
+        close(fd);
+        return false;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(data == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map wordlist %s.\n", path);
+        return false;
+    }
+
+    list->data = data;
+    list->size = st.st_size;
+    list->mapped = true;
+
+    if(!build_index(list))
+    {
+        wordlist_close(list);
+        return false;
+    }
+
+    return true;
+}
+
+void wordlist_close(Wordlist_t *list)
+{
+    if(list->mapped)
+        munmap((void *)list->data, list->size);
+
+    free(list->words);
+
+    list->data = NULL;
+    list->words = NULL;
+    list->count = 0;
+    list->mapped = false;
+}
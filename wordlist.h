@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2017 Niko Rosvall <niko@byteptr.com>
+ */
+
+#ifndef __WORDLIST_H
+#define __WORDLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Wordlist used for passphrases when TITAN_WORDLIST is not set.
+ * The EFF large wordlist can be installed here as is.
+ */
+#define TITAN_WORDLIST "/usr/share/titan/eff_large_wordlist.txt"
+
+/* Position of a word inside the wordlist data */
+typedef struct _word
+{
+    uint32_t offset;
+    uint32_t length;
+
+} Word_t;
+
+/* Wordlist mapped into memory with an index of its words. Words are
+ * not copied, the index points into the mapped file or into the list
+ * built into the program.
+ */
+typedef struct _wordlist
+{
+    const char *data;
+    size_t size;
+    /* True if data is mapped and must be unmapped */
+    bool mapped;
+    Word_t *words;
+    uint32_t count;
+
+} Wordlist_t;
+
+bool wordlist_open(Wordlist_t *list);
+void wordlist_close(Wordlist_t *list);
+
+#endif